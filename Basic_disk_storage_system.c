@@ -1,255 +1,3556 @@
-// Basic_disk_storage_system.c
-// Disk server for Project 3 – Part 3
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <errno.h>
-#define BLOCK_SIZE 128
-#define BACKLOG 10
-
-static int num_cylinders;
-static int sectors_per_cylinder;
-static int seek_usec;
-static int disk_fd;
-
-static off_t get_offset(int c, int s) {
-    return ((off_t)c * sectors_per_cylinder + s) * BLOCK_SIZE;
-}
-
-static int valid_block(int c, int s) {
-    if (c < 0 || c >= num_cylinders) return 0;
-    if (s < 0 || s >= sectors_per_cylinder) return 0;
-    return 1;
-}
-
-static void simulate_seek(int new_cylinder, int *last_cylinder) {
-    int diff = abs(new_cylinder - *last_cylinder);
-    useconds_t sleep_time = (useconds_t)diff * (useconds_t)seek_usec;
-    if (sleep_time > 0) {
-        usleep(sleep_time);
-    }
-    *last_cylinder = new_cylinder;
-}
-
-static void handle_read(FILE *client, int *last_cylinder, int c, int s) {
-    if (!valid_block(c, s)) {
-        fputc('0', client);
-        fflush(client);
-        return;
-    }
-
-    simulate_seek(c, last_cylinder);
-
-    off_t offset = get_offset(c, s);
-    if (lseek(disk_fd, offset, SEEK_SET) < 0) {
-        perror("lseek (read)");
-        fputc('0', client);
-        fflush(client);
-        return;
-    }
-
-    unsigned char buf[BLOCK_SIZE];
-    ssize_t n = read(disk_fd, buf, BLOCK_SIZE);
-    if (n != BLOCK_SIZE) {
-        perror("read (disk)");
-        fputc('0', client);
-        fflush(client);
-        return;
-    }
-
-    // success: send '1' then 128 bytes
-    fputc('1', client);
-    fflush(client);
-
-    int client_fd = fileno(client);
-    ssize_t w = write(client_fd, buf, BLOCK_SIZE);
-    if (w != BLOCK_SIZE) {
-        perror("write (to client)");
-    }
-}
-
-static void handle_write(FILE *client, int *last_cylinder, char *line) {
-    int c, s, l;
-
-    // Parse "W c s l"
-    if (sscanf(line, "W %d %d %d", &c, &s, &l) != 3) {
-        fputc('0', client);
-        fflush(client);
-        return;
-    }
-
-    if (!valid_block(c, s) || l < 0 || l > BLOCK_SIZE) {
-        fputc('0', client);
-        fflush(client);
-        return;
-    }
-
-    int client_fd = fileno(client);
-    unsigned char buf[BLOCK_SIZE];
-    memset(buf, 0, sizeof(buf));
-
-    // Read exactly l bytes from client as data payload
-    ssize_t total = 0;
-    while (total < l) {
-        ssize_t r = read(client_fd, buf + total, l - total);
-        if (r <= 0) {
-            perror("read (write data from client)");
-            fputc('0', client);
-            fflush(client);
-            return;
-        }
-        total += r;
-    }
-
-    simulate_seek(c, last_cylinder);
-
-    off_t offset = get_offset(c, s);
-    if (lseek(disk_fd, offset, SEEK_SET) < 0) {
-        perror("lseek (write)");
-        fputc('0', client);
-        fflush(client);
-        return;
-    }
-
-    // Write full 128-byte block (zero-filled if l < 128)
-    ssize_t w = write(disk_fd, buf, BLOCK_SIZE);
-    if (w != BLOCK_SIZE) {
-        perror("write (disk)");
-        fputc('0', client);
-        fflush(client);
-        return;
-    }
-
-    fputc('1', client);
-    fflush(client);
-}
-
-static void handle_client(int client_sock) {
-    FILE *client = fdopen(client_sock, "r+");
-    if (!client) {
-        perror("fdopen");
-        close(client_sock);
-        return;
-    }
-
-    char line[1024];
-    int last_cylinder = 0;
-
-    while (fgets(line, sizeof(line), client) != NULL) {
-        if (line[0] == 'I') {
-            // Information request
-            fprintf(client, "%d %d\n", num_cylinders, sectors_per_cylinder);
-            fflush(client);
-        } else if (line[0] == 'R') {
-            int c, s;
-            if (sscanf(line, "R %d %d", &c, &s) != 2) {
-                fputc('0', client);
-                fflush(client);
-                continue;
-            }
-            handle_read(client, &last_cylinder, c, s);
-        } else if (line[0] == 'W') {
-            handle_write(client, &last_cylinder, line);
-        } else {
-            // Unknown command – ignore or send failure
-            fputc('0', client);
-            fflush(client);
-        }
-    }
-
-    fclose(client); // also closes client_sock
-}
-
-int main(int argc, char *argv[]) {
-    if (argc != 6) {
-        fprintf(stderr,
-                "Usage: %s <port> <num_cyl> <sec_per_cyl> <seek_usec> <disk_file>\n",
-                argv[0]);
-        return 1;
-    }
-
-    int port = atoi(argv[1]);
-    num_cylinders = atoi(argv[2]);
-    sectors_per_cylinder = atoi(argv[3]);
-    seek_usec = atoi(argv[4]);
-    const char *disk_file = argv[5];
-
-    if (num_cylinders <= 0 || sectors_per_cylinder <= 0 || seek_usec < 0) {
-        fprintf(stderr, "Invalid geometry or seek time.\n");
-        return 1;
-    }
-
-    off_t total_blocks = (off_t)num_cylinders * sectors_per_cylinder;
-    off_t file_size = total_blocks * BLOCK_SIZE;
-
-    // Open or create disk file and size it with ftruncate
-    disk_fd = open(disk_file, O_RDWR | O_CREAT, 0666);
-    if (disk_fd < 0) {
-        perror("open disk_file");
-        return 1;
-    }
-
-    if (ftruncate(disk_fd, file_size) < 0) {
-        perror("ftruncate disk_file");
-        close(disk_fd);
-        return 1;
-    }
-
-    // Set up listening socket
-    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) {
-        perror("socket");
-        close(disk_fd);
-        return 1;
-    }
-
-    int optval = 1;
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port);
-
-    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        close(listen_fd);
-        close(disk_fd);
-        return 1;
-    }
-
-    if (listen(listen_fd, BACKLOG) < 0) {
-        perror("listen");
-        close(listen_fd);
-        close(disk_fd);
-        return 1;
-    }
-
-    printf("Disk server listening on port %d\n", port);
-    printf("Geometry: %d cylinders, %d sectors/cylinder, block size %d\n",
-           num_cylinders, sectors_per_cylinder, BLOCK_SIZE);
-
-    while (1) {
-        int client_sock = accept(listen_fd, NULL, NULL);
-        if (client_sock < 0) {
-            perror("accept");
-            continue;
-        }
-
-        // Single-threaded for simplicity – handle one client at a time
-        handle_client(client_sock);
-    }
-
-    close(listen_fd);
-    close(disk_fd);
-    return 0;
-}
+// Basic_disk_storage_system.c
+// Disk server for Project 3 – Part 3
+
+#define _GNU_SOURCE              // fallocate, SEEK_DATA / SEEK_HOLE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "ioring.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "trace.h"
+#include "histogram.h"
+
+#define DEFAULT_BLOCK_SIZE 128
+#define MIN_BLOCK_SIZE 128
+#define MAX_BLOCK_SIZE 65536
+#define BACKLOG 10
+#define MAX_RANGE_BLOCKS 256       // largest RN/WN transfer, in blocks...
+#define MAX_RANGE_BYTES (1 << 20)  // ...and in bytes
+
+// I/O scheduling policies (selected with -s)
+#define SCHED_FCFS  0
+#define SCHED_SSTF  1
+#define SCHED_SCAN  2
+#define SCHED_CLOOK 3
+
+static const char *sched_names[] = { "fcfs", "sstf", "scan", "clook" };
+
+// Geometry and block size are fixed at startup (-b). Positions are 64-bit
+// so the image size is limited by off_t, not by int.
+static long long num_cylinders;
+static long long sectors_per_cylinder;
+static int block_size = DEFAULT_BLOCK_SIZE;
+static int max_range_blocks;     // MAX_RANGE_BLOCKS, less for big blocks
+static int seek_usec;
+static int disk_fd;
+static unsigned char *disk_map = NULL;   // whole image, when started with -m
+static off_t disk_size;
+
+// A pending R/W request. Client threads queue these and sleep on done_cond;
+// the single disk thread picks the next one according to sched_policy.
+typedef struct DiskRequest {
+    int is_write;                // also set for discards, for conflict ordering
+    int is_discard;              // D: deallocate the blocks, no data
+    long long c, s;              // first block
+    int n;                       // number of consecutive blocks
+    unsigned char *buf;          // n * block_size bytes, filled (R) or consumed (W)
+    int status;                  // 1 = success, 0 = failure
+    int done;
+    int detached;                // cache write-back: nobody waits, disk thread frees it
+    int journaled;               // a logged write being applied to the image (-j)
+    int journal_gen;             // ...and the checkpoint generation it belongs to
+    long long seek_dist;         // cylinders travelled to serve it, for the stats
+    long long sim_submitted;     // simulated clock when queued and when served
+    long long sim_done;
+    pthread_cond_t done_cond;
+    struct timespec submitted;
+    struct DiskRequest *next;
+} DiskRequest;
+
+// -m: an RN reply is sent straight from the mapping. While a connection is
+// sending, the reply's range is listed here. The disk thread waits for any
+// listed range that overlaps blocks it is about to write or discard, so a
+// reply never carries a block that is half old and half new.
+typedef struct MapSend {
+    long long lba, n;
+    struct MapSend *next;
+} MapSend;
+
+static MapSend *map_sending;
+static pthread_mutex_t map_send_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t map_send_done = PTHREAD_COND_INITIALIZER;
+
+// There is one head for the whole disk, shared by every connection. Only
+// the disk thread moves it or touches disk_fd, so requests from different
+// clients interleave on the head the way they would on a real spindle.
+static long long head_cylinder = 0;
+static int head_surface = 0;     // which head is active within the cylinder
+static int scan_direction = 1;   // +1 towards higher cylinders, -1 towards 0
+
+// Timing model (-t key=value,...). The defaults give the original model,
+// where only |delta cylinder| * seek_usec costs anything.
+static int rpm = 0;              // 0: no rotational delay or transfer time
+static int heads = 1;            // a track is sectors_per_cylinder / heads sectors
+static int settle_usec = 0;      // fixed part of any non-zero seek
+static int seek_sqrt_usec = 0;   // plus this * sqrt(distance)
+static int head_switch_usec = 0; // changing track within a cylinder
+
+static int sched_policy = SCHED_FCFS;
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_nonempty = PTHREAD_COND_INITIALIZER;
+static DiskRequest *pending_head = NULL;   // in arrival order
+static DiskRequest *pending_tail = NULL;
+
+// Cache write-backs are fire-and-forget; F waits for them to drain
+static int writebacks_inflight = 0;
+static pthread_cond_t writebacks_idle = PTHREAD_COND_INITIALIZER;
+
+// Scheduler statistics, protected by sched_lock
+static long long stat_requests;
+static long long stat_blocks;
+static long long stat_seek_distance;
+static long long stat_latency_usec;
+static long long stat_max_latency_usec;
+static long long stat_sim_latency_usec;
+static long long stat_seek_usec;
+static long long stat_rotation_usec;
+static long long stat_transfer_usec;
+
+// Simulated clock, in microseconds of modelled disk time. The disk thread
+// advances disk_clock_usec as it charges disk time; sim_clock_usec (under
+// sched_lock) is the latest completion published to clients. With -v the
+// cost is only charged to the clock, without sleeping, so a run takes as
+// long as the transfers themselves and its timings are deterministic.
+static int virtual_time = 0;
+static long long disk_clock_usec;
+static long long sim_clock_usec;
+
+// io_uring backend (-u); see the disk thread section. Only the disk
+// thread touches these.
+#define RING_ENTRIES 64
+static IoRing ring;
+static int use_ring = 0;
+static DiskRequest *ring_inflight[RING_ENTRIES];
+static int ring_count;
+static DiskRequest *ring_queuing;   // picked and waiting for room on the ring
+
+// Thin provisioning. The image is sparse: blocks never written, or
+// discarded with D, are holes in the file. alloc_map has a bit per block
+// that may hold data, built from SEEK_DATA/SEEK_HOLE at startup, set when a
+// write is queued and cleared when a discard is queued. A read of blocks
+// that are all clear is answered with zeros without going to the disk.
+// Protected by sched_lock; NULL (every block treated as written) if the
+// disk is too large for the map.
+#define MAX_ALLOC_MAP_BYTES (1 << 28)
+static unsigned char *alloc_map;
+static long long allocated_blocks;
+static unsigned char *zero_blocks;   // max_range_blocks of zeros, never written
+static long long stat_zero_reads;
+static long long stat_discards;
+static long long stat_discarded_blocks;
+
+// Write-ahead journal (-j); see the journal section. Image writes still
+// outstanding in each checkpoint generation are counted under sched_lock.
+static int journal_fd = -1;
+static int journal_outstanding[2];
+static pthread_cond_t journal_applied = PTHREAD_COND_INITIALIZER;
+
+// Block checksums (-k) and the scrubber (-r); see the checksum section.
+// crc_table is NULL without -k.
+static unsigned char *crc_map;
+static size_t crc_map_size;
+static uint32_t *crc_table;
+static int scrub_rate;           // blocks per second; 0: no scrubber
+
+// Request trace (-T): each batch's reads, writes, discards and flushes are
+// logged as they are submitted, tagged with the connection's number
+static TraceWriter tracer = { .fd = -1 };
+static unsigned int next_client;
+
+static long long block_lba(long long c, long long s) {
+    return c * sectors_per_cylinder + s;
+}
+
+static off_t get_offset(long long c, long long s) {
+    return (off_t)block_lba(c, s) * block_size;
+}
+
+static int valid_block(long long c, long long s) {
+    if (c < 0 || c >= num_cylinders) return 0;
+    if (s < 0 || s >= sectors_per_cylinder) return 0;
+    return 1;
+}
+
+// n consecutive blocks starting at (c,s), continuing onto the following
+// cylinders, must all lie on the disk.
+static int blocks_on_disk(long long c, long long s, int n) {
+    if (!valid_block(c, s) || n < 1) return 0;
+    return block_lba(c, s) + n - 1 < num_cylinders * sectors_per_cylinder;
+}
+
+// ...and a transfer is also limited in size
+static int valid_range(long long c, long long s, int n) {
+    return n <= max_range_blocks && blocks_on_disk(c, s, n);
+}
+
+static long long elapsed_usec(const struct timespec *from, const struct timespec *to) {
+    return (long long)(to->tv_sec - from->tv_sec) * 1000000LL +
+           (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static long long isqrt(long long v) {
+    if (v < 2)
+        return v;
+    long long x = v, y = (v + 1) / 2;
+    while (y < x) {
+        x = y;
+        y = (x + v / x) / 2;
+    }
+    return x;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, (const char *)buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        done += n;
+    }
+    return 1;
+}
+
+static int pread_all(int fd, void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (char *)buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        done += n;
+    }
+    return 1;
+}
+
+// Modelled disk time is charged to the clock here and, unless -v, paid
+// back as one sleep per request in pay_disk_time(). The per-request
+// breakdown is folded into the stats by the disk thread. Disk thread only.
+static long long disk_time_owed;
+static long long seek_charged, rotation_charged, transfer_charged;
+static long long stat_slept_usec;    // written here, read with counter_read
+
+static void charge(long long usec, long long *stat) {
+    disk_clock_usec += usec;
+    disk_time_owed += usec;
+    *stat += usec;
+}
+
+static void pay_disk_time(void) {
+    if (disk_time_owed > 0 && !virtual_time) {
+        // Let transfers already queued on the ring run while the arm moves
+        if (use_ring)
+            ioring_submit(&ring, 0);
+        struct timespec before, after;
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        usleep((useconds_t)disk_time_owed);
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        counter_add(&stat_slept_usec, elapsed_usec(&before, &after));
+    }
+    disk_time_owed = 0;
+}
+
+// Seek cost: settle + linear + square-root terms, as in the usual
+// short-seek/long-seek curve. Returns the distance travelled.
+static long long simulate_seek(long long new_cylinder) {
+    long long diff = llabs(new_cylinder - head_cylinder);
+    if (diff > 0)
+        charge(settle_usec + diff * seek_usec +
+               isqrt(diff * seek_sqrt_usec * seek_sqrt_usec), &seek_charged);
+    head_cylinder = new_cylinder;
+    return diff;
+}
+
+// Move to the request and transfer it: for each track it touches, switch
+// head or step to the next cylinder, wait for the first sector to come
+// round, then read or write the sectors on that track. The platter's
+// angle is derived from the simulated clock. Returns the seek distance.
+static long long simulate_access(const DiskRequest *req) {
+    long long track_sectors = sectors_per_cylinder / heads;
+    long long period = rpm > 0 ? 60000000LL / rpm : 0;
+    long long lba = block_lba(req->c, req->s);
+    int remaining = req->n;
+    long long dist = 0;
+
+    while (remaining > 0) {
+        long long c = lba / sectors_per_cylinder;
+        long long within = lba % sectors_per_cylinder;
+        int head = (int)(within / track_sectors);
+        long long sector = within % track_sectors;
+
+        if (c != head_cylinder)
+            dist += simulate_seek(c);
+        else if (head != head_surface)
+            charge(head_switch_usec, &seek_charged);
+        head_surface = head;
+
+        int chunk = track_sectors - sector < remaining ? (int)(track_sectors - sector) : remaining;
+        if (period > 0) {
+            long long start = sector * period / track_sectors;
+            long long wait = (start - disk_clock_usec % period + period) % period;
+            charge(wait, &rotation_charged);
+            charge((sector + chunk) * period / track_sectors - start, &transfer_charged);
+        }
+        lba += chunk;
+        remaining -= chunk;
+    }
+    return dist;
+}
+
+// Scheduling policies
+
+// Ties on cylinder always go to the earliest arrival, so two requests for
+// the same block are never reordered relative to each other.
+
+static DiskRequest *pick_sstf(void) {
+    DiskRequest *best = NULL;
+    long long best_dist = 0;
+    for (DiskRequest *r = pending_head; r; r = r->next) {
+        long long d = llabs(r->c - head_cylinder);
+        if (!best || d < best_dist) {
+            best = r;
+            best_dist = d;
+        }
+    }
+    return best;
+}
+
+// Nearest request at or beyond the head in direction dir, or NULL.
+static DiskRequest *pick_ahead(int dir) {
+    DiskRequest *best = NULL;
+    for (DiskRequest *r = pending_head; r; r = r->next) {
+        long long d = (r->c - head_cylinder) * dir;
+        if (d < 0) continue;
+        if (!best || d < (best->c - head_cylinder) * dir)
+            best = r;
+    }
+    return best;
+}
+
+static DiskRequest *pick_clook(void) {
+    DiskRequest *best = pick_ahead(1);
+    if (best) return best;
+    // Nothing above the head: jump back to the lowest pending cylinder
+    for (DiskRequest *r = pending_head; r; r = r->next) {
+        if (!best || r->c < best->c)
+            best = r;
+    }
+    return best;
+}
+
+// Two requests conflict if their block ranges overlap and either writes.
+static int requests_conflict(const DiskRequest *a, const DiskRequest *b) {
+    if (!a->is_write && !b->is_write) return 0;
+    long long a0 = block_lba(a->c, a->s);
+    long long b0 = block_lba(b->c, b->s);
+    return a0 < b0 + b->n && b0 < a0 + a->n;
+}
+
+// Earliest request queued before req that req must not overtake, or NULL.
+// A range can start on a different cylinder from a single-block request
+// inside it, so equal-cylinder tie-breaking alone doesn't keep them ordered.
+static DiskRequest *first_conflict(DiskRequest *req) {
+    for (DiskRequest *r = pending_head; r != req; r = r->next) {
+        if (requests_conflict(r, req))
+            return r;
+    }
+    return NULL;
+}
+
+static DiskRequest *pick_by_policy(long long *sweep_to) {
+    *sweep_to = -1;
+    switch (sched_policy) {
+    case SCHED_SSTF:
+        return pick_sstf();
+    case SCHED_SCAN: {
+        DiskRequest *r = pick_ahead(scan_direction);
+        if (r) return r;
+        // True SCAN runs the arm to the edge of the disk before reversing
+        *sweep_to = scan_direction > 0 ? num_cylinders - 1 : 0;
+        scan_direction = -scan_direction;
+        return pick_ahead(scan_direction);
+    }
+    case SCHED_CLOOK:
+        return pick_clook();
+    default:
+        return pending_head;
+    }
+}
+
+// Caller must hold sched_lock; the queue must be non-empty.
+static DiskRequest *pick_next(long long *sweep_to) {
+    DiskRequest *r = pick_by_policy(sweep_to);
+    DiskRequest *earlier;
+    while ((earlier = first_conflict(r)) != NULL)
+        r = earlier;
+    return r;
+}
+
+static void unlink_pending(DiskRequest *req) {
+    DiskRequest **pp = &pending_head;
+    DiskRequest *prev = NULL;
+    while (*pp != req) {
+        prev = *pp;
+        pp = &(*pp)->next;
+    }
+    *pp = req->next;
+    if (pending_tail == req)
+        pending_tail = prev;
+    req->next = NULL;
+}
+
+// Compressed, deduplicated store (-z)
+//
+// With -z the disk file is not a flat image but a store holding the
+// logical disk. Each block that isn't all zeros maps to a record of unique
+// contents, found by its CRC32C and confirmed by comparing the bytes, so a
+// block written many times over (or at many addresses) is kept once. The
+// new contents of a write are packed into frames of up to ZFRAME_BYTES,
+// compressed with lz.h and placed in free space in the file; a read
+// decompresses the frames it touches and keeps the last few. Zero blocks,
+// like discarded ones, take no space at all.
+//
+// The map, frames and records live in memory. A flush (F, a checkpoint,
+// or ZSTORE_RECLAIM_BYTES of dead frames) writes them, compressed, to
+// fresh space and then points the older of two header slots at them, so a
+// crash goes back to the last flush: where journal replay starts, and
+// without -j no worse than a plain image, where writes since the last F
+// may be lost too. The space of frames that die is reused only after the
+// next flush, as the durable map may still point into it. A frame is kept
+// until none of its blocks is referenced; the file is never compacted.
+//
+// The disk thread and flushes take zstore_lock. Startup code (journal
+// replay, the checksum and allocation maps) runs before there is a disk
+// thread and calls in without it.
+
+#define ZSTORE_HEADER_SIZE 4096          // one slot; there are two
+#define ZSTORE_DATA_START (2 * ZSTORE_HEADER_SIZE)
+#define ZFRAME_BYTES 65536               // uncompressed contents of a frame, at most
+#define ZFRAME_CACHE 8                   // decompressed frames kept
+#define ZMETA_PIECE (1 << 20)            // metadata is compressed in pieces this big
+#define ZSTORE_RECLAIM_BYTES (8 << 20)
+
+typedef struct {
+    char magic[4];               // "DZ01"
+    int block_size;
+    long long blocks;
+    unsigned long long gen;      // the valid slot with the higher one is current
+    long long meta_off;          // compressed map, frames and records
+    long long meta_len;
+    int nframes;
+    int nrecs;
+    unsigned int meta_sum;       // CRC32C of the metadata
+    unsigned int sum;            // CRC32C of this header with sum 0
+} ZStoreHeader;
+
+typedef struct {
+    long long off;               // in the store file
+    int clen;                    // stored bytes; nblocks * block_size if not compressed
+    int nblocks;
+    int live;                    // records still pointing into it; 0: free slot
+    int next;                    // free list
+} ZFrame;
+
+typedef struct {
+    uint32_t hash;               // CRC32C of the contents
+    int frame;                   // -1: free slot
+    int index;                   // block within the frame
+    int refs;                    // logical blocks mapped to it
+    int next;                    // hash chain, or free list
+} ZRecord;
+
+typedef struct {
+    long long off, len;
+} ZExtent;
+
+typedef struct {
+    ZExtent *v;
+    int n, cap;
+} ZExtents;
+
+static pthread_mutex_t zstore_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *zmap;                // per logical block: record, or -1 (zeros); NULL without -z
+static ZFrame *zframes;
+static int zframes_n, zframes_cap, zframe_free = -1;
+static ZRecord *zrecs;
+static int zrecs_n, zrecs_cap, zrec_free = -1;
+static int *zbuckets;            // hash -> record chain
+static unsigned int zbuckets_n;
+static ZExtents zfree;           // reusable space, by offset
+static ZExtents zdead;           // freed since the last flush
+static long long zdead_bytes;
+static long long zstore_end;     // end of the used part of the file
+static ZStoreHeader zheader;     // the current slot's contents
+static int zframe_max;           // blocks per frame
+static unsigned char *zfresh;    // contents of the frame being built
+static unsigned char *zio;       // a frame as stored
+static struct {
+    int frame;
+    unsigned char *data;
+} zcache[ZFRAME_CACHE];
+static int zcache_next;
+
+// Store statistics, protected by zstore_lock
+static long long zstat_logical;  // blocks mapped to a record
+static long long zstat_unique;   // records in use
+static long long zstat_stored;   // bytes of live frames
+static long long zstat_dedup_hits;
+
+static int zextents_add(ZExtents *e, long long off, long long len) {
+    if (e->n == e->cap) {
+        int cap = e->cap ? e->cap * 2 : 64;
+        ZExtent *v = realloc(e->v, cap * sizeof(*v));
+        if (!v)
+            return 0;
+        e->v = v;
+        e->cap = cap;
+    }
+    e->v[e->n].off = off;
+    e->v[e->n].len = len;
+    e->n++;
+    return 1;
+}
+
+// Return space to the free list, merging it with its neighbours
+static void zspace_free(long long off, long long len) {
+    int i = 0;
+    while (i < zfree.n && zfree.v[i].off < off)
+        i++;
+    if (i > 0 && zfree.v[i - 1].off + zfree.v[i - 1].len == off) {
+        zfree.v[i - 1].len += len;
+        if (i < zfree.n && off + len == zfree.v[i].off) {
+            zfree.v[i - 1].len += zfree.v[i].len;
+            memmove(zfree.v + i, zfree.v + i + 1, (zfree.n - i - 1) * sizeof(ZExtent));
+            zfree.n--;
+        }
+    } else if (i < zfree.n && off + len == zfree.v[i].off) {
+        zfree.v[i].off = off;
+        zfree.v[i].len += len;
+    } else {
+        if (!zextents_add(&zfree, 0, 0))
+            return;              // the space is lost until the next restart
+        memmove(zfree.v + i + 1, zfree.v + i, (zfree.n - i - 1) * sizeof(ZExtent));
+        zfree.v[i].off = off;
+        zfree.v[i].len = len;
+    }
+    // Space at the end goes back to the file
+    ZExtent *last = &zfree.v[zfree.n - 1];
+    if (last->off + last->len == zstore_end) {
+        zstore_end = last->off;
+        zfree.n--;
+    }
+}
+
+// First fit, else the end of the file
+static long long zspace_alloc(long long len) {
+    for (int i = 0; i < zfree.n; i++) {
+        if (zfree.v[i].len >= len) {
+            long long off = zfree.v[i].off;
+            zfree.v[i].off += len;
+            zfree.v[i].len -= len;
+            if (zfree.v[i].len == 0) {
+                memmove(zfree.v + i, zfree.v + i + 1, (zfree.n - i - 1) * sizeof(ZExtent));
+                zfree.n--;
+            }
+            return off;
+        }
+    }
+    long long off = zstore_end;
+    zstore_end += len;
+    return off;
+}
+
+static void zbuckets_insert(int r) {
+    unsigned int b = zrecs[r].hash & (zbuckets_n - 1);
+    zrecs[r].next = zbuckets[b];
+    zbuckets[b] = r;
+}
+
+// Keep chains short: one bucket per record
+static int zbuckets_grow(unsigned int want) {
+    unsigned int n = zbuckets_n ? zbuckets_n : 1024;
+    while (n < want)
+        n *= 2;
+    if (n == zbuckets_n)
+        return 1;
+    int *b = malloc(n * sizeof(int));
+    if (!b)
+        return 0;
+    free(zbuckets);
+    zbuckets = b;
+    zbuckets_n = n;
+    memset(zbuckets, 0xff, n * sizeof(int));
+    for (int r = 0; r < zrecs_n; r++) {
+        if (zrecs[r].frame >= 0)
+            zbuckets_insert(r);
+    }
+    return 1;
+}
+
+static int zframe_new(void) {
+    int f = zframe_free;
+    if (f >= 0) {
+        zframe_free = zframes[f].next;
+        return f;
+    }
+    if (zframes_n == zframes_cap) {
+        int cap = zframes_cap ? zframes_cap * 2 : 1024;
+        ZFrame *v = realloc(zframes, cap * sizeof(*v));
+        if (!v)
+            return -1;
+        zframes = v;
+        zframes_cap = cap;
+    }
+    memset(&zframes[zframes_n], 0, sizeof(ZFrame));
+    return zframes_n++;
+}
+
+static void zframe_release(int f) {
+    zframes[f].live = 0;
+    zframes[f].next = zframe_free;
+    zframe_free = f;
+}
+
+static int zrec_new(uint32_t hash, int frame, int index) {
+    int r = zrec_free;
+    if (r >= 0) {
+        zrec_free = zrecs[r].next;
+    } else {
+        if (zrecs_n == zrecs_cap) {
+            int cap = zrecs_cap ? zrecs_cap * 2 : 1024;
+            ZRecord *v = realloc(zrecs, cap * sizeof(*v));
+            if (!v)
+                return -1;
+            zrecs = v;
+            zrecs_cap = cap;
+        }
+        r = zrecs_n++;
+    }
+    zrecs[r].hash = hash;
+    zrecs[r].frame = frame;
+    zrecs[r].index = index;
+    zrecs[r].refs = 0;
+    zstat_unique++;
+    if ((unsigned int)zstat_unique > zbuckets_n && zbuckets_grow(zbuckets_n * 2))
+        return r;                // the rebuild has linked it in
+    zbuckets_insert(r);
+    return r;
+}
+
+// Contents of frame f, from the cache if it's there
+static unsigned char *zframe_data(int f) {
+    for (int i = 0; i < ZFRAME_CACHE; i++) {
+        if (zcache[i].data && zcache[i].frame == f)
+            return zcache[i].data;
+    }
+    int slot = zcache_next;
+    zcache_next = (zcache_next + 1) % ZFRAME_CACHE;
+    if (!zcache[slot].data) {
+        zcache[slot].data = malloc((size_t)zframe_max * block_size);
+        if (!zcache[slot].data)
+            return NULL;
+    }
+    zcache[slot].frame = -1;
+
+    ZFrame *fr = &zframes[f];
+    int raw = fr->nblocks * block_size;
+    unsigned char *dst = zcache[slot].data;
+    if (!pread_all(disk_fd, fr->clen == raw ? dst : zio, fr->clen, fr->off)) {
+        perror("pread (store)");
+        return NULL;
+    }
+    if (fr->clen != raw && lz_decompress(zio, fr->clen, dst, raw) != raw) {
+        fprintf(stderr, "store: frame at %lld is corrupt\n", fr->off);
+        return NULL;
+    }
+    zcache[slot].frame = f;
+    return dst;
+}
+
+static void zrec_unref(int r) {
+    if (r < 0 || --zrecs[r].refs > 0)
+        return;
+    unsigned int b = zrecs[r].hash & (zbuckets_n - 1);
+    int *link = &zbuckets[b];
+    while (*link != r)
+        link = &zrecs[*link].next;
+    *link = zrecs[r].next;
+
+    int f = zrecs[r].frame;
+    zrecs[r].frame = -1;
+    zrecs[r].next = zrec_free;
+    zrec_free = r;
+    zstat_unique--;
+    if (--zframes[f].live > 0)
+        return;
+
+    // The whole frame is dead; its space is free once a flush has let go of it
+    for (int i = 0; i < ZFRAME_CACHE; i++) {
+        if (zcache[i].frame == f)
+            zcache[i].frame = -1;
+    }
+    zstat_stored -= zframes[f].clen;
+    zdead_bytes += zframes[f].clen;
+    if (!zextents_add(&zdead, zframes[f].off, zframes[f].clen))
+        zdead_bytes -= zframes[f].clen;      // lost until the next restart
+    zframe_release(f);
+}
+
+// A record with the contents of block b, or -1. The frame being built
+// (building, whose blocks are in zfresh) is compared from memory.
+static int zrec_find(uint32_t hash, const unsigned char *b, int building) {
+    for (int r = zbuckets[hash & (zbuckets_n - 1)]; r >= 0; r = zrecs[r].next) {
+        if (zrecs[r].hash != hash)
+            continue;
+        const unsigned char *data = zrecs[r].frame == building ? zfresh : zframe_data(zrecs[r].frame);
+        if (data && memcmp(data + (size_t)zrecs[r].index * block_size, b, block_size) == 0)
+            return r;
+    }
+    return -1;
+}
+
+static int zstore_write(long long lba, long long n, const unsigned char *data) {
+    long long i = 0;
+    while (i < n) {
+        // Map the next blocks, collecting new contents into one frame
+        int f = zframe_new();
+        if (f < 0)
+            return 0;
+        int nf = 0;
+        for (; i < n && nf < zframe_max; i++) {
+            const unsigned char *b = data + (size_t)i * block_size;
+            int r = -1;
+            if (memcmp(b, zero_blocks, block_size) != 0) {
+                uint32_t hash = crc32c(b, block_size);
+                r = zrec_find(hash, b, f);
+                if (r >= 0) {
+                    zstat_dedup_hits++;
+                } else {
+                    r = zrec_new(hash, f, nf);
+                    if (r < 0) {
+                        zframe_release(f);
+                        return 0;
+                    }
+                    memcpy(zfresh + (size_t)nf * block_size, b, block_size);
+                    nf++;
+                }
+                zrecs[r].refs++;
+            }
+            int old = zmap[lba + i];
+            zmap[lba + i] = r;
+            zstat_logical += (r >= 0) - (old >= 0);
+            zrec_unref(old);
+        }
+        if (nf == 0) {
+            zframe_release(f);
+            continue;
+        }
+
+        int raw = nf * block_size;
+        int clen = lz_compress(zfresh, raw, zio, raw - 1);
+        ZFrame *fr = &zframes[f];
+        fr->clen = clen ? clen : raw;
+        fr->nblocks = nf;
+        fr->live = nf;
+        fr->off = zspace_alloc(fr->clen);
+        zstat_stored += fr->clen;
+        if (!pwrite_all(disk_fd, clen ? zio : zfresh, fr->clen, fr->off)) {
+            perror("pwrite (store)");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int zstore_read(long long lba, long long n, unsigned char *out) {
+    for (long long i = 0; i < n; i++) {
+        unsigned char *b = out + (size_t)i * block_size;
+        int r = zmap[lba + i];
+        if (r < 0) {
+            memset(b, 0, block_size);
+            continue;
+        }
+        unsigned char *data = zframe_data(zrecs[r].frame);
+        if (!data)
+            return 0;
+        memcpy(b, data + (size_t)zrecs[r].index * block_size, block_size);
+    }
+    return 1;
+}
+
+static void zstore_discard(long long lba, long long n) {
+    for (long long i = 0; i < n; i++) {
+        if (zmap[lba + i] >= 0)
+            zstat_logical--;
+        zrec_unref(zmap[lba + i]);
+        zmap[lba + i] = -1;
+    }
+}
+
+// Append an array to the metadata, compressed a piece at a time; each
+// piece is a u32 stored length (the piece's own length: not compressed),
+// then the bytes.
+static int zmeta_put(unsigned char **out, size_t *len, size_t *cap, const void *src, size_t n) {
+    const unsigned char *p = src;
+    while (n > 0) {
+        int piece = n < ZMETA_PIECE ? (int)n : ZMETA_PIECE;
+        size_t need = *len + 4 + lz_bound(piece);
+        if (need > *cap) {
+            size_t c = *cap ? *cap : ZMETA_PIECE;
+            while (c < need)
+                c *= 2;
+            unsigned char *o = realloc(*out, c);
+            if (!o)
+                return 0;
+            *out = o;
+            *cap = c;
+        }
+        unsigned char *dst = *out + *len + 4;
+        uint32_t clen = lz_compress(p, piece, dst, piece - 1);
+        if (clen == 0) {
+            memcpy(dst, p, piece);
+            clen = piece;
+        }
+        memcpy(*out + *len, &clen, 4);
+        *len += 4 + clen;
+        p += piece;
+        n -= piece;
+    }
+    return 1;
+}
+
+static int zmeta_get(const unsigned char **in, const unsigned char *end, void *dst, size_t n) {
+    unsigned char *p = dst;
+    while (n > 0) {
+        int piece = n < ZMETA_PIECE ? (int)n : ZMETA_PIECE;
+        uint32_t clen;
+        if (end - *in < 4)
+            return 0;
+        memcpy(&clen, *in, 4);
+        *in += 4;
+        if (clen > (uint32_t)(end - *in))
+            return 0;
+        if (clen == (uint32_t)piece)
+            memcpy(p, *in, piece);
+        else if (lz_decompress(*in, clen, p, piece) != piece)
+            return 0;
+        *in += clen;
+        p += piece;
+        n -= piece;
+    }
+    return 1;
+}
+
+// Make the store's current state durable. Caller holds zstore_lock.
+static int zstore_commit(void) {
+    long long total = num_cylinders * sectors_per_cylinder;
+    unsigned char *meta = NULL;
+    size_t len = 0, cap = 0;
+    if (!zmeta_put(&meta, &len, &cap, zmap, (size_t)total * sizeof(int)) ||
+        !zmeta_put(&meta, &len, &cap, zframes, (size_t)zframes_n * sizeof(ZFrame)) ||
+        !zmeta_put(&meta, &len, &cap, zrecs, (size_t)zrecs_n * sizeof(ZRecord))) {
+        perror("store metadata");
+        free(meta);
+        return 0;
+    }
+
+    ZStoreHeader h = zheader;
+    h.gen++;
+    h.meta_off = zspace_alloc(len);
+    h.meta_len = len;
+    h.nframes = zframes_n;
+    h.nrecs = zrecs_n;
+    h.meta_sum = crc32c(meta, len);
+    h.sum = 0;
+    h.sum = crc32c(&h, sizeof(h));
+    int ok = pwrite_all(disk_fd, meta, len, h.meta_off) && fsync(disk_fd) == 0 &&
+             pwrite_all(disk_fd, &h, sizeof(h), (h.gen & 1) * ZSTORE_HEADER_SIZE) &&
+             fsync(disk_fd) == 0;
+    free(meta);
+    if (!ok) {
+        perror("store flush");
+        zspace_free(h.meta_off, len);
+        return 0;
+    }
+
+    // Nothing durable points at the old metadata or the dead frames now
+    if (zheader.meta_len > 0)
+        zspace_free(zheader.meta_off, zheader.meta_len);
+    for (int i = 0; i < zdead.n; i++)
+        zspace_free(zdead.v[i].off, zdead.v[i].len);
+    zdead.n = 0;
+    zdead_bytes = 0;
+    zheader = h;
+    if (ftruncate(disk_fd, zstore_end) < 0)
+        perror("ftruncate (store)");
+    return 1;
+}
+
+static int zextent_cmp(const void *a, const void *b) {
+    const ZExtent *x = a, *y = b;
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+// Load the state from the newest valid header slot
+static int zstore_load(void) {
+    long long total = num_cylinders * sectors_per_cylinder;
+    ZStoreHeader slots[2];
+    int cur = -1;
+    for (int i = 0; i < 2; i++) {
+        ZStoreHeader *h = &slots[i];
+        if (!pread_all(disk_fd, h, sizeof(*h), i * ZSTORE_HEADER_SIZE))
+            continue;
+        unsigned int sum = h->sum;
+        h->sum = 0;
+        if (memcmp(h->magic, "DZ01", 4) != 0 || crc32c(h, sizeof(*h)) != sum)
+            continue;
+        h->sum = sum;
+        if (cur < 0 || h->gen > slots[cur].gen)
+            cur = i;
+    }
+    if (cur < 0) {
+        fprintf(stderr, "The disk file is not a block store\n");
+        return 0;
+    }
+    ZStoreHeader *h = &slots[cur];
+    if (h->block_size != block_size || h->blocks != total) {
+        fprintf(stderr, "The block store holds %lld blocks of %d bytes\n", h->blocks, h->block_size);
+        return 0;
+    }
+
+    unsigned char *meta = malloc(h->meta_len);
+    zframes_n = zframes_cap = h->nframes;
+    zrecs_n = zrecs_cap = h->nrecs;
+    zframes = malloc((size_t)zframes_cap * sizeof(ZFrame) + 1);
+    zrecs = malloc((size_t)zrecs_cap * sizeof(ZRecord) + 1);
+    if (!meta || !zframes || !zrecs) {
+        perror("malloc");
+        free(meta);
+        return 0;
+    }
+    const unsigned char *in = meta;
+    int ok = pread_all(disk_fd, meta, h->meta_len, h->meta_off) &&
+             crc32c(meta, h->meta_len) == h->meta_sum &&
+             zmeta_get(&in, meta + h->meta_len, zmap, (size_t)total * sizeof(int)) &&
+             zmeta_get(&in, meta + h->meta_len, zframes, (size_t)zframes_n * sizeof(ZFrame)) &&
+             zmeta_get(&in, meta + h->meta_len, zrecs, (size_t)zrecs_n * sizeof(ZRecord));
+    free(meta);
+    if (!ok) {
+        fprintf(stderr, "The block store's metadata is corrupt\n");
+        return 0;
+    }
+    zheader = *h;
+
+    // Free lists, hash chains and statistics aren't stored
+    ZExtents used = { NULL, 0, 0 };
+    zextents_add(&used, h->meta_off, h->meta_len);
+    for (int f = zframes_n - 1; f >= 0; f--) {
+        if (zframes[f].live > 0) {
+            zstat_stored += zframes[f].clen;
+            if (!zextents_add(&used, zframes[f].off, zframes[f].clen))
+                return 0;
+        } else {
+            zframe_release(f);
+        }
+    }
+    for (int r = zrecs_n - 1; r >= 0; r--) {
+        if (zrecs[r].frame < 0 || zrecs[r].frame >= zframes_n) {
+            zrecs[r].frame = -1;
+            zrecs[r].next = zrec_free;
+            zrec_free = r;
+        } else {
+            zstat_unique++;
+        }
+    }
+    if (!zbuckets_grow(zstat_unique))
+        return 0;
+    for (long long i = 0; i < total; i++) {
+        if (zmap[i] < -1 || zmap[i] >= zrecs_n || (zmap[i] >= 0 && zrecs[zmap[i]].frame < 0)) {
+            fprintf(stderr, "The block store's map is corrupt\n");
+            return 0;
+        }
+        zstat_logical += zmap[i] >= 0;
+    }
+
+    qsort(used.v, used.n, sizeof(ZExtent), zextent_cmp);
+    zstore_end = ZSTORE_DATA_START;
+    for (int i = 0; i < used.n; i++) {
+        if (used.v[i].off > zstore_end)
+            zextents_add(&zfree, zstore_end, used.v[i].off - zstore_end);
+        if (used.v[i].off + used.v[i].len > zstore_end)
+            zstore_end = used.v[i].off + used.v[i].len;
+    }
+    free(used.v);
+    return 1;
+}
+
+// Open the store in disk_fd, or start one in an empty file
+static int zstore_open(void) {
+    long long total = num_cylinders * sectors_per_cylinder;
+    if (total > INT_MAX) {
+        fprintf(stderr, "Disk too large for a block store\n");
+        return 0;
+    }
+    zframe_max = ZFRAME_BYTES / block_size > 0 ? ZFRAME_BYTES / block_size : 1;
+    zmap = malloc((size_t)total * sizeof(int));
+    zfresh = malloc((size_t)zframe_max * block_size);
+    zio = malloc(lz_bound(zframe_max * block_size));
+    if (!zmap || !zfresh || !zio) {
+        perror("malloc");
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(disk_fd, &st) < 0) {
+        perror("fstat");
+        return 0;
+    }
+    if (st.st_size > 0)
+        return zstore_load();
+
+    memset(zmap, 0xff, (size_t)total * sizeof(int));
+    memcpy(zheader.magic, "DZ01", 4);
+    zheader.block_size = block_size;
+    zheader.blocks = total;
+    zstore_end = ZSTORE_DATA_START;
+    return zbuckets_grow(0) && zstore_commit();
+}
+
+// Disk thread: the store's side of service_request()
+static int zstore_service(DiskRequest *req) {
+    long long lba = block_lba(req->c, req->s);
+    int ok = 1;
+    pthread_mutex_lock(&zstore_lock);
+    if (req->is_discard)
+        zstore_discard(lba, req->n);
+    else if (req->is_write)
+        ok = zstore_write(lba, req->n, req->buf);
+    else
+        ok = zstore_read(lba, req->n, req->buf);
+    if (zdead_bytes > ZSTORE_RECLAIM_BYTES)
+        zstore_commit();
+    pthread_mutex_unlock(&zstore_lock);
+    return ok;
+}
+
+// Allocation map
+
+static int block_allocated(long long lba) {
+    return (alloc_map[lba >> 3] >> (lba & 7)) & 1;
+}
+
+// Mark n blocks from lba as written (1) or discarded (0). Whole bytes are
+// done at once, since a discard can cover the entire disk.
+static void alloc_map_set(long long lba, long long n, int value) {
+    long long end = lba + n;
+    while (lba < end && (lba & 7)) {
+        if (block_allocated(lba) != value) {
+            alloc_map[lba >> 3] ^= 1 << (lba & 7);
+            allocated_blocks += value ? 1 : -1;
+        }
+        lba++;
+    }
+    for (; lba + 8 <= end; lba += 8) {
+        int bits = __builtin_popcount(alloc_map[lba >> 3]);
+        allocated_blocks += value ? 8 - bits : -bits;
+        alloc_map[lba >> 3] = value ? 0xff : 0;
+    }
+    for (; lba < end; lba++) {
+        if (block_allocated(lba) != value) {
+            alloc_map[lba >> 3] ^= 1 << (lba & 7);
+            allocated_blocks += value ? 1 : -1;
+        }
+    }
+}
+
+// Build the map from the image's holes. The filesystem's allocation unit
+// is usually larger than a block, so a few blocks that were never written
+// may be counted as written; that only costs them the fast path.
+static int alloc_map_init(void) {
+    long long total = num_cylinders * sectors_per_cylinder;
+    if ((total + 7) / 8 > MAX_ALLOC_MAP_BYTES)
+        return 0;
+    alloc_map = calloc((size_t)(total + 7) / 8, 1);
+    if (!alloc_map)
+        return 0;
+    if (zmap) {
+        for (long long lba = 0; lba < total; lba++) {
+            if (zmap[lba] >= 0)
+                alloc_map_set(lba, 1, 1);
+        }
+        return 1;
+    }
+
+    off_t pos = 0;
+    while (pos < disk_size) {
+        off_t data = lseek(disk_fd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno != ENXIO)      // no SEEK_DATA: assume everything is written
+                alloc_map_set(0, total, 1);
+            break;
+        }
+        off_t hole = lseek(disk_fd, data, SEEK_HOLE);
+        if (hole < 0)
+            hole = disk_size;
+        long long first = data / block_size;
+        long long last = (hole + block_size - 1) / block_size;
+        alloc_map_set(first, last - first, 1);
+        pos = hole;
+    }
+    return 1;
+}
+
+// Block checksums (-k <file>)
+//
+// A CRC32C of every block is kept in a sidecar file, mapped into memory
+// behind a small header. The disk thread sets a block's entry when a write
+// or discard reaches the image and checks it when a read comes back from
+// the image, so the table always describes what the image holds; a block
+// that doesn't match fails the read. Cache hits and never-written blocks
+// don't come from the image and aren't checked. F and checkpoints flush the
+// table along with the image. Without -j, blocks written after the last F
+// may fail their check after a crash, as the table and the image can reach
+// the disk in different states.
+
+#define CRC_HEADER_SIZE 4096
+
+typedef struct {
+    char magic[4];               // "DCK1"
+    int block_size;
+    long long blocks;
+} ChecksumHeader;
+
+static uint32_t zero_crc;        // of a block of zeros, for holes
+static long long stat_checksum_errors;     // under sched_lock
+
+// Record the checksums of n blocks from lba, or of zeros if data is NULL
+static void crc_set(long long lba, long long n, const unsigned char *data) {
+    if (data) {
+        crc32c_blocks(data, n, block_size, crc_table + lba);
+        return;
+    }
+    for (long long i = 0; i < n; i++)
+        crc_table[lba + i] = zero_crc;
+}
+
+// Checksum every block of the image into a new table, skipping holes
+static int crc_build(void) {
+    long long total = num_cylinders * sectors_per_cylinder;
+    size_t chunk = (size_t)max_range_blocks * block_size;
+    unsigned char *buf = malloc(chunk);
+    if (!buf)
+        return 0;
+    crc_set(0, total, NULL);
+
+    off_t pos = 0;
+    while (pos < disk_size) {
+        off_t data = pos, hole = disk_size;     // a store (-z) is read in full
+        if (!zmap && (data = lseek(disk_fd, pos, SEEK_DATA)) < 0) {
+            if (errno == ENXIO)
+                break;
+            data = pos;              // no SEEK_DATA: read it all
+        } else if (!zmap) {
+            hole = lseek(disk_fd, data, SEEK_HOLE);
+            if (hole < 0)
+                hole = disk_size;
+        }
+        long long first = data / block_size;
+        long long last = (hole + block_size - 1) / block_size;
+        for (long long lba = first; lba < last; lba += max_range_blocks) {
+            long long n = last - lba < max_range_blocks ? last - lba : max_range_blocks;
+            int ok = zmap ? zstore_read(lba, n, buf)
+                          : pread_all(disk_fd, buf, (size_t)n * block_size, (off_t)lba * block_size);
+            if (!ok) {
+                perror("pread (checksums)");
+                free(buf);
+                return 0;
+            }
+            crc_set(lba, n, buf);
+        }
+        pos = (off_t)last * block_size;
+    }
+    free(buf);
+    return 1;
+}
+
+// Map the sidecar, building it from the image if it is new or doesn't
+// match the disk. The header is written last, so a build cut short by a
+// crash is redone.
+static int crc_open(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        perror("open checksum file");
+        return 0;
+    }
+    long long total = num_cylinders * sectors_per_cylinder;
+    ChecksumHeader h;
+    int fresh = pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+                memcmp(h.magic, "DCK1", 4) != 0 || h.block_size != block_size ||
+                h.blocks != total;
+    crc_map_size = CRC_HEADER_SIZE + (size_t)total * sizeof(uint32_t);
+    if ((fresh && ftruncate(fd, 0) < 0) || ftruncate(fd, crc_map_size) < 0) {
+        perror("ftruncate checksum file");
+        close(fd);
+        return 0;
+    }
+    crc_map = mmap(NULL, crc_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (crc_map == MAP_FAILED) {
+        perror("mmap checksum file");
+        crc_map = NULL;
+        return 0;
+    }
+    crc_table = (uint32_t *)(crc_map + CRC_HEADER_SIZE);
+    zero_crc = crc32c(zero_blocks, block_size);
+    if (!fresh)
+        return 1;
+
+    printf("Checksums: building %s from the image\n", path);
+    if (!crc_build() || msync(crc_map, crc_map_size, MS_SYNC) < 0)
+        return 0;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "DCK1", 4);
+    h.block_size = block_size;
+    h.blocks = total;
+    memcpy(crc_map, &h, sizeof(h));
+    return msync(crc_map, CRC_HEADER_SIZE, MS_SYNC) == 0;
+}
+
+static int crc_flush(void) {
+    if (crc_map && msync(crc_map, crc_map_size, MS_SYNC) < 0) {
+        perror("msync (checksums)");
+        return 0;
+    }
+    return 1;
+}
+
+// Disk thread, once req has reached the image: record a write's or
+// discard's checksums, or check a read's. Returns the number of blocks
+// that didn't match.
+static int crc_check(const DiskRequest *req) {
+    long long lba = block_lba(req->c, req->s);
+    if (req->is_write) {
+        crc_set(lba, req->n, req->is_discard ? NULL : req->buf);
+        return 0;
+    }
+    uint32_t sums[MAX_RANGE_BLOCKS];
+    crc32c_blocks(req->buf, req->n, block_size, sums);
+    int bad = 0;
+    for (int i = 0; i < req->n; i++) {
+        if (sums[i] != crc_table[lba + i]) {
+            fprintf(stderr, "checksum mismatch in block %lld/%lld\n",
+                    (lba + i) / sectors_per_cylinder, (lba + i) % sectors_per_cylinder);
+            bad++;
+        }
+    }
+    return bad;
+}
+
+// Request queue
+
+static void submit_request(DiskRequest *req) {
+    req->done = 0;
+    req->next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &req->submitted);
+
+    pthread_mutex_lock(&sched_lock);
+    req->sim_submitted = sim_clock_usec;
+    if (alloc_map) {
+        long long lba = block_lba(req->c, req->s);
+        if (req->is_write) {
+            alloc_map_set(lba, req->n, !req->is_discard);
+        } else {
+            int i = 0;
+            while (i < req->n && !block_allocated(lba + i))
+                i++;
+            if (i == req->n) {
+                // Never written: zeros, without a seek or a read
+                req->buf = zero_blocks;
+                req->status = 1;
+                req->done = 1;
+                req->sim_done = sim_clock_usec;
+                stat_zero_reads++;
+                pthread_mutex_unlock(&sched_lock);
+                return;
+            }
+        }
+    }
+    if (req->detached)
+        writebacks_inflight++;
+    if (pending_tail)
+        pending_tail->next = req;
+    else
+        pending_head = req;
+    pending_tail = req;
+    pthread_cond_signal(&sched_nonempty);
+    pthread_mutex_unlock(&sched_lock);
+}
+
+static long long sim_clock_now(void) {
+    pthread_mutex_lock(&sched_lock);
+    long long now = sim_clock_usec;
+    pthread_mutex_unlock(&sched_lock);
+    return now;
+}
+
+static int wait_request(DiskRequest *req) {
+    pthread_mutex_lock(&sched_lock);
+    while (!req->done)
+        pthread_cond_wait(&req->done_cond, &sched_lock);
+    pthread_mutex_unlock(&sched_lock);
+    return req->status;
+}
+
+// Sector cache (-c <blocks>)
+//
+// An LRU cache of whole blocks in front of the scheduler. Read hits are
+// answered from memory without a seek, and single-block writes are
+// write-back: they are acknowledged once they are in the cache, and reach
+// the image only when evicted or when F flushes the cache. Write-backs are
+// ordinary (detached) requests on the scheduler, and first_conflict() keeps
+// later reads of the same block behind them.
+//
+// Lock order is cache_lock before sched_lock. The disk thread fills the
+// cache after a read miss, but only if the block isn't cached already and
+// no queued write covers it, so it never installs stale data.
+
+typedef struct {
+    long long lba;
+    int dirty;
+    int prev, next;              // LRU list (most recent first), or free list
+    int hnext;                   // hash chain
+    unsigned char *data;
+} CacheEntry;
+
+static int cache_capacity = 0;   // in blocks; 0 disables the cache
+static CacheEntry *cache_entries;
+static unsigned char *cache_data;
+static int *cache_buckets;
+static unsigned int cache_nbuckets;
+static int cache_lru_head = -1, cache_lru_tail = -1;
+static int cache_free_list = -1;
+static int cache_dirty_count;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Cache statistics, protected by cache_lock
+static long long stat_cache_hits;
+static long long stat_cache_misses;
+static long long stat_cache_writebacks;
+
+static int cache_init(int blocks) {
+    cache_nbuckets = 1;
+    while (cache_nbuckets < 2U * (unsigned int)blocks)
+        cache_nbuckets <<= 1;
+
+    cache_entries = calloc(blocks, sizeof(CacheEntry));
+    cache_data = malloc((size_t)blocks * block_size);
+    cache_buckets = malloc(cache_nbuckets * sizeof(int));
+    if (!cache_entries || !cache_data || !cache_buckets)
+        return 0;
+
+    for (unsigned int b = 0; b < cache_nbuckets; b++)
+        cache_buckets[b] = -1;
+    for (int i = 0; i < blocks; i++) {
+        cache_entries[i].data = cache_data + (size_t)i * block_size;
+        cache_entries[i].next = i + 1 < blocks ? i + 1 : -1;
+    }
+    cache_free_list = 0;
+    cache_capacity = blocks;
+    return 1;
+}
+
+static unsigned int cache_hash(long long lba) {
+    return (unsigned int)(((unsigned long long)lba * 0x9E3779B97F4A7C15ULL) >> 32) &
+           (cache_nbuckets - 1);
+}
+
+static int cache_find(long long lba) {
+    for (int i = cache_buckets[cache_hash(lba)]; i >= 0; i = cache_entries[i].hnext) {
+        if (cache_entries[i].lba == lba)
+            return i;
+    }
+    return -1;
+}
+
+static void lru_unlink(int i) {
+    CacheEntry *e = &cache_entries[i];
+    if (e->prev >= 0) cache_entries[e->prev].next = e->next;
+    else cache_lru_head = e->next;
+    if (e->next >= 0) cache_entries[e->next].prev = e->prev;
+    else cache_lru_tail = e->prev;
+}
+
+static void lru_push_front(int i) {
+    CacheEntry *e = &cache_entries[i];
+    e->prev = -1;
+    e->next = cache_lru_head;
+    if (cache_lru_head >= 0) cache_entries[cache_lru_head].prev = i;
+    cache_lru_head = i;
+    if (cache_lru_tail < 0) cache_lru_tail = i;
+}
+
+static void hash_remove(int i) {
+    int *pp = &cache_buckets[cache_hash(cache_entries[i].lba)];
+    while (*pp != i)
+        pp = &cache_entries[*pp].hnext;
+    *pp = cache_entries[i].hnext;
+}
+
+// Queue a copy of a dirty block for writing. Caller holds cache_lock.
+static int queue_writeback(long long lba, const unsigned char *data) {
+    DiskRequest *wb = calloc(1, sizeof(DiskRequest) + block_size);
+    if (!wb) {
+        perror("calloc (write-back)");
+        return 0;
+    }
+    wb->is_write = 1;
+    wb->c = lba / sectors_per_cylinder;
+    wb->s = lba % sectors_per_cylinder;
+    wb->n = 1;
+    wb->buf = (unsigned char *)(wb + 1);
+    wb->detached = 1;
+    memcpy(wb->buf, data, block_size);
+    stat_cache_writebacks++;
+    submit_request(wb);
+    return 1;
+}
+
+static void cache_remove(int i) {
+    hash_remove(i);
+    lru_unlink(i);
+    if (cache_entries[i].dirty) {
+        cache_entries[i].dirty = 0;
+        cache_dirty_count--;
+    }
+    cache_entries[i].next = cache_free_list;
+    cache_free_list = i;
+}
+
+// A free entry, evicting the least recently used block if necessary.
+// Caller holds cache_lock. Returns -1 if a dirty victim can't be written back.
+static int cache_alloc(long long lba) {
+    int i = cache_free_list;
+    if (i >= 0) {
+        cache_free_list = cache_entries[i].next;
+    } else {
+        i = cache_lru_tail;
+        if (cache_entries[i].dirty && !queue_writeback(cache_entries[i].lba, cache_entries[i].data))
+            return -1;
+        cache_remove(i);
+        cache_free_list = cache_entries[i].next;
+    }
+    CacheEntry *e = &cache_entries[i];
+    e->lba = lba;
+    e->dirty = 0;
+    unsigned int b = cache_hash(lba);
+    e->hnext = cache_buckets[b];
+    cache_buckets[b] = i;
+    lru_push_front(i);
+    return i;
+}
+
+static int cache_read(long long lba, unsigned char *out) {
+    pthread_mutex_lock(&cache_lock);
+    int i = cache_find(lba);
+    if (i >= 0) {
+        memcpy(out, cache_entries[i].data, block_size);
+        lru_unlink(i);
+        lru_push_front(i);
+        stat_cache_hits++;
+    } else {
+        stat_cache_misses++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return i >= 0;
+}
+
+static int cache_write(long long lba, const unsigned char *data) {
+    pthread_mutex_lock(&cache_lock);
+    int i = cache_find(lba);
+    if (i >= 0) {
+        lru_unlink(i);
+        lru_push_front(i);
+    } else {
+        i = cache_alloc(lba);
+    }
+    if (i >= 0) {
+        memcpy(cache_entries[i].data, data, block_size);
+        if (!cache_entries[i].dirty) {
+            cache_entries[i].dirty = 1;
+            cache_dirty_count++;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return i >= 0;
+}
+
+// A write that has left the queue for the ring but not yet finished:
+// the one being queued (ring_queue reaps while it waits for room) or one
+// in flight. Disk thread only.
+static int ring_write_conflict(const DiskRequest *req) {
+    if (ring_queuing && requests_conflict(ring_queuing, req))
+        return 1;
+    for (int i = 0; i < ring_count; i++) {
+        if (requests_conflict(ring_inflight[i], req))
+            return 1;
+    }
+    return 0;
+}
+
+// Called by the disk thread once a single-block read has been serviced.
+// The block isn't cached if a write to it hasn't reached the image yet.
+static void cache_fill(DiskRequest *req) {
+    long long lba = block_lba(req->c, req->s);
+    pthread_mutex_lock(&cache_lock);
+    if (cache_find(lba) < 0 && !ring_write_conflict(req)) {
+        pthread_mutex_lock(&sched_lock);
+        DiskRequest *w = pending_head;
+        while (w && !requests_conflict(w, req))
+            w = w->next;
+        pthread_mutex_unlock(&sched_lock);
+
+        int i = w ? -1 : cache_alloc(lba);
+        if (i >= 0)
+            memcpy(cache_entries[i].data, req->buf, block_size);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Queue a range request behind the cache. Dirty blocks an RN covers are
+// written back first; blocks a WN overwrites or a D discards are simply
+// dropped.
+static void cache_submit_range(DiskRequest *req) {
+    long long lba = block_lba(req->c, req->s);
+    pthread_mutex_lock(&cache_lock);
+    if (req->is_discard && req->n > cache_capacity) {
+        // A large discard: walk the cache rather than the range
+        int i = cache_lru_head;
+        while (i >= 0) {
+            int next = cache_entries[i].next;
+            if (cache_entries[i].lba >= lba && cache_entries[i].lba < lba + req->n)
+                cache_remove(i);
+            i = next;
+        }
+        submit_request(req);
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    for (long long b = lba; b < lba + req->n; b++) {
+        int i = cache_find(b);
+        if (i < 0) continue;
+        if (req->is_write) {
+            cache_remove(i);
+        } else if (cache_entries[i].dirty && queue_writeback(b, cache_entries[i].data)) {
+            cache_entries[i].dirty = 0;
+            cache_dirty_count--;
+        }
+    }
+    submit_request(req);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static int compare_lba(const void *a, const void *b) {
+    long long x = cache_entries[*(const int *)a].lba;
+    long long y = cache_entries[*(const int *)b].lba;
+    return (x > y) - (x < y);
+}
+
+// Write every dirty block back in cylinder order and wait for all
+// outstanding write-backs to reach the image.
+static int cache_flush(void) {
+    int ok = 1;
+    pthread_mutex_lock(&cache_lock);
+    if (cache_dirty_count > 0) {
+        int *dirty = malloc(cache_dirty_count * sizeof(int));
+        if (!dirty) {
+            pthread_mutex_unlock(&cache_lock);
+            return 0;
+        }
+        int nd = 0;
+        for (int i = cache_lru_head; i >= 0; i = cache_entries[i].next) {
+            if (cache_entries[i].dirty)
+                dirty[nd++] = i;
+        }
+        qsort(dirty, nd, sizeof(int), compare_lba);
+        for (int k = 0; k < nd; k++) {
+            CacheEntry *e = &cache_entries[dirty[k]];
+            if (!queue_writeback(e->lba, e->data)) {
+                ok = 0;
+                continue;
+            }
+            e->dirty = 0;
+            cache_dirty_count--;
+        }
+        free(dirty);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    pthread_mutex_lock(&sched_lock);
+    while (writebacks_inflight > 0)
+        pthread_cond_wait(&writebacks_idle, &sched_lock);
+    pthread_mutex_unlock(&sched_lock);
+    return ok;
+}
+
+// Try to satisfy a request from the cache; otherwise queue it.
+static void submit_cached(DiskRequest *req) {
+    if (req->n > 1 || req->is_discard) {
+        cache_submit_range(req);
+        return;
+    }
+    long long lba = block_lba(req->c, req->s);
+    int hit = req->is_write ? cache_write(lba, req->buf) : cache_read(lba, req->buf);
+    if (hit) {
+        req->status = 1;
+        req->done = 1;
+        req->sim_done = sim_clock_now();
+    } else {
+        submit_request(req);
+    }
+}
+
+// Disk thread
+
+// A range of blocks is contiguous in the image, so the whole request is a
+// single positioned read or write (no lseek); the loop only covers short
+// transfers.
+//
+// In mmap mode a write is a memcpy into the mapping and a one-block read
+// a memcpy out of it. A range read does no copy at all: req->buf is
+// pointed into the mapping and the reply is sent to the socket straight
+// from there, with writes to those blocks held off while it goes out
+// (map_sending).
+//
+// A discard punches a hole, which also drops the pages from the mapping.
+// Filesystems without hole punching get zeros written instead.
+static int discard_blocks(off_t offset, off_t len) {
+    if (fallocate(disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+        return 1;
+    if (errno != EOPNOTSUPP) {
+        perror("fallocate (discard)");
+        return 0;
+    }
+    if (disk_map) {
+        memset(disk_map + offset, 0, len);
+        return 1;
+    }
+    size_t chunk = (size_t)max_range_blocks * block_size;
+    for (off_t done = 0; done < len; ) {
+        size_t want = len - done < (off_t)chunk ? (size_t)(len - done) : chunk;
+        ssize_t n = pwrite(disk_fd, zero_blocks, want, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror("pwrite (discard)");
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+// Disk thread, -m: wait until no RN reply is being sent from blocks
+// [lba, lba + n). Returns with map_send_lock held, so none can start until
+// the caller has changed them.
+static void map_lock_blocks(long long lba, long long n) {
+    pthread_mutex_lock(&map_send_lock);
+    MapSend *m = map_sending;
+    while (m) {
+        if (m->lba < lba + n && lba < m->lba + m->n) {
+            pthread_cond_wait(&map_send_done, &map_send_lock);
+            m = map_sending;
+        } else {
+            m = m->next;
+        }
+    }
+}
+
+static int service_request(DiskRequest *req) {
+    off_t offset = get_offset(req->c, req->s);
+    size_t len = (size_t)req->n * block_size;
+    size_t done = 0;
+
+    if (zmap)
+        return zstore_service(req);
+
+    if (disk_map && req->is_write) {
+        map_lock_blocks(block_lba(req->c, req->s), req->n);
+        int ok = 1;
+        if (req->is_discard)
+            ok = discard_blocks(offset, (off_t)len);
+        else
+            memcpy(disk_map + offset, req->buf, len);
+        pthread_mutex_unlock(&map_send_lock);
+        return ok;
+    }
+    if (req->is_discard)
+        return discard_blocks(offset, (off_t)len);
+
+    if (disk_map) {
+        if (req->n == 1)
+            memcpy(req->buf, disk_map + offset, len);
+        else
+            req->buf = disk_map + offset;
+        return 1;
+    }
+
+    while (done < len) {
+        ssize_t n;
+        if (req->is_write)
+            n = pwrite(disk_fd, req->buf + done, len - done, offset + done);
+        else
+            n = pread(disk_fd, req->buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror(req->is_write ? "pwrite (disk)" : "pread (disk)");
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+// Runs on the disk thread once a request's transfer has finished.
+static void complete_request(DiskRequest *req, int status) {
+    int bad = 0;
+    if (crc_table && status) {
+        bad = crc_check(req);
+        status = bad == 0;
+    }
+    if (cache_capacity > 0 && status && !req->is_write && req->n == 1)
+        cache_fill(req);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long lat = elapsed_usec(&req->submitted, &now);
+
+    pthread_mutex_lock(&sched_lock);
+    stat_requests++;
+    stat_checksum_errors += bad;
+    if (req->is_discard) {
+        stat_discards++;
+        stat_discarded_blocks += req->n;
+    } else {
+        stat_blocks += req->n;
+    }
+    stat_seek_distance += req->seek_dist;
+    stat_latency_usec += lat;
+    stat_sim_latency_usec += req->sim_done - req->sim_submitted;
+    if (req->sim_done > sim_clock_usec)
+        sim_clock_usec = req->sim_done;
+    if (lat > stat_max_latency_usec)
+        stat_max_latency_usec = lat;
+    if (req->detached) {
+        if (!status)
+            fprintf(stderr, "write-back of block %lld/%lld failed\n", req->c, req->s);
+        if (--writebacks_inflight == 0)
+            pthread_cond_broadcast(&writebacks_idle);
+        if (req->journaled) {
+            journal_outstanding[req->journal_gen]--;
+            pthread_cond_broadcast(&journal_applied);
+        }
+        pthread_mutex_unlock(&sched_lock);
+        free(req);
+        return;
+    }
+    req->status = status;
+    req->done = 1;
+    pthread_cond_signal(&req->done_cond);
+    pthread_mutex_unlock(&sched_lock);
+}
+
+// io_uring backend (-u)
+//
+// The disk thread doesn't block in pread/pwrite. It keeps picking requests
+// in scheduler order, charges their seeks, and queues each transfer on the
+// ring. Queued entries go to the kernel in one io_uring_enter when the
+// request queue runs dry, the ring fills, or the arm is about to sleep for
+// a seek, so transfers overlap the simulated seek time. The kernel may
+// finish ring entries in any order, so a request that conflicts with one
+// still in flight waits for it first.
+
+// Collect finished transfers; with wait set, submit and block for one.
+static void ring_reap(int wait) {
+    if (wait && ioring_submit(&ring, 1) < 0)
+        perror("io_uring_enter");
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = ioring_peek_cqe(&ring)) != NULL) {
+        DiskRequest *req = (DiskRequest *)(unsigned long)cqe->user_data;
+        int res = cqe->res;
+        ioring_cqe_seen(&ring);
+
+        for (int i = 0; i < ring_count; i++) {
+            if (ring_inflight[i] == req) {
+                ring_inflight[i] = ring_inflight[--ring_count];
+                break;
+            }
+        }
+        // A failed or short transfer is redone synchronously, which also
+        // reports the error (or, for a discard, falls back to zeroing)
+        int expected = req->is_discard ? 0 : req->n * block_size;
+        int status = res == expected ? 1 : service_request(req);
+        complete_request(req, status);
+    }
+}
+
+static int ring_conflicts(const DiskRequest *req) {
+    for (int i = 0; i < ring_count; i++) {
+        if (requests_conflict(ring_inflight[i], req))
+            return 1;
+    }
+    return 0;
+}
+
+static void ring_queue(DiskRequest *req) {
+    // Reads reaped meanwhile must see req as a write still to come
+    ring_queuing = req;
+    while (ring_count == RING_ENTRIES || ring_conflicts(req))
+        ring_reap(1);
+    ring_queuing = NULL;
+
+    struct io_uring_sqe *sqe = ioring_get_sqe(&ring);
+    if (req->is_discard)
+        ioring_prep_fallocate(sqe, disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                              get_offset(req->c, req->s), (off_t)req->n * block_size, req);
+    else
+        ioring_prep_rw(sqe, req->is_write ? IORING_OP_WRITE : IORING_OP_READ, disk_fd,
+                       req->buf, (unsigned)req->n * block_size, get_offset(req->c, req->s), req);
+    ring_inflight[ring_count++] = req;
+    ring_reap(0);
+}
+
+static void *disk_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&sched_lock);
+        while (!pending_head) {
+            if (ring_count > 0) {
+                pthread_mutex_unlock(&sched_lock);
+                ring_reap(1);
+                pthread_mutex_lock(&sched_lock);
+                continue;
+            }
+            pthread_cond_wait(&sched_nonempty, &sched_lock);
+        }
+        long long sweep_to;
+        DiskRequest *req = pick_next(&sweep_to);
+        unlink_pending(req);
+        pthread_mutex_unlock(&sched_lock);
+
+        long long dist = 0;
+        if (sweep_to >= 0)
+            dist += simulate_seek(sweep_to);
+        // A discard only updates the image's block map; the arm stays put
+        if (!req->is_discard)
+            dist += simulate_access(req);
+        req->seek_dist = dist;
+        req->sim_done = disk_clock_usec;
+        pay_disk_time();
+
+        pthread_mutex_lock(&sched_lock);
+        stat_seek_usec += seek_charged;
+        stat_rotation_usec += rotation_charged;
+        stat_transfer_usec += transfer_charged;
+        pthread_mutex_unlock(&sched_lock);
+        seek_charged = rotation_charged = transfer_charged = 0;
+
+        if (use_ring)
+            ring_queue(req);     // may complete (and free) req before returning
+        else
+            complete_request(req, service_request(req));
+    }
+    return NULL;
+}
+
+// "F": make every write acknowledged so far durable, with its checksums
+static int flush_disk(void) {
+    if (zmap) {
+        pthread_mutex_lock(&zstore_lock);
+        int ok = zstore_commit();
+        pthread_mutex_unlock(&zstore_lock);
+        if (!ok)
+            return 0;
+    } else if (disk_map) {
+        if (msync(disk_map, disk_size, MS_SYNC) < 0) {
+            perror("msync");
+            return 0;
+        }
+    } else if (fsync(disk_fd) < 0) {
+        perror("fsync");
+        return 0;
+    }
+    return crc_flush();
+}
+
+// Scrubber (-r <blocks per second>)
+//
+// Rereads the whole disk in cylinder order, a range at a time, through the
+// scheduler like any client, so every block's checksum gets checked even
+// if nobody reads it; then starts over. Sleeps after each range to stay
+// under the rate. Never-written blocks are skipped by the read fast path.
+
+static long long stat_scrubbed_blocks, stat_scrub_passes;   // under sched_lock
+
+static void *scrubber(void *arg) {
+    (void)arg;
+    long long total = num_cylinders * sectors_per_cylinder;
+    int chunk = scrub_rate < max_range_blocks ? scrub_rate : max_range_blocks;
+    DiskRequest *req = calloc(1, sizeof(*req));
+    unsigned char *buf = malloc((size_t)chunk * block_size);
+    if (!req || !buf) {
+        perror("scrubber");
+        free(req);
+        free(buf);
+        return NULL;
+    }
+    pthread_cond_init(&req->done_cond, NULL);
+
+    while (1) {
+        long long failed = 0;
+        for (long long lba = 0; lba < total; lba += req->n) {
+            req->is_write = 0;
+            req->is_discard = 0;
+            req->c = lba / sectors_per_cylinder;
+            req->s = lba % sectors_per_cylinder;
+            req->n = total - lba < chunk ? (int)(total - lba) : chunk;
+            req->buf = buf;
+            submit_request(req);
+            if (!wait_request(req))
+                failed++;
+            pthread_mutex_lock(&sched_lock);
+            stat_scrubbed_blocks += req->n;
+            pthread_mutex_unlock(&sched_lock);
+            usleep((useconds_t)((long long)req->n * 1000000 / scrub_rate));
+        }
+        pthread_mutex_lock(&sched_lock);
+        stat_scrub_passes++;
+        pthread_mutex_unlock(&sched_lock);
+        if (failed > 0)
+            fprintf(stderr, "scrub pass finished: %lld ranges failed\n", failed);
+    }
+    return NULL;
+}
+
+// Write-ahead journal (-j <file>)
+//
+// Without a journal a write is acknowledged once it is in the page cache,
+// and only F makes it durable. With one, every write and discard is
+// appended to the log and acknowledged once the log has been fdatasync'd;
+// a copy is queued on the scheduler as a detached request, like a cache
+// write-back, which applies it to the image in the background.
+//
+// Group commit: records from every connection are appended to an
+// in-memory buffer. Whoever waits for its record first and finds no commit
+// running becomes the leader: it takes the whole buffer, writes it with one
+// pwrite and one fdatasync, and wakes everyone it covered. Writers that
+// arrive meanwhile fill the other buffer for the next leader, so a single
+// fdatasync acknowledges many clients' writes.
+//
+// Checkpoints: once the log grows past JOURNAL_CHECKPOINT_BYTES, or after a
+// quiet second, the checkpointer starts a new generation, waits for the
+// old generation's image writes to complete, flushes the image, and moves
+// the header's replay point past them. The dead records are punched out of
+// the file, or the file is truncated if nothing newer has been logged. At
+// startup the records after the replay point are applied to the image,
+// stopping at the first torn or out-of-sequence one.
+//
+// The log is taken to sit on a device of its own, so appending to it costs
+// no modelled disk time; the image writes pay for their seeks as usual.
+
+#define JOURNAL_DATA_START 4096            // records start here; header below
+#define JOURNAL_CHECKPOINT_BYTES (16 << 20)
+#define JOURNAL_MAX_OUTSTANDING 4096       // image writes queued before writers wait
+#define JOURNAL_REC_MAGIC 0x4345524aU      // "JREC"
+
+typedef struct {
+    char magic[4];               // "DJ01"
+    int block_size;
+    long long replay_from;       // file offset of the first live record
+    long long reserved[5];
+} JournalHeader;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int type;           // 'W' or 'D'
+    int n;                       // blocks
+    unsigned int data_len;       // n * block_size for W, 0 for D
+    long long lba;
+    unsigned long long seq;      // consecutive within the log
+    unsigned long long sum;      // FNV-1a of the data, then of this header with sum 0
+} JournalRecord;
+
+typedef struct {
+    unsigned char *data;
+    size_t len, cap;
+} JournalBuf;
+
+// Log positions are logical byte counts that never go back, so a waiter's
+// position stays meaningful across truncations; journal_base is the
+// position stored at JOURNAL_DATA_START. All protected by journal_lock.
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_durable_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t journal_work = PTHREAD_COND_INITIALIZER;
+static JournalBuf journal_bufs[2];
+static int journal_active;           // journal_bufs[] index being appended to
+static long long journal_base;
+static long long journal_end;        // after the last appended record
+static long long journal_written;    // ...the last one handed to a leader
+static long long journal_durable;    // ...the last one fdatasync'd
+static long long journal_ckpt;       // replay point
+static unsigned long long journal_seq;
+static int journal_gen;
+static int journal_committing;
+static int journal_failed;
+static long long stat_journal_records;
+static long long stat_journal_commits;
+static long long stat_journal_checkpoints;
+
+static unsigned long long fnv1a(unsigned long long h, const void *p, size_t len) {
+    const unsigned char *b = p;
+    for (size_t i = 0; i < len; i++) {
+        h ^= b[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static off_t journal_offset(long long pos) {
+    return JOURNAL_DATA_START + (pos - journal_base);
+}
+
+static int journal_write_header(long long replay_from) {
+    JournalHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "DJ01", 4);
+    h.block_size = block_size;
+    h.replay_from = replay_from;
+    if (!pwrite_all(journal_fd, &h, sizeof(h), 0) || fdatasync(journal_fd) < 0) {
+        perror("journal header");
+        return 0;
+    }
+    return 1;
+}
+
+// Apply the live records of an existing journal to the image, then start
+// an empty one. Runs before anything else touches the image.
+static int journal_open(const char *path) {
+    journal_fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (journal_fd < 0) {
+        perror("open journal");
+        return 0;
+    }
+
+    JournalHeader h;
+    ssize_t got = pread(journal_fd, &h, sizeof(h), 0);
+    if (got == (ssize_t)sizeof(h)) {
+        if (memcmp(h.magic, "DJ01", 4) != 0 || h.block_size != block_size) {
+            fprintf(stderr, "%s is not a journal for %d-byte blocks\n", path, block_size);
+            return 0;
+        }
+        long long total = num_cylinders * sectors_per_cylinder;
+        size_t cap = (size_t)max_range_blocks * block_size;
+        unsigned char *data = malloc(cap);
+        if (!data) {
+            perror("malloc");
+            return 0;
+        }
+        off_t pos = h.replay_from;
+        unsigned long long seq = 0;
+        int replayed = 0;
+        JournalRecord rec;
+        while (pread(journal_fd, &rec, sizeof(rec), pos) == (ssize_t)sizeof(rec) &&
+               rec.magic == JOURNAL_REC_MAGIC && (replayed == 0 || rec.seq == seq) &&
+               rec.n > 0 && rec.lba >= 0 && rec.lba + rec.n <= total &&
+               ((rec.type == 'W' && rec.data_len == (unsigned int)rec.n * block_size &&
+                 rec.data_len <= cap) ||
+                (rec.type == 'D' && rec.data_len == 0))) {
+            if (pread(journal_fd, data, rec.data_len, pos + sizeof(rec)) != (ssize_t)rec.data_len)
+                break;
+            unsigned long long sum = rec.sum;
+            rec.sum = 0;
+            if (fnv1a(fnv1a(0xcbf29ce484222325ULL, data, rec.data_len), &rec, sizeof(rec)) != sum)
+                break;   // torn by a crash mid-append
+            off_t off = (off_t)rec.lba * block_size;
+            int ok = 1;
+            if (rec.type == 'W')
+                ok = zmap ? zstore_write(rec.lba, rec.n, data)
+                          : pwrite_all(disk_fd, data, rec.data_len, off);
+            else if (zmap)
+                zstore_discard(rec.lba, rec.n);
+            else
+                ok = discard_blocks(off, (off_t)rec.n * block_size);
+            if (!ok) {
+                perror("journal replay");
+                free(data);
+                return 0;
+            }
+            if (crc_table)
+                crc_set(rec.lba, rec.n, rec.type == 'W' ? data : NULL);
+            replayed++;
+            seq = rec.seq + 1;
+            pos += sizeof(rec) + rec.data_len;
+        }
+        free(data);
+        if (replayed > 0) {
+            if (!flush_disk())
+                return 0;
+            printf("Journal: replayed %d records\n", replayed);
+        }
+    }
+
+    if (ftruncate(journal_fd, JOURNAL_DATA_START) < 0) {
+        perror("ftruncate journal");
+        return 0;
+    }
+    return journal_write_header(JOURNAL_DATA_START);
+}
+
+// Log a copy of req, which is about to be queued for the image. Caller
+// holds journal_lock. Returns the position to wait for, or -1.
+static long long journal_append(DiskRequest *req) {
+    size_t data_len = req->is_discard ? 0 : (size_t)req->n * block_size;
+    JournalBuf *jb = &journal_bufs[journal_active];
+    size_t need = jb->len + sizeof(JournalRecord) + data_len;
+    if (need > jb->cap) {
+        size_t cap = jb->cap ? jb->cap : 65536;
+        while (cap < need)
+            cap *= 2;
+        unsigned char *p = realloc(jb->data, cap);
+        if (!p) {
+            perror("realloc (journal)");
+            return -1;
+        }
+        jb->data = p;
+        jb->cap = cap;
+    }
+
+    JournalRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = JOURNAL_REC_MAGIC;
+    rec.type = req->is_discard ? 'D' : 'W';
+    rec.n = req->n;
+    rec.data_len = (unsigned int)data_len;
+    rec.lba = block_lba(req->c, req->s);
+    rec.seq = journal_seq++;
+    rec.sum = fnv1a(fnv1a(0xcbf29ce484222325ULL, req->buf, data_len), &rec, sizeof(rec));
+    memcpy(jb->data + jb->len, &rec, sizeof(rec));
+    memcpy(jb->data + jb->len + sizeof(rec), req->buf, data_len);
+    jb->len = need;
+    journal_end += sizeof(rec) + data_len;
+    stat_journal_records++;
+    if (journal_end - journal_ckpt >= JOURNAL_CHECKPOINT_BYTES)
+        pthread_cond_signal(&journal_work);
+
+    req->journaled = 1;
+    req->journal_gen = journal_gen;
+    pthread_mutex_lock(&sched_lock);
+    journal_outstanding[journal_gen]++;
+    pthread_mutex_unlock(&sched_lock);
+    return journal_end;
+}
+
+// Log a write or discard and queue it for the image. Returns the log
+// position to pass to journal_wait(), or -1.
+static long long journal_submit(const DiskRequest *req) {
+    size_t data_len = req->is_discard ? 0 : (size_t)req->n * block_size;
+
+    // Don't let the log run arbitrarily far ahead of the image
+    pthread_mutex_lock(&sched_lock);
+    while (journal_outstanding[0] + journal_outstanding[1] >= JOURNAL_MAX_OUTSTANDING)
+        pthread_cond_wait(&journal_applied, &sched_lock);
+    pthread_mutex_unlock(&sched_lock);
+
+    DiskRequest *wb = calloc(1, sizeof(DiskRequest) + data_len);
+    if (!wb) {
+        perror("calloc (journal)");
+        return -1;
+    }
+    wb->is_write = 1;
+    wb->is_discard = req->is_discard;
+    wb->c = req->c;
+    wb->s = req->s;
+    wb->n = req->n;
+    wb->buf = (unsigned char *)(wb + 1);
+    wb->detached = 1;
+    memcpy(wb->buf, req->buf, data_len);
+
+    // Appending and queueing under one lock keeps the image writes in log
+    // order wherever they overlap
+    pthread_mutex_lock(&journal_lock);
+    long long pos = journal_failed ? -1 : journal_append(wb);
+    if (pos >= 0) {
+        if (cache_capacity > 0)
+            cache_submit_range(wb);  // drops any cached copy of the blocks
+        else
+            submit_request(wb);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    if (pos < 0)
+        free(wb);
+    return pos;
+}
+
+// Wait until the log is durable up to pos, leading a group commit if none
+// is running. Returns 1 on success.
+static int journal_wait(long long pos) {
+    pthread_mutex_lock(&journal_lock);
+    while (journal_durable < pos && !journal_failed) {
+        if (journal_committing) {
+            pthread_cond_wait(&journal_durable_cond, &journal_lock);
+            continue;
+        }
+        journal_committing = 1;
+        JournalBuf *jb = &journal_bufs[journal_active];
+        journal_active ^= 1;
+        off_t off = journal_offset(journal_written);
+        long long target = journal_end;
+        journal_written = target;
+        pthread_mutex_unlock(&journal_lock);
+
+        int ok = pwrite_all(journal_fd, jb->data, jb->len, off) && fdatasync(journal_fd) == 0;
+        if (!ok)
+            perror("journal commit");
+        jb->len = 0;
+
+        pthread_mutex_lock(&journal_lock);
+        journal_committing = 0;
+        if (ok) {
+            journal_durable = target;
+            stat_journal_commits++;
+        } else {
+            journal_failed = 1;
+        }
+        pthread_cond_broadcast(&journal_durable_cond);
+    }
+    int ok = !journal_failed;
+    pthread_mutex_unlock(&journal_lock);
+    return ok;
+}
+
+static void *journal_checkpointer(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&journal_lock);
+    while (1) {
+        if (journal_end - journal_ckpt < JOURNAL_CHECKPOINT_BYTES) {
+            long long seen = journal_end;
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += 1;
+            pthread_cond_timedwait(&journal_work, &journal_lock, &until);
+            // Below the threshold, only a quiet log is checkpointed
+            if (journal_end - journal_ckpt < JOURNAL_CHECKPOINT_BYTES &&
+                (journal_end == journal_ckpt || journal_end != seen))
+                continue;
+        }
+
+        long long upto = journal_end;
+        int old = journal_gen;
+        journal_gen ^= 1;
+        pthread_mutex_unlock(&journal_lock);
+
+        pthread_mutex_lock(&sched_lock);
+        while (journal_outstanding[old] > 0)
+            pthread_cond_wait(&journal_applied, &sched_lock);
+        pthread_mutex_unlock(&sched_lock);
+        int ok = flush_disk();
+
+        pthread_mutex_lock(&journal_lock);
+        if (!ok)
+            continue;    // try again; the records are still in the log
+        journal_ckpt = upto;
+        stat_journal_checkpoints++;
+        if (journal_end == upto && journal_durable == upto) {
+            // Everything logged is in the image: start the file over
+            journal_base = journal_written = upto;
+            if (ftruncate(journal_fd, JOURNAL_DATA_START) < 0)
+                perror("ftruncate journal");
+            journal_write_header(JOURNAL_DATA_START);
+        } else if (journal_write_header(journal_offset(upto))) {
+            // Free the space of the records before the new replay point
+            off_t dead = journal_offset(upto) - JOURNAL_DATA_START;
+            if (dead > 0 &&
+                fallocate(journal_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          JOURNAL_DATA_START, dead) < 0 && errno != EOPNOTSUPP)
+                perror("fallocate journal");
+        }
+    }
+    return NULL;
+}
+
+// Network handling
+//
+// Each connection reads commands through its own buffer rather than a FILE*.
+// Everything that arrived in one recv() is parsed into a batch, all of the
+// batch's R/W requests are queued at once (so the scheduler sees the whole
+// queue depth), and the replies go back in a single writev().
+//
+// A command may be prefixed with "T <id> " to tag it; its reply is then
+// prefixed with "<id> " so a client can keep many requests in flight.
+// Replies are always sent in the order the commands arrived.
+//
+// "F" writes back the cache's dirty blocks and flushes the image to stable
+// storage (msync in mmap mode, fsync otherwise) once every earlier command
+// on the connection has completed.
+//
+// "I" replies "<cylinders> <sectors per cylinder> <block size>". R and W
+// move one block of that size.
+//
+// "RN c s n" reads n consecutive blocks starting at (c,s) and replies '1'
+// followed by n * block_size bytes. "WN c s n" is followed by n * block_size
+// bytes of data. n is at most 256 blocks and at most 1 MiB. Ranges continue onto the next cylinder and cost one request
+// on the scheduler and one read or write; the timing model charges them
+// track by track.
+//
+// "D c s n" discards n consecutive blocks starting at (c,s) and replies
+// '1' or '0'. The blocks' space is returned to the host filesystem (the
+// image is sparse) and they read back as zeros; n is limited only by the
+// size of the disk. Reads of blocks that were never written, or have been
+// discarded, are answered with zeros without a seek.
+//
+// With -j, W, WN and D are acknowledged once they are in the journal and
+// the journal is on stable storage (see the journal section).
+//
+// With -k, an R or RN that touches a block whose checksum doesn't match
+// fails with '0' (see the checksum section).
+//
+// "V" replies with the simulated clock in microseconds: the modelled time
+// at which the latest request completed. Two V's bracket a run's simulated
+// service time, which with -v (no sleeping) is the figure to compare.
+//
+// "B" answers '1' and switches the connection to binary framing for the
+// rest of its life. Every request is then a fixed 20-byte header followed
+// by `length` payload bytes; all fields are little-endian:
+//
+//   0  u8  op        'I', 'R', 'W', 'D', 'S', 'F' or 'V'
+//   1  u8  flags     FRAME_SIM_TIME: return the simulated completion time
+//   2  u16 count     blocks for R/W/D (0 means 1)
+//   4  u32 tag       echoed in the reply
+//   8  u32 cylinder
+//  12  u32 sector
+//  16  u32 length    payload bytes (W data, zero-padded to count blocks)
+//
+// and every reply a 16-byte header followed by `length` payload bytes:
+//
+//   0  u8  status    1 = success, 0 = failure
+//   1  u8  op
+//   2  u16 flags     FRAME_SIM_TIME if the request asked for it
+//   4  u32 tag
+//   8  u32 length    R: the blocks; I: u32 cylinders, u32 sectors,
+//                    u32 block size; S: text; V: u64 simulated clock
+//  12  u32 reserved  0
+//
+// With FRAME_SIM_TIME set, a u64 simulated completion time sits between the
+// header and the payload; `length` doesn't count it. Binary frames reach the
+// first 2^32 cylinders and sectors; the ASCII protocol reaches all of them.
+
+#define MAX_BATCH     64
+#define MAX_LINE      1024
+#define IN_BUF_SIZE   (MAX_RANGE_BYTES + MAX_LINE)   // the largest WN fits
+#define REQ_HDR_SIZE  20
+#define RESP_HDR_SIZE 16
+#define FRAME_SIM_TIME 0x01
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Per-command statistics. Each connection counts its own commands, bytes
+// and latencies (from parsing to the reply going out) in a ConnStats that
+// only its thread writes, without locks (histogram.h's _shared calls); S
+// sums them. stats_lock only guards the list, taken when a connection
+// comes or goes and by S, and a closed connection's counts are folded into
+// retired_stats.
+enum { CMD_R, CMD_W, CMD_RN, CMD_WN, CMD_D, CMD_F, CMD_I, CMD_S, CMD_V, CMD_B, CMD_OTHER, NUM_CMDS };
+static const char *cmd_names[NUM_CMDS] = { "R", "W", "RN", "WN", "D", "F", "I", "S", "V", "B", "other" };
+
+typedef struct ConnStats {
+    long long count[NUM_CMDS];
+    long long failed[NUM_CMDS];
+    long long bytes_read, bytes_written;     // block data
+    Histogram latency[NUM_CMDS];             // microseconds
+    struct ConnStats *next;
+} ConnStats;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static ConnStats *live_stats;
+static ConnStats retired_stats;
+
+typedef struct {
+    int has_req;
+    DiskRequest req;
+    char head[96];               // tag prefix + status byte, short text reply,
+    int head_len;                // or binary reply header (+ I payload)
+    int binary;
+    int op;                      // binary: request op and tag
+    unsigned int tag;
+    int failed;                  // rejected while parsing
+    int is_stats;
+    int is_flush;
+    int is_clock;                // V
+    int want_time;               // binary FRAME_SIM_TIME
+    char *text;                  // longer text reply (S), malloc'd
+    int text_len;
+    unsigned char *data;         // one block, carved from Conn.block_data
+    unsigned char *range_buf;    // RN/WN data, malloc'd
+    MapSend map_send;            // -m RN: the range, while the reply is sent
+    long long journal_pos;       // -j writes: log position to wait for (-1: failed)
+    int cmd;                     // CMD_*, for the stats
+    struct timespec arrived;
+} ReplySlot;
+
+typedef struct {
+    int fd;
+    unsigned char in[IN_BUF_SIZE];
+    size_t in_start, in_end;
+    int binary;                  // switched to binary framing by "B"
+    ReplySlot slots[MAX_BATCH];
+    int nslots;
+    unsigned char *block_data;   // MAX_BATCH blocks backing slots[].data
+    unsigned int id;             // connection number, for the trace
+    ConnStats *stats;
+} Conn;
+
+static unsigned int get_le16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int get_le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static void put_le16(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static void put_le64(unsigned char *p, unsigned long long v) {
+    put_le32(p, (unsigned int)v);
+    put_le32(p + 4, (unsigned int)(v >> 32));
+}
+
+// Connection threads only, on their own ConnStats
+static void count_command(ConnStats *st, const ReplySlot *slot, int ok,
+                          const struct timespec *now) {
+    counter_add(&st->count[slot->cmd], 1);
+    if (!ok) {
+        counter_add(&st->failed[slot->cmd], 1);
+    } else if (slot->has_req && !slot->req.is_discard) {
+        long long bytes = (long long)slot->req.n * block_size;
+        counter_add(slot->req.is_write ? &st->bytes_written : &st->bytes_read, bytes);
+    }
+    hist_record_shared(&st->latency[slot->cmd], elapsed_usec(&slot->arrived, now));
+}
+
+static void stats_register(ConnStats *st) {
+    pthread_mutex_lock(&stats_lock);
+    st->next = live_stats;
+    live_stats = st;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_merge(ConnStats *dst, const ConnStats *src) {
+    for (int i = 0; i < NUM_CMDS; i++) {
+        dst->count[i] += counter_read(&src->count[i]);
+        dst->failed[i] += counter_read(&src->failed[i]);
+        hist_merge_shared(&dst->latency[i], &src->latency[i]);
+    }
+    dst->bytes_read += counter_read(&src->bytes_read);
+    dst->bytes_written += counter_read(&src->bytes_written);
+}
+
+// A closing connection's counts move to retired_stats
+static void stats_retire(ConnStats *st) {
+    pthread_mutex_lock(&stats_lock);
+    ConnStats **p = &live_stats;
+    while (*p != st)
+        p = &(*p)->next;
+    *p = st->next;
+    stats_merge(&retired_stats, st);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// "S": one "key value" line per statistic, terminated by "END"
+static char *format_stats(int *out_len) {
+    pthread_mutex_lock(&sched_lock);
+    long long reqs = stat_requests;
+    long long blocks = stat_blocks;
+    long long dist = stat_seek_distance;
+    long long lat = stat_latency_usec;
+    long long max_lat = stat_max_latency_usec;
+    long long sim_lat = stat_sim_latency_usec;
+    long long sim_time = sim_clock_usec;
+    long long seek_time = stat_seek_usec;
+    long long rotation_time = stat_rotation_usec;
+    long long transfer_time = stat_transfer_usec;
+    long long zero_reads = stat_zero_reads;
+    long long discards = stat_discards;
+    long long discarded = stat_discarded_blocks;
+    long long allocated = alloc_map ? allocated_blocks : num_cylinders * sectors_per_cylinder;
+    long long checksum_errors = stat_checksum_errors;
+    long long scrubbed = stat_scrubbed_blocks;
+    long long scrub_passes = stat_scrub_passes;
+    pthread_mutex_unlock(&sched_lock);
+
+    pthread_mutex_lock(&cache_lock);
+    long long hits = stat_cache_hits;
+    long long misses = stat_cache_misses;
+    long long writebacks = stat_cache_writebacks;
+    int dirty = cache_dirty_count;
+    pthread_mutex_unlock(&cache_lock);
+
+    pthread_mutex_lock(&journal_lock);
+    long long jrecords = stat_journal_records;
+    long long jcommits = stat_journal_commits;
+    long long jcheckpoints = stat_journal_checkpoints;
+    long long jlive = journal_end - journal_ckpt;
+    pthread_mutex_unlock(&journal_lock);
+
+    pthread_mutex_lock(&zstore_lock);
+    long long zlogical = zstat_logical * block_size;
+    long long zunique = zstat_unique;
+    long long zstored = zstat_stored;
+    long long zdedup = zstat_dedup_hits;
+    long long zfile = zstore_end;
+    pthread_mutex_unlock(&zstore_lock);
+
+    ConnStats *sum = calloc(1, sizeof(ConnStats));
+    if (!sum) return NULL;
+    pthread_mutex_lock(&stats_lock);
+    stats_merge(sum, &retired_stats);
+    for (ConnStats *st = live_stats; st; st = st->next)
+        stats_merge(sum, st);
+    pthread_mutex_unlock(&stats_lock);
+
+    size_t cap = 2048 + NUM_CMDS * 7 * 48;
+    char *out = malloc(cap);
+    if (!out) {
+        free(sum);
+        return NULL;
+    }
+    int n = snprintf(out, cap,
+                     "policy %s\n"
+                     "requests %lld\n"
+                     "blocks %lld\n"
+                     "seek_distance %lld\n"
+                     "avg_seek_distance %.2f\n"
+                     "avg_latency_usec %.1f\n"
+                     "max_latency_usec %lld\n"
+                     "sim_time_usec %lld\n"
+                     "avg_sim_latency_usec %.1f\n"
+                     "seek_usec %lld\n"
+                     "rotation_usec %lld\n"
+                     "transfer_usec %lld\n"
+                     "allocated_blocks %lld\n"
+                     "zero_reads %lld\n"
+                     "discards %lld\n"
+                     "discarded_blocks %lld\n"
+                     "cache_blocks %d\n"
+                     "cache_hits %lld\n"
+                     "cache_misses %lld\n"
+                     "cache_hit_rate %.4f\n"
+                     "cache_dirty %d\n"
+                     "cache_writebacks %lld\n"
+                     "journal_records %lld\n"
+                     "journal_commits %lld\n"
+                     "avg_records_per_commit %.2f\n"
+                     "journal_checkpoints %lld\n"
+                     "journal_live_bytes %lld\n"
+                     "checksums %s\n"
+                     "checksum_errors %lld\n"
+                     "scrubbed_blocks %lld\n"
+                     "scrub_passes %lld\n"
+                     "store %s\n"
+                     "store_logical_bytes %lld\n"
+                     "store_unique_blocks %lld\n"
+                     "store_dedup_hits %lld\n"
+                     "store_stored_bytes %lld\n"
+                     "store_file_bytes %lld\n"
+                     "store_savings_ratio %.2f\n"
+                     "slept_usec %lld\n"
+                     "bytes_read %lld\n"
+                     "bytes_written %lld\n",
+                     sched_names[sched_policy], reqs, blocks, dist,
+                     reqs ? (double)dist / reqs : 0.0,
+                     reqs ? (double)lat / reqs : 0.0,
+                     max_lat, sim_time,
+                     reqs ? (double)sim_lat / reqs : 0.0,
+                     seek_time, rotation_time, transfer_time,
+                     allocated, zero_reads, discards, discarded,
+                     cache_capacity, hits, misses,
+                     hits + misses ? (double)hits / (hits + misses) : 0.0,
+                     dirty, writebacks,
+                     jrecords, jcommits, jcommits ? (double)jrecords / jcommits : 0.0,
+                     jcheckpoints, jlive,
+                     crc_table ? crc32c_kernel() : "off",
+                     checksum_errors, scrubbed, scrub_passes,
+                     zmap ? "lz+dedup" : "off", zlogical, zunique, zdedup, zstored, zfile,
+                     zstored ? (double)zlogical / zstored : 0.0,
+                     counter_read(&stat_slept_usec), sum->bytes_read, sum->bytes_written);
+    // Commands that have been seen, with their latency from arrival to reply
+    for (int i = 0; i < NUM_CMDS; i++) {
+        const Histogram *h = &sum->latency[i];
+        if (sum->count[i] == 0)
+            continue;
+        n += snprintf(out + n, cap - n,
+                      "cmd_%s %lld\n"
+                      "cmd_%s_failed %lld\n"
+                      "cmd_%s_mean_usec %.1f\n"
+                      "cmd_%s_p50_usec %lld\n"
+                      "cmd_%s_p99_usec %lld\n"
+                      "cmd_%s_p999_usec %lld\n"
+                      "cmd_%s_max_usec %lld\n",
+                      cmd_names[i], sum->count[i], cmd_names[i], sum->failed[i],
+                      cmd_names[i], hist_mean(h), cmd_names[i], hist_percentile(h, 0.5),
+                      cmd_names[i], hist_percentile(h, 0.99), cmd_names[i],
+                      hist_percentile(h, 0.999), cmd_names[i], h->max);
+    }
+    n += snprintf(out + n, cap - n, "END\n");
+    free(sum);
+    *out_len = n;
+    return out;
+}
+
+// -S: append "time <unix seconds>" and the S report to the dump file
+// every stats_interval seconds
+static int stats_fd = -1;
+static int stats_interval = 10;
+
+static void *stats_dumper(void *arg) {
+    (void)arg;
+    while (1) {
+        sleep(stats_interval);
+        int len;
+        char *text = format_stats(&len);
+        if (!text)
+            continue;
+        if (dprintf(stats_fd, "time %lld\n%.*s", (long long)time(NULL), len, text) < 0)
+            perror("write stats file");
+        free(text);
+    }
+    return NULL;
+}
+
+static ReplySlot *next_slot(Conn *conn) {
+    ReplySlot *slot = &conn->slots[conn->nslots];
+    slot->has_req = 0;
+    slot->binary = 0;
+    slot->failed = 0;
+    slot->is_stats = 0;
+    slot->is_flush = 0;
+    slot->is_clock = 0;
+    slot->want_time = 0;
+    slot->range_buf = NULL;
+    slot->req.n = 1;
+    slot->text = NULL;
+    slot->text_len = 0;
+    slot->head_len = 0;
+    slot->cmd = CMD_OTHER;
+    clock_gettime(CLOCK_MONOTONIC, &slot->arrived);
+    return slot;
+}
+
+// Set up slot->req for n blocks at (c,s). Reads and multi-block writes
+// that don't fit slot->data get their own buffer (except RN in mmap mode,
+// which is answered straight from the mapping).
+static int prepare_request(ReplySlot *slot, int is_write, long long c, long long s, int n) {
+    if (n == 1 ? !valid_block(c, s) : !valid_range(c, s, n))
+        return 0;
+    if (n > 1 && (is_write || !disk_map)) {
+        slot->range_buf = malloc((size_t)n * block_size);
+        if (!slot->range_buf)
+            return 0;
+    }
+    slot->has_req = 1;
+    slot->req.is_write = is_write;
+    slot->req.is_discard = 0;
+    slot->req.c = c;
+    slot->req.s = s;
+    slot->req.n = n;
+    return 1;
+}
+
+// Set up slot->req to discard n blocks at (c,s). Carries no data, so it
+// isn't bound by the transfer size limit.
+static int prepare_discard(ReplySlot *slot, long long c, long long s, int n) {
+    if (!blocks_on_disk(c, s, n))
+        return 0;
+    slot->has_req = 1;
+    slot->req.is_write = 1;
+    slot->req.is_discard = 1;
+    slot->req.c = c;
+    slot->req.s = s;
+    slot->req.n = n;
+    return 1;
+}
+
+// Binary framing: parse one request frame. Returns 0 if the frame isn't
+// complete yet and -1 if the stream can't be resynchronised.
+static int parse_frame(Conn *conn) {
+    unsigned char *p = conn->in + conn->in_start;
+    size_t avail = conn->in_end - conn->in_start;
+    if (avail < REQ_HDR_SIZE)
+        return 0;
+
+    int op = p[0];
+    int n = get_le16(p + 2);
+    unsigned int tag = get_le32(p + 4);
+    unsigned int c = get_le32(p + 8);
+    unsigned int s = get_le32(p + 12);
+    size_t len = get_le32(p + 16);
+    if (n == 0)
+        n = 1;
+    if (len > (size_t)max_range_blocks * block_size) {
+        fprintf(stderr, "binary frame with %zu-byte payload, dropping connection\n", len);
+        return -1;
+    }
+    if (avail < REQ_HDR_SIZE + len)
+        return 0;
+
+    ReplySlot *slot = next_slot(conn);
+    slot->binary = 1;
+    slot->op = op;
+    slot->tag = tag;
+    slot->want_time = (p[1] & FRAME_SIM_TIME) != 0;
+    unsigned char *payload = p + REQ_HDR_SIZE;
+
+    if (op == 'R' || op == 'W') {
+        int is_write = op == 'W';
+        slot->cmd = n > 1 ? (is_write ? CMD_WN : CMD_RN) : (is_write ? CMD_W : CMD_R);
+        if (n > max_range_blocks || (is_write && len > (size_t)n * block_size) ||
+            !prepare_request(slot, is_write, c, s, n)) {
+            slot->failed = 1;
+        } else if (is_write) {
+            unsigned char *dst = slot->range_buf ? slot->range_buf : slot->data;
+            memcpy(dst, payload, len);
+            memset(dst + len, 0, (size_t)n * block_size - len);
+        }
+    } else if (op == 'D') {
+        slot->cmd = CMD_D;
+        if (!prepare_discard(slot, c, s, n))
+            slot->failed = 1;
+    } else if (op == 'I') {
+        // Geometry is filled in with the reply header
+        slot->cmd = CMD_I;
+    } else if (op == 'V') {
+        slot->cmd = CMD_V;
+        slot->is_clock = 1;
+    } else if (op == 'S') {
+        slot->cmd = CMD_S;
+        slot->is_stats = 1;
+    } else if (op == 'F') {
+        slot->cmd = CMD_F;
+        slot->is_flush = 1;
+    } else {
+        slot->failed = 1;
+    }
+
+    conn->in_start += REQ_HDR_SIZE + len;
+    conn->nslots++;
+    return 1;
+}
+
+// Parse one complete command from the front of the input buffer into the
+// next reply slot. Returns 0 if the buffer doesn't hold a whole command yet
+// and -1 if the connection must be dropped.
+static int parse_command(Conn *conn) {
+    if (conn->binary)
+        return parse_frame(conn);
+
+    unsigned char *start = conn->in + conn->in_start;
+    size_t avail = conn->in_end - conn->in_start;
+    unsigned char *nl = memchr(start, '\n', avail);
+    if (!nl) {
+        // A line that can't fit in the buffer is garbage; drop it
+        if (conn->in_start == 0 && conn->in_end == IN_BUF_SIZE)
+            conn->in_start = conn->in_end;
+        return 0;
+    }
+    size_t line_len = (size_t)(nl - start) + 1;
+
+    char line[MAX_LINE];
+    size_t copy = line_len < MAX_LINE ? line_len : MAX_LINE - 1;
+    memcpy(line, start, copy);
+    line[copy] = '\0';
+
+    ReplySlot *slot = next_slot(conn);
+
+    char *cmd = line;
+    int prefix_len = 0;
+    unsigned int tag;
+    int off = 0;
+    if (line[0] == 'T' && sscanf(line, "T %u %n", &tag, &off) == 1 && off > 0) {
+        cmd = line + off;
+        prefix_len = snprintf(slot->head, sizeof(slot->head), "%u ", tag);
+    }
+
+    size_t consumed = line_len;
+    char *h = slot->head + prefix_len;
+    size_t room = sizeof(slot->head) - prefix_len;
+
+    if (cmd[0] == 'I') {
+        // Information request
+        slot->cmd = CMD_I;
+        prefix_len += snprintf(h, room, "%lld %lld %d\n",
+                               num_cylinders, sectors_per_cylinder, block_size);
+    } else if (cmd[0] == 'R' && cmd[1] == 'N') {
+        long long c, s;
+        int n;
+        slot->cmd = CMD_RN;
+        if (sscanf(cmd, "RN %lld %lld %d", &c, &s, &n) != 3 || !prepare_request(slot, 0, c, s, n)) {
+            h[0] = '0';
+            prefix_len++;
+            slot->failed = 1;
+        }
+    } else if (cmd[0] == 'W' && cmd[1] == 'N') {
+        long long c, s;
+        int n;
+        slot->cmd = CMD_WN;
+        if (sscanf(cmd, "WN %lld %lld %d", &c, &s, &n) != 3 || n < 1 || n > max_range_blocks) {
+            h[0] = '0';
+            prefix_len++;
+            slot->failed = 1;
+        } else {
+            // n whole blocks of payload follow the header line
+            size_t len = (size_t)n * block_size;
+            if (avail - line_len < len)
+                return 0;
+            consumed += len;
+            if (!prepare_request(slot, 1, c, s, n)) {
+                h[0] = '0';
+                prefix_len++;
+                slot->failed = 1;
+            } else {
+                memcpy(slot->range_buf ? slot->range_buf : slot->data, start + line_len, len);
+            }
+        }
+    } else if (cmd[0] == 'D') {
+        long long c, s;
+        int n;
+        slot->cmd = CMD_D;
+        if (sscanf(cmd, "D %lld %lld %d", &c, &s, &n) != 3 || !prepare_discard(slot, c, s, n)) {
+            h[0] = '0';
+            prefix_len++;
+            slot->failed = 1;
+        }
+    } else if (cmd[0] == 'R') {
+        long long c, s;
+        slot->cmd = CMD_R;
+        if (sscanf(cmd, "R %lld %lld", &c, &s) != 2 || !prepare_request(slot, 0, c, s, 1)) {
+            h[0] = '0';
+            prefix_len++;
+            slot->failed = 1;
+        }
+    } else if (cmd[0] == 'W') {
+        long long c, s;
+        int l;
+        slot->cmd = CMD_W;
+        if (sscanf(cmd, "W %lld %lld %d", &c, &s, &l) != 3 || l < 0 || l > block_size) {
+            h[0] = '0';
+            prefix_len++;
+            slot->failed = 1;
+        } else {
+            // The l-byte payload follows the header line
+            if (avail - line_len < (size_t)l)
+                return 0;
+            memset(slot->data, 0, block_size);
+            memcpy(slot->data, start + line_len, l);
+            consumed += l;
+            if (!prepare_request(slot, 1, c, s, 1)) {
+                h[0] = '0';
+                prefix_len++;
+                slot->failed = 1;
+            }
+        }
+    } else if (cmd[0] == 'B') {
+        // Everything after this line is binary frames
+        slot->cmd = CMD_B;
+        conn->binary = 1;
+        h[0] = '1';
+        prefix_len++;
+    } else if (cmd[0] == 'F') {
+        slot->cmd = CMD_F;
+        slot->is_flush = 1;
+    } else if (cmd[0] == 'V') {
+        slot->cmd = CMD_V;
+        slot->is_clock = 1;
+    } else if (cmd[0] == 'S') {
+        // Formatted when its turn comes, so it covers earlier commands
+        slot->cmd = CMD_S;
+        slot->is_stats = 1;
+    } else {
+        // Unknown command – send failure
+        h[0] = '0';
+        prefix_len++;
+        slot->failed = 1;
+    }
+
+    slot->head_len = prefix_len;
+    conn->in_start += consumed;
+    conn->nslots++;
+    return 1;
+}
+
+static int writev_all(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        int chunk = cnt < IOV_MAX ? cnt : IOV_MAX;
+        ssize_t n = writev(fd, iov, chunk);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        // Skip fully written vectors, trim a partially written one
+        while (chunk > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+            chunk--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Wait for slots [from, to) in order and send their replies in one writev.
+static int finish_slots(Conn *conn, int from, int to) {
+    struct iovec iov[MAX_BATCH * 3];
+    int cnt = 0;
+    int slot_ok[MAX_BATCH];
+    MapSend *map_first = NULL, *map_last = NULL;
+    for (int i = from; i < to; i++) {
+        ReplySlot *slot = &conn->slots[i];
+        int ok = !slot->failed;
+        if (slot->has_req && journal_fd >= 0 && slot->req.is_write) {
+            ok = slot->journal_pos >= 0 && journal_wait(slot->journal_pos);
+            slot->req.sim_done = sim_clock_now();
+        } else if (slot->has_req) {
+            ok = wait_request(&slot->req);
+        }
+        if (slot->is_flush) {
+            ok = cache_flush();
+            ok = flush_disk() && ok;
+        }
+        if (slot->is_stats) {
+            slot->text = format_stats(&slot->text_len);
+            ok = slot->text != NULL;
+        }
+        // Requests report when they finished; anything else, the clock now
+        long long sim_time = 0;
+        if (slot->is_clock || slot->want_time)
+            sim_time = slot->has_req ? slot->req.sim_done : sim_clock_now();
+
+        if (slot->binary) {
+            unsigned char *h = (unsigned char *)slot->head;
+            unsigned char *extra = h + RESP_HDR_SIZE;
+            if (slot->want_time) {
+                put_le64(extra, sim_time);
+                extra += 8;
+            }
+            size_t len = 0;
+            if (slot->op == 'I') {
+                put_le32(extra, (unsigned int)num_cylinders);
+                put_le32(extra + 4, (unsigned int)sectors_per_cylinder);
+                put_le32(extra + 8, block_size);
+                len = 12;
+            } else if (slot->is_clock) {
+                put_le64(extra, sim_time);
+                len = 8;
+            } else if (slot->has_req && !slot->req.is_write && ok) {
+                len = (size_t)slot->req.n * block_size;
+            } else if (slot->text) {
+                len = slot->text_len;
+            }
+            h[0] = ok ? 1 : 0;
+            h[1] = slot->op;
+            put_le16(h + 2, slot->want_time ? FRAME_SIM_TIME : 0);
+            put_le32(h + 4, slot->tag);
+            put_le32(h + 8, (unsigned int)len);
+            put_le32(h + 12, 0);
+            // I and V carry their payload inside head
+            slot->head_len = (int)(extra - h) + (slot->op == 'I' || slot->is_clock ? (int)len : 0);
+        } else if (slot->is_clock) {
+            slot->head_len += snprintf(slot->head + slot->head_len,
+                                       sizeof(slot->head) - slot->head_len, "%lld\n", sim_time);
+        } else if (slot->has_req || slot->is_flush) {
+            slot->head[slot->head_len++] = ok ? '1' : '0';
+        }
+
+        if (slot->head_len > 0) {
+            iov[cnt].iov_base = slot->head;
+            iov[cnt].iov_len = slot->head_len;
+            cnt++;
+        }
+        if (slot->has_req && !slot->req.is_write && slot->req.status) {
+            // success: '1' then the block(s)
+            iov[cnt].iov_base = slot->req.buf;
+            iov[cnt].iov_len = (size_t)slot->req.n * block_size;
+            cnt++;
+            if (disk_map && slot->req.n > 1) {
+                MapSend *m = &slot->map_send;
+                m->lba = block_lba(slot->req.c, slot->req.s);
+                m->n = slot->req.n;
+                m->next = NULL;
+                if (map_last)
+                    map_last->next = m;
+                else
+                    map_first = m;
+                map_last = m;
+            }
+        }
+        if (slot->text) {
+            iov[cnt].iov_base = slot->text;
+            iov[cnt].iov_len = slot->text_len;
+            cnt++;
+        }
+        slot_ok[i] = ok;
+    }
+
+    // Hold off writes to the ranges sent from the mapping until they're out
+    if (map_first) {
+        pthread_mutex_lock(&map_send_lock);
+        map_last->next = map_sending;
+        map_sending = map_first;
+        pthread_mutex_unlock(&map_send_lock);
+    }
+    int rc = writev_all(conn->fd, iov, cnt);
+    if (rc < 0)
+        perror("writev (to client)");
+    if (map_first) {
+        pthread_mutex_lock(&map_send_lock);
+        MapSend **p = &map_sending;
+        while (*p != map_first)
+            p = &(*p)->next;
+        *p = map_last->next;
+        pthread_cond_broadcast(&map_send_done);
+        pthread_mutex_unlock(&map_send_lock);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = from; i < to; i++)
+        count_command(conn->stats, &conn->slots[i], slot_ok[i], &now);
+
+    for (int i = from; i < to; i++) {
+        free(conn->slots[i].text);
+        free(conn->slots[i].range_buf);
+    }
+    return rc;
+}
+
+// One trace record per request in the batch, under a single lock
+static void trace_batch(Conn *conn) {
+    pthread_mutex_lock(&tracer.lock);
+    for (int i = 0; i < conn->nslots; i++) {
+        ReplySlot *slot = &conn->slots[i];
+        if (slot->has_req) {
+            DiskRequest *req = &slot->req;
+            int op = req->is_discard ? 'D' : req->is_write ? 'W' : 'R';
+            trace_add_locked(&tracer, op, conn->id, block_lba(req->c, req->s), req->n, NULL);
+        } else if (slot->is_flush) {
+            trace_add_locked(&tracer, 'F', conn->id, 0, 0, NULL);
+        }
+    }
+    pthread_mutex_unlock(&tracer.lock);
+}
+
+static int run_batch(Conn *conn) {
+    int from = 0;
+    int pending_ranges = 0;
+    int rc = 0;
+    if (tracer.fd >= 0)
+        trace_batch(conn);
+    for (int i = 0; i < conn->nslots && rc == 0; i++) {
+        ReplySlot *slot = &conn->slots[i];
+        if (!slot->has_req)
+            continue;
+
+        // In mmap mode an RN reply points into the mapping until it is
+        // sent, so a later write on this connection is queued only once
+        // it's out. Other connections' writes wait just for the send.
+        if (disk_map && slot->req.is_write && pending_ranges) {
+            rc = finish_slots(conn, from, i);
+            from = i;
+            pending_ranges = 0;
+        }
+
+        slot->req.buf = slot->range_buf ? slot->range_buf : slot->data;
+        if (journal_fd >= 0 && slot->req.is_write)
+            slot->journal_pos = journal_submit(&slot->req);
+        else if (cache_capacity > 0)
+            submit_cached(&slot->req);
+        else
+            submit_request(&slot->req);
+        if (!slot->req.is_write && slot->req.n > 1)
+            pending_ranges = 1;
+    }
+
+    if (rc == 0)
+        rc = finish_slots(conn, from, conn->nslots);
+    conn->nslots = 0;
+    return rc;
+}
+
+static void *handle_client(void *arg) {
+    int client_sock = *(int *)arg;
+    free(arg);
+
+    Conn *conn = calloc(1, sizeof(Conn));
+    if (!conn) {
+        perror("calloc");
+        close(client_sock);
+        return NULL;
+    }
+    conn->fd = client_sock;
+    conn->id = __atomic_fetch_add(&next_client, 1, __ATOMIC_RELAXED);
+    conn->block_data = malloc((size_t)MAX_BATCH * block_size);
+    conn->stats = calloc(1, sizeof(ConnStats));
+    if (!conn->block_data || !conn->stats) {
+        perror("malloc");
+        close(client_sock);
+        free(conn->block_data);
+        free(conn->stats);
+        free(conn);
+        return NULL;
+    }
+    stats_register(conn->stats);
+    for (int i = 0; i < MAX_BATCH; i++) {
+        conn->slots[i].data = conn->block_data + (size_t)i * block_size;
+        pthread_cond_init(&conn->slots[i].req.done_cond, NULL);
+    }
+
+    while (1) {
+        int r = 0;
+        while (conn->nslots < MAX_BATCH && (r = parse_command(conn)) > 0) {}
+        if (r < 0)
+            break;
+
+        if (conn->nslots > 0) {
+            if (run_batch(conn) < 0)
+                break;
+            continue;
+        }
+
+        // Nothing complete buffered: compact and block for more input
+        if (conn->in_start > 0) {
+            memmove(conn->in, conn->in + conn->in_start, conn->in_end - conn->in_start);
+            conn->in_end -= conn->in_start;
+            conn->in_start = 0;
+        }
+        ssize_t n = recv(conn->fd, conn->in + conn->in_end, IN_BUF_SIZE - conn->in_end, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        conn->in_end += n;
+    }
+
+    for (int i = 0; i < MAX_BATCH; i++)
+        pthread_cond_destroy(&conn->slots[i].req.done_cond);
+    trace_flush(&tracer);
+    stats_retire(conn->stats);
+    close(conn->fd);
+    free(conn->block_data);
+    free(conn->stats);
+    free(conn);
+    return NULL;
+}
+
+static int parse_policy(const char *name) {
+    for (int i = 0; i < (int)(sizeof(sched_names) / sizeof(sched_names[0])); i++) {
+        if (strcmp(name, sched_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-s fcfs|sstf|scan|clook] [-m] [-u] [-v] [-z] [-b block_size] [-c cache_blocks] [-t timing] [-j journal_file] [-k checksum_file [-r scrub_blocks_per_sec]] [-T trace_file] [-S stats_file [-i seconds]] <port> <num_cyl> <sec_per_cyl> <seek_usec> <disk_file>\n"
+            "  timing: comma-separated rpm=N,heads=N,settle=usec,sqrt=usec,switch=usec\n",
+            prog);
+}
+
+// "-t rpm=7200,heads=4,settle=500,sqrt=200,switch=50"; 0 on a bad spec
+static int parse_timing(char *spec) {
+    for (char *item = strtok(spec, ","); item; item = strtok(NULL, ",")) {
+        char key[16];
+        int value;
+        if (sscanf(item, "%15[^=]=%d", key, &value) != 2 || value < 0)
+            return 0;
+        if (strcmp(key, "rpm") == 0)
+            rpm = value;
+        else if (strcmp(key, "heads") == 0 && value > 0)
+            heads = value;
+        else if (strcmp(key, "settle") == 0)
+            settle_usec = value;
+        else if (strcmp(key, "sqrt") == 0)
+            seek_sqrt_usec = value;
+        else if (strcmp(key, "switch") == 0)
+            head_switch_usec = value;
+        else
+            return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int use_mmap = 0;
+    int want_ring = 0;
+    int use_store = 0;
+    int cache_blocks = 0;
+    const char *journal_path = NULL;
+    const char *crc_path = NULL;
+    const char *trace_path = NULL;
+    const char *stats_path = NULL;
+    while ((opt = getopt(argc, argv, "s:muvzc:t:b:j:k:r:T:S:i:")) != -1) {
+        switch (opt) {
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'S':
+            stats_path = optarg;
+            break;
+        case 'i':
+            stats_interval = atoi(optarg);
+            if (stats_interval <= 0) {
+                fprintf(stderr, "Invalid stats interval: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            crc_path = optarg;
+            break;
+        case 'r':
+            scrub_rate = atoi(optarg);
+            if (scrub_rate <= 0) {
+                fprintf(stderr, "Invalid scrub rate: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'j':
+            journal_path = optarg;
+            break;
+        case 'c':
+            cache_blocks = atoi(optarg);
+            if (cache_blocks < 0) {
+                fprintf(stderr, "Invalid cache size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            block_size = atoi(optarg);
+            // Powers of two only, so blocks never straddle a page
+            if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+                (block_size & (block_size - 1)) != 0) {
+                fprintf(stderr, "Block size must be a power of two from %d to %d\n",
+                        MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+                return 1;
+            }
+            break;
+        case 'm':
+            use_mmap = 1;
+            break;
+        case 'u':
+            want_ring = 1;
+            break;
+        case 'v':
+            virtual_time = 1;
+            break;
+        case 'z':
+            use_store = 1;
+            break;
+        case 't':
+            if (!parse_timing(optarg)) {
+                fprintf(stderr, "Invalid timing model: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            sched_policy = parse_policy(optarg);
+            if (sched_policy < 0) {
+                fprintf(stderr, "Unknown scheduling policy: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 5 || (scrub_rate > 0 && !crc_path)) {
+        usage(argv[0]);
+        return 1;
+    }
+    argv += optind - 1;
+
+    int port = atoi(argv[1]);
+    num_cylinders = atoll(argv[2]);
+    sectors_per_cylinder = atoll(argv[3]);
+    seek_usec = atoi(argv[4]);
+    const char *disk_file = argv[5];
+
+    if (num_cylinders <= 0 || sectors_per_cylinder <= 0 || seek_usec < 0) {
+        fprintf(stderr, "Invalid geometry or seek time.\n");
+        return 1;
+    }
+    if (sectors_per_cylinder % heads != 0) {
+        fprintf(stderr, "sectors per cylinder must be a multiple of heads (%d)\n", heads);
+        return 1;
+    }
+    if (num_cylinders > LLONG_MAX / sectors_per_cylinder / block_size) {
+        fprintf(stderr, "Disk too large.\n");
+        return 1;
+    }
+    max_range_blocks = MAX_RANGE_BYTES / block_size < MAX_RANGE_BLOCKS ?
+                       MAX_RANGE_BYTES / block_size : MAX_RANGE_BLOCKS;
+
+    off_t total_blocks = (off_t)(num_cylinders * sectors_per_cylinder);
+    off_t file_size = total_blocks * block_size;
+
+    // Open or create disk file and size it with ftruncate, which leaves
+    // any new space as a hole
+    disk_fd = open(disk_file, O_RDWR | O_CREAT, 0666);
+    if (disk_fd < 0) {
+        perror("open disk_file");
+        return 1;
+    }
+
+    // A store (-z) sizes itself to what it holds
+    if (!use_store && ftruncate(disk_fd, file_size) < 0) {
+        perror("ftruncate disk_file");
+        close(disk_fd);
+        return 1;
+    }
+    disk_size = file_size;
+
+    // The store's file isn't the image, so it can't be mapped or read in place
+    if (use_store && (use_mmap || want_ring)) {
+        fprintf(stderr, "-m and -u have no effect with -z\n");
+        use_mmap = want_ring = 0;
+    }
+    if (use_mmap) {
+        disk_map = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+        if (disk_map == MAP_FAILED) {
+            perror("mmap disk_file");
+            close(disk_fd);
+            return 1;
+        }
+    }
+
+    zero_blocks = calloc(max_range_blocks, block_size);
+    if (!zero_blocks) {
+        perror("calloc");
+        close(disk_fd);
+        return 1;
+    }
+    crc32c_init();
+    if (use_store && !zstore_open()) {
+        close(disk_fd);
+        return 1;
+    }
+    if (crc_path && !crc_open(crc_path)) {
+        close(disk_fd);
+        return 1;
+    }
+    // Replay before anything reads the image
+    if (journal_path && !journal_open(journal_path)) {
+        close(disk_fd);
+        return 1;
+    }
+    if (!alloc_map_init())
+        fprintf(stderr, "Disk too large for an allocation map; unwritten blocks are read from the image\n");
+
+    // mmap transfers are plain memcpy, so the ring only matters without -m
+    if (want_ring && use_mmap) {
+        fprintf(stderr, "-u has no effect with -m; using mmap\n");
+    } else if (want_ring) {
+        if (ioring_init(&ring, RING_ENTRIES) == 0)
+            use_ring = 1;
+        else
+            perror("io_uring_setup (falling back to pread/pwrite)");
+    }
+
+    if (trace_path && !trace_open(&tracer, trace_path, 'D', block_size)) {
+        close(disk_fd);
+        return 1;
+    }
+    if (stats_path) {
+        stats_fd = open(stats_path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if (stats_fd < 0) {
+            perror("open stats_file");
+            close(disk_fd);
+            return 1;
+        }
+    }
+
+    // Set up listening socket
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        close(disk_fd);
+        return 1;
+    }
+
+    int optval = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(listen_fd);
+        close(disk_fd);
+        return 1;
+    }
+
+    if (listen(listen_fd, BACKLOG) < 0) {
+        perror("listen");
+        close(listen_fd);
+        close(disk_fd);
+        return 1;
+    }
+
+    if (cache_blocks > 0 && !cache_init(cache_blocks)) {
+        fprintf(stderr, "Cannot allocate a %d-block cache\n", cache_blocks);
+        close(listen_fd);
+        close(disk_fd);
+        return 1;
+    }
+
+    pthread_t disk_tid;
+    if (pthread_create(&disk_tid, NULL, disk_thread, NULL) != 0) {
+        perror("pthread_create (disk)");
+        close(listen_fd);
+        close(disk_fd);
+        return 1;
+    }
+    pthread_detach(disk_tid);
+
+    if (journal_fd >= 0) {
+        pthread_t ckpt_tid;
+        if (pthread_create(&ckpt_tid, NULL, journal_checkpointer, NULL) != 0) {
+            perror("pthread_create (checkpointer)");
+            close(listen_fd);
+            close(disk_fd);
+            return 1;
+        }
+        pthread_detach(ckpt_tid);
+    }
+
+    if (scrub_rate > 0) {
+        pthread_t scrub_tid;
+        if (pthread_create(&scrub_tid, NULL, scrubber, NULL) != 0) {
+            perror("pthread_create (scrubber)");
+            close(listen_fd);
+            close(disk_fd);
+            return 1;
+        }
+        pthread_detach(scrub_tid);
+    }
+
+    if (stats_fd >= 0) {
+        pthread_t stats_tid;
+        if (pthread_create(&stats_tid, NULL, stats_dumper, NULL) != 0) {
+            perror("pthread_create (stats)");
+            close(listen_fd);
+            close(disk_fd);
+            return 1;
+        }
+        pthread_detach(stats_tid);
+    }
+
+    printf("Disk server listening on port %d\n", port);
+    printf("Geometry: %lld cylinders, %lld sectors/cylinder, block size %d\n",
+           num_cylinders, sectors_per_cylinder, block_size);
+    printf("Scheduler: %s\n", sched_names[sched_policy]);
+    printf("Timing: %s; seek %d usec/cyl + %d sqrt + %d settle, %d rpm, %d heads, %d usec head switch\n",
+           virtual_time ? "virtual" : "real", seek_usec, seek_sqrt_usec, settle_usec,
+           rpm, heads, head_switch_usec);
+    printf("Backing store: %s\n", zmap ? "compressed, deduplicated store" :
+           disk_map ? "mmap" : use_ring ? "io_uring" : "pread/pwrite");
+    if (zmap)
+        printf("Store: %lld blocks in use, %lld unique, %lld bytes stored\n",
+               zstat_logical, zstat_unique, zstat_stored);
+    if (alloc_map)
+        printf("Allocated: %lld of %lld blocks\n", allocated_blocks, num_cylinders * sectors_per_cylinder);
+    if (cache_capacity > 0)
+        printf("Cache: %d blocks, %s\n", cache_capacity,
+               journal_fd >= 0 ? "writes go through the journal" : "write-back");
+    if (journal_fd >= 0)
+        printf("Journal: %s, group commit\n", journal_path);
+    if (crc_table)
+        printf("Checksums: %s, crc32c (%s)\n", crc_path, crc32c_kernel());
+    if (scrub_rate > 0)
+        printf("Scrubber: %d blocks/sec\n", scrub_rate);
+    if (tracer.fd >= 0)
+        printf("Trace: %s\n", trace_path);
+    if (stats_fd >= 0)
+        printf("Stats: %s every %d s\n", stats_path, stats_interval);
+
+    while (1) {
+        int *client_sock = malloc(sizeof(int));
+        if (!client_sock) {
+            perror("malloc");
+            break;
+        }
+        *client_sock = accept(listen_fd, NULL, NULL);
+        if (*client_sock < 0) {
+            perror("accept");
+            free(client_sock);
+            continue;
+        }
+
+        // Replies go out as status byte + data; don't let Nagle hold them back
+        int nodelay = 1;
+        setsockopt(*client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        // One thread per connection; requests meet in the shared scheduler queue
+        pthread_t t;
+        if (pthread_create(&t, NULL, handle_client, client_sock) != 0) {
+            perror("pthread_create");
+            close(*client_sock);
+            free(client_sock);
+            continue;
+        }
+        pthread_detach(t);
+    }
+
+    close(listen_fd);
+    close(disk_fd);
+    return 0;
+}
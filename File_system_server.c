@@ -1,546 +1,1671 @@
-// File_system_server.c
-// Flat filesystem server for Project 3 - Part 
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <errno.h>
-
-#define BLOCK_SIZE      128
-#define TOTAL_BLOCKS    1024
-
-#define FAT_BLOCKS      32
-#define DIR_BLOCKS      32
-
-#define SUPERBLOCK_BLOCK 0
-#define FAT_START_BLOCK  (SUPERBLOCK_BLOCK + 1)
-#define DIR_START_BLOCK  (FAT_START_BLOCK + FAT_BLOCKS)
-#define DATA_START_BLOCK (DIR_START_BLOCK + DIR_BLOCKS)
-
-// FAT markers
-#define FAT_FREE     (-1)
-#define FAT_EOF      (-2)
-#define FAT_RESERVED (-3)
-
-#define MAX_FILENAME 32
-#define DIR_ENTRIES  64   // 32 blocks * 128 bytes / 64 bytes per entry
-
-typedef struct {
-    char magic[4];      // "FS01"
-    int total_blocks;
-    int fat_start;
-    int fat_blocks;
-    int dir_start;
-    int dir_blocks;
-    int data_start;
-    int reserved[25];   // padding to fit one 128-byte block
-} Superblock;
-
-typedef struct {
-    char name[MAX_FILENAME]; // 32 bytes
-    int length;              // file length in bytes
-    int first_block;         // index into FAT of first data block, or -1
-    int in_use;              // 0 = free, 1 = used
-    char padding[20];        // pad struct to 64 bytes
-} DirEntry;
-
-static int fs_fd = -1;
-static Superblock super;
-static int fat[TOTAL_BLOCKS];
-static DirEntry dir_table[DIR_ENTRIES];
-static int fs_formatted = 0;
-
-// Low-level disk helpers
-
-static off_t block_offset(int block_index) {
-    return (off_t)block_index * BLOCK_SIZE;
-}
-
-static void die(const char *msg) {
-    perror(msg);
-    exit(1);
-}
-
-// Filesystem metadata load/save
-
-static int load_superblock() {
-    if (lseek(fs_fd, block_offset(SUPERBLOCK_BLOCK), SEEK_SET) < 0)
-        return 0;
-    ssize_t n = read(fs_fd, &super, sizeof(Superblock));
-    if (n != sizeof(Superblock))
-        return 0;
-    if (memcmp(super.magic, "FS01", 4) != 0)
-        return 0;
-    return 1;
-}
-
-static void save_superblock() {
-    if (lseek(fs_fd, block_offset(SUPERBLOCK_BLOCK), SEEK_SET) < 0)
-        die("lseek super");
-    if (write(fs_fd, &super, sizeof(Superblock)) != sizeof(Superblock))
-        die("write super");
-}
-
-static void load_fat() {
-    if (lseek(fs_fd, block_offset(FAT_START_BLOCK), SEEK_SET) < 0)
-        die("lseek fat");
-    ssize_t n = read(fs_fd, fat, sizeof(fat));
-    if (n != sizeof(fat))
-        die("read fat");
-}
-
-static void save_fat() {
-    if (lseek(fs_fd, block_offset(FAT_START_BLOCK), SEEK_SET) < 0)
-        die("lseek fat write");
-    if (write(fs_fd, fat, sizeof(fat)) != sizeof(fat))
-        die("write fat");
-}
-
-static void load_dir() {
-    if (lseek(fs_fd, block_offset(DIR_START_BLOCK), SEEK_SET) < 0)
-        die("lseek dir");
-    ssize_t n = read(fs_fd, dir_table, sizeof(dir_table));
-    if (n != sizeof(dir_table))
-        die("read dir");
-}
-
-static void save_dir() {
-    if (lseek(fs_fd, block_offset(DIR_START_BLOCK), SEEK_SET) < 0)
-        die("lseek dir write");
-    if (write(fs_fd, dir_table, sizeof(dir_table)) != sizeof(dir_table))
-        die("write dir");
-}
-
-// Formatting
-
-static int fs_format() {
-    // Fill superblock
-    memcpy(super.magic, "FS01", 4);
-    super.total_blocks = TOTAL_BLOCKS;
-    super.fat_start = FAT_START_BLOCK;
-    super.fat_blocks = FAT_BLOCKS;
-    super.dir_start = DIR_START_BLOCK;
-    super.dir_blocks = DIR_BLOCKS;
-    super.data_start = DATA_START_BLOCK;
-    memset(super.reserved, 0, sizeof(super.reserved));
-
-    save_superblock();
-
-    // Initialize FAT
-    for (int i = 0; i < TOTAL_BLOCKS; i++) {
-        if (i < DATA_START_BLOCK) {
-            fat[i] = FAT_RESERVED; // space used by superblock/FAT/dir
-        } else {
-            fat[i] = FAT_FREE;
-        }
-    }
-    save_fat();
-
-    // Initialize directory
-    for (int i = 0; i < DIR_ENTRIES; i++) {
-        dir_table[i].in_use = 0;
-        dir_table[i].name[0] = '\0';
-        dir_table[i].length = 0;
-        dir_table[i].first_block = -1;
-        memset(dir_table[i].padding, 0, sizeof(dir_table[i].padding));
-    }
-    save_dir();
-
-    // Zero data blocks (not strictly required but nice)
-    unsigned char zero[BLOCK_SIZE];
-    memset(zero, 0, BLOCK_SIZE);
-    for (int b = DATA_START_BLOCK; b < TOTAL_BLOCKS; b++) {
-        if (lseek(fs_fd, block_offset(b), SEEK_SET) < 0)
-            die("lseek data zero");
-        if (write(fs_fd, zero, BLOCK_SIZE) != BLOCK_SIZE)
-            die("write data zero");
-    }
-
-    fs_formatted = 1;
-    return 0; // success
-}
-
-static void fs_load_or_unformatted() {
-    if (!load_superblock()) {
-        fs_formatted = 0;
-        return;
-    }
-    // If superblock looks good, load FAT and directory
-    load_fat();
-    load_dir();
-    fs_formatted = 1;
-}
-
-// Helper: find file, allocate blocks, free blocks
-
-static int find_file(const char *name) {
-    for (int i = 0; i < DIR_ENTRIES; i++) {
-        if (dir_table[i].in_use && strcmp(dir_table[i].name, name) == 0) {
-            return i;
-        }
-    }
-    return -1;
-}
-
-static int alloc_block() {
-    for (int i = DATA_START_BLOCK; i < TOTAL_BLOCKS; i++) {
-        if (fat[i] == FAT_FREE) {
-            fat[i] = FAT_EOF; // mark as end-of-chain for now
-            return i;
-        }
-    }
-    return -1; // no space
-}
-
-static void free_chain(int first_block) {
-    int cur = first_block;
-    while (cur >= DATA_START_BLOCK && cur < TOTAL_BLOCKS) {
-        int next = fat[cur];
-        fat[cur] = FAT_FREE;
-        if (next == FAT_EOF || next == FAT_FREE || next == FAT_RESERVED)
-            break;
-        cur = next;
-    }
-}
-
-// FS operations implementing the prompt
-
-static int fs_create(const char *name) {
-    if (!fs_formatted) return 2;
-    if (strlen(name) >= MAX_FILENAME) return 2;
-
-    if (find_file(name) >= 0)
-        return 1; // already exists
-
-    // find free dir entry
-    for (int i = 0; i < DIR_ENTRIES; i++) {
-        if (!dir_table[i].in_use) {
-            dir_table[i].in_use = 1;
-            strncpy(dir_table[i].name, name, MAX_FILENAME - 1);
-            dir_table[i].name[MAX_FILENAME - 1] = '\0';
-            dir_table[i].length = 0;
-            dir_table[i].first_block = -1;
-            save_dir();
-            save_fat(); // not really changed, but safe
-            return 0;
-        }
-    }
-    return 2; // no directory space
-}
-
-static int fs_delete(const char *name) {
-    if (!fs_formatted) return 2;
-
-    int idx = find_file(name);
-    if (idx < 0)
-        return 1;
-
-    if (dir_table[idx].first_block >= 0) {
-        free_chain(dir_table[idx].first_block);
-    }
-
-    dir_table[idx].in_use = 0;
-    dir_table[idx].name[0] = '\0';
-    dir_table[idx].length = 0;
-    dir_table[idx].first_block = -1;
-
-    save_dir();
-    save_fat();
-    return 0;
-}
-
-static int fs_write(const char *name, const unsigned char *data, int len) {
-    if (!fs_formatted) return 2;
-
-    int idx = find_file(name);
-    if (idx < 0)
-        return 1; // no such filename
-
-    // free old chain
-    if (dir_table[idx].first_block >= 0) {
-        free_chain(dir_table[idx].first_block);
-    }
-
-    if (len == 0) {
-        dir_table[idx].first_block = -1;
-        dir_table[idx].length = 0;
-        save_dir();
-        save_fat();
-        return 0;
-    }
-
-    int blocks_needed = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    int first = -1;
-    int prev = -1;
-    int pos = 0;
-
-    for (int i = 0; i < blocks_needed; i++) {
-        int b = alloc_block();
-        if (b < 0) {
-            // out of space – free what we allocated so far
-            if (first >= 0) free_chain(first);
-            return 2;
-        }
-
-        if (first < 0) first = b;
-        if (prev >= 0) fat[prev] = b;
-        fat[b] = FAT_EOF;
-        prev = b;
-
-        // write up to BLOCK_SIZE bytes of data into this block
-        unsigned char buf[BLOCK_SIZE];
-        memset(buf, 0, BLOCK_SIZE);
-        int chunk = BLOCK_SIZE;
-        if (len - pos < BLOCK_SIZE) chunk = len - pos;
-        memcpy(buf, data + pos, chunk);
-        pos += chunk;
-
-        if (lseek(fs_fd, block_offset(b), SEEK_SET) < 0)
-            die("lseek data write");
-        if (write(fs_fd, buf, BLOCK_SIZE) != BLOCK_SIZE)
-            die("write data block");
-    }
-
-    dir_table[idx].first_block = first;
-    dir_table[idx].length = len;
-    save_fat();
-    save_dir();
-    return 0;
-}
-
-static int fs_read(const char *name, unsigned char **out_buf, int *out_len) {
-    if (!fs_formatted) return 2;
-
-    int idx = find_file(name);
-    if (idx < 0)
-        return 1;
-
-    int len = dir_table[idx].length;
-    *out_len = len;
-
-    if (len == 0) {
-        *out_buf = NULL;
-        return 0;
-    }
-
-    unsigned char *buf = (unsigned char *)malloc(len);
-    if (!buf) return 2;
-
-    int pos = 0;
-    int cur = dir_table[idx].first_block;
-
-    while (cur >= DATA_START_BLOCK && cur < TOTAL_BLOCKS && pos < len) {
-        unsigned char block[BLOCK_SIZE];
-        if (lseek(fs_fd, block_offset(cur), SEEK_SET) < 0) {
-            free(buf);
-            return 2;
-        }
-        if (read(fs_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
-            free(buf);
-            return 2;
-        }
-        int chunk = BLOCK_SIZE;
-        if (len - pos < BLOCK_SIZE) chunk = len - pos;
-        memcpy(buf + pos, block, chunk);
-        pos += chunk;
-
-        int next = fat[cur];
-        if (next == FAT_EOF || next == FAT_FREE || next == FAT_RESERVED)
-            break;
-        cur = next;
-    }
-
-    *out_buf = buf;
-    return 0;
-}
-
-// Network handling for FS protocol
-
-static void handle_list(FILE *client, int verbose) {
-    // status line just to keep consistent
-    fprintf(client, "0\n");
-    for (int i = 0; i < DIR_ENTRIES; i++) {
-        if (dir_table[i].in_use) {
-            if (!verbose)
-                fprintf(client, "%s\n", dir_table[i].name);
-            else
-                fprintf(client, "%s %d\n", dir_table[i].name, dir_table[i].length);
-        }
-    }
-    fprintf(client, "END\n");
-    fflush(client);
-}
-
-static ssize_t read_exact(int fd, unsigned char *buf, int len) {
-    int total = 0;
-    while (total < len) {
-        ssize_t n = read(fd, buf + total, len - total);
-        if (n <= 0) return n;
-        total += n;
-    }
-    return total;
-}
-
-static void handle_client(int client_sock) {
-    FILE *client = fdopen(client_sock, "r+");
-    if (!client) {
-        perror("fdopen client");
-        close(client_sock);
-        return;
-    }
-
-    char line[1024];
-
-    while (fgets(line, sizeof(line), client) != NULL) {
-        if (line[0] == 'F') {
-            int rc = fs_format();
-            fprintf(client, "%d\n", rc);
-            fflush(client);
-        } else if (line[0] == 'C') {
-            char fname[MAX_FILENAME];
-            if (sscanf(line, "C %31s", fname) != 1) {
-                fprintf(client, "2\n");
-                fflush(client);
-                continue;
-            }
-            int rc = fs_create(fname);
-            fprintf(client, "%d\n", rc);
-            fflush(client);
-        } else if (line[0] == 'D') {
-            char fname[MAX_FILENAME];
-            if (sscanf(line, "D %31s", fname) != 1) {
-                fprintf(client, "2\n");
-                fflush(client);
-                continue;
-            }
-            int rc = fs_delete(fname);
-            fprintf(client, "%d\n", rc);
-            fflush(client);
-        } else if (line[0] == 'L') {
-            int b = 0;
-            sscanf(line, "L %d", &b);
-            handle_list(client, b != 0);
-        } else if (line[0] == 'R') {
-            char fname[MAX_FILENAME];
-            if (sscanf(line, "R %31s", fname) != 1) {
-                fprintf(client, "2 0 \n");
-                fflush(client);
-                continue;
-            }
-            unsigned char *buf = NULL;
-            int len = 0;
-            int rc = fs_read(fname, &buf, &len);
-            // Send: return_code, length (ASCII), space, data
-            fprintf(client, "%d %d ", rc, len);
-            fflush(client);
-            if (rc == 0 && len > 0 && buf != NULL) {
-                int fd = fileno(client);
-                if (write(fd, buf, len) != len) {
-                    perror("write read-data to client");
-                }
-            }
-            fputc('\n', client); // line break after data
-            fflush(client);
-            if (buf) free(buf);
-        } else if (line[0] == 'W') {
-            char fname[MAX_FILENAME];
-            int len;
-            if (sscanf(line, "W %31s %d", fname, &len) != 2 || len < 0) {
-                fprintf(client, "2\n");
-                fflush(client);
-                continue;
-            }
-            unsigned char *buf = NULL;
-            if (len > 0) {
-                buf = (unsigned char *)malloc(len);
-                if (!buf) {
-                    fprintf(client, "2\n");
-                    fflush(client);
-                    continue;
-                }
-                int fd = fileno(client);
-                if (read_exact(fd, buf, len) != len) {
-                    free(buf);
-                    fprintf(client, "2\n");
-                    fflush(client);
-                    continue;
-                }
-            }
-            int rc = fs_write(fname, buf, len);
-            if (buf) free(buf);
-            fprintf(client, "%d\n", rc);
-            fflush(client);
-        } else {
-            // Unknown command
-            fprintf(client, "2\n");
-            fflush(client);
-        }
-    }
-
-    fclose(client);
-}
-
-// main
-
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <port> <fs_image>\n", argv[0]);
-        return 1;
-    }
-
-    int port = atoi(argv[1]);
-    const char *fs_image = argv[2];
-
-    fs_fd = open(fs_image, O_RDWR | O_CREAT, 0666);
-    if (fs_fd < 0) die("open fs_image");
-
-    // Ensure size
-    off_t size = (off_t)TOTAL_BLOCKS * BLOCK_SIZE;
-    if (ftruncate(fs_fd, size) < 0) die("ftruncate fs_image");
-
-    fs_load_or_unformatted();
-    if (!fs_formatted) {
-        fprintf(stderr, "Filesystem not formatted yet. Use 'F' command from client.\n");
-    }
-
-    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) die("socket");
-
-    int opt = 1;
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port);
-
-    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-        die("bind");
-
-    if (listen(listen_fd, 5) < 0)
-        die("listen");
-
-    printf("Filesystem server listening on port %d, image %s\n", port, fs_image);
-
-    while (1) {
-        int client_sock = accept(listen_fd, NULL, NULL);
-        if (client_sock < 0) {
-            perror("accept");
-            continue;
-        }
-        // Single-threaded: handle one client at a time
-        handle_client(client_sock);
-    }
-
-    close(listen_fd);
-    close(fs_fd);
-    return 0;
-}
+// File_system_server.c
+// Flat filesystem server for Project 3 - Part 
+
+#define _GNU_SOURCE              // fallocate
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include "ioring.h"
+#include "crc32c.h"
+#include "trace.h"
+#include "histogram.h"
+
+// The block size is chosen when the filesystem is formatted ("F [size]")
+// and recorded in the superblock, which always sits in the first 128 bytes.
+// The FAT, directory and checksum table take as many blocks as their fixed
+// byte sizes need, so their positions come from the superblock rather than
+// constants. R fails with 2 if a block doesn't match its checksum.
+#define DEFAULT_BLOCK_SIZE 128
+#define MIN_BLOCK_SIZE     128
+#define MAX_BLOCK_SIZE     65536
+#define TOTAL_BLOCKS    1024
+
+#define SUPERBLOCK_BLOCK 0
+
+// FAT markers
+#define FAT_FREE     (-1)
+#define FAT_EOF      (-2)
+#define FAT_RESERVED (-3)
+
+// How files' blocks are recorded on disk, chosen at format time
+// ("F size layout", or -e for the default). Either way the server keeps
+// a FAT in memory; an extent image stores each file as a list of
+// (start, count) runs instead, in the space the FAT would take, and the
+// directory entry's first_block names its first extent record.
+#define LAYOUT_FAT     0    // "FS01"
+#define LAYOUT_EXTENTS 1    // "FS02"
+
+// The directory takes DIR_BYTES, or one block if that's larger, so images
+// with large blocks hold more files; the count is in the superblock.
+#define MAX_FILENAME 32
+#define DIR_BYTES        4096   // 64 entries of 64 bytes
+#define DIR_ENTRIES      64     // images formatted before dir_entries was recorded
+#define MAX_DIR_ENTRIES  1024   // one 64 KiB block
+
+typedef struct {
+    char magic[4];      // "FS01"
+    int total_blocks;
+    int fat_start;
+    int fat_blocks;
+    int dir_start;
+    int dir_blocks;
+    int data_start;
+    int block_size;     // 0 in images formatted before it was recorded: 128
+    int crc_start;      // block checksum table; 0 in images without one
+    int crc_blocks;
+    int dir_entries;    // 0 in images formatted before it was recorded: 64
+    int layout;         // LAYOUT_FAT or LAYOUT_EXTENTS
+    int reserved[20];   // padding to fit in 128 bytes
+} Superblock;
+
+typedef struct {
+    char name[MAX_FILENAME]; // 32 bytes
+    int length;              // file length in bytes
+    int first_block;         // index into FAT of first data block, or -1; on disk
+                             // in extent images, the first extent record
+    int in_use;              // 0 = free, 1 = used
+    char padding[20];        // pad struct to 64 bytes
+} DirEntry;
+
+// An extent image's block map: per file, a chain of these records
+typedef struct {
+    unsigned short start;    // first block
+    unsigned short count;    // blocks
+    int next;                // the file's next extent record, or -1
+} Extent;
+
+static int fs_fd = -1;
+static Superblock super;
+static int fat[TOTAL_BLOCKS];
+static DirEntry dir_table[MAX_DIR_ENTRIES];
+static int dir_entries = DIR_ENTRIES;               // of the loaded filesystem
+static uint32_t block_crc[TOTAL_BLOCKS];   // CRC32C of each data block as last written
+static int fs_formatted = 0;
+static int block_size = DEFAULT_BLOCK_SIZE;          // of the loaded filesystem
+static int format_block_size = DEFAULT_BLOCK_SIZE;   // for "F" without a size (-b)
+static int format_layout = LAYOUT_FAT;               // for "F" without a layout (-e)
+
+// Extent layout: the records, each file's first one, and the free ones
+static Extent extents[TOTAL_BLOCKS];
+static int extent_head[MAX_DIR_ENTRIES];
+static int extent_free[TOTAL_BLOCKS];
+static int extent_free_count;
+
+// io_uring backend (-u): data blocks of a file go to the kernel as one batch
+#define RING_ENTRIES 64
+static IoRing ring;
+static int use_ring = 0;
+
+// Request trace (-T): commands as they arrive, tagged with the number of
+// the connection (served one at a time) they came in on
+static TraceWriter tracer = { .fd = -1 };
+static unsigned int client_id;
+
+// Statistics ("S", and every -i seconds to the -S file). The command loop
+// is the only writer and the dump thread reads them as they change, so
+// they go through histogram.h's _shared calls rather than a lock.
+enum { CMD_F, CMD_C, CMD_D, CMD_L, CMD_R, CMD_G, CMD_W, CMD_P, CMD_A, CMD_T, CMD_B, CMD_S,
+       CMD_OTHER, NUM_CMDS };
+static const char *cmd_names[NUM_CMDS] = { "F", "C", "D", "L", "R", "G", "W", "P", "A", "T", "B",
+                                           "S", "other" };
+static long long stat_count[NUM_CMDS];
+static long long stat_failed[NUM_CMDS];      // answered with a non-zero code
+static Histogram stat_latency[NUM_CMDS];     // microseconds, command to reply
+static long long stat_bytes_read, stat_bytes_written;
+static long long stat_checksum_errors;
+static long long stat_free_blocks;           // FAT entries marked free
+static long long stat_files;
+static long long stat_extents;               // extent records in use (extent layout)
+static int stats_fd = -1;
+static int stats_interval = 10;
+
+// Low-level disk helpers
+
+static off_t block_offset(int block_index) {
+    return (off_t)block_index * block_size;
+}
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+// Number of blocks from blocks[i] on that sit next to each other on disk
+static int run_length(const int *blocks, int i, int count) {
+    int n = 1;
+    while (i + n < count && blocks[i + n] == blocks[i] + n)
+        n++;
+    return n;
+}
+
+// Read or write count whole blocks; blocks[i] maps to buf + i * block_size.
+// Blocks that are adjacent on disk move in one transfer. With the ring,
+// every transfer of a chunk is submitted in one io_uring_enter instead of
+// a seek and a read/write each. Returns 1 on success.
+static int transfer_blocks(int is_write, const int *blocks, unsigned char *buf, int count) {
+    int i = 0;
+    while (use_ring && i < count) {
+        int batch = 0, next = i;
+        while (batch < RING_ENTRIES && next < count) {
+            int run = run_length(blocks, next, count);
+            struct io_uring_sqe *sqe = ioring_get_sqe(&ring);
+            ioring_prep_rw(sqe, is_write ? IORING_OP_WRITE : IORING_OP_READ, fs_fd,
+                           buf + (size_t)next * block_size, (unsigned int)run * block_size,
+                           block_offset(blocks[next]), (void *)(long)run);
+            batch++;
+            next += run;
+        }
+        if (ioring_submit(&ring, batch) < 0) {
+            perror("io_uring_enter");
+            return 0;
+        }
+        int ok = 1;
+        for (int j = 0; j < batch; j++) {
+            struct io_uring_cqe *cqe;
+            while ((cqe = ioring_peek_cqe(&ring)) == NULL)
+                ioring_submit(&ring, 1);
+            if (cqe->res != (long)cqe->user_data * block_size)
+                ok = 0;
+            ioring_cqe_seen(&ring);
+        }
+        if (!ok)
+            break;   // redo the rest synchronously, which reports the error
+        i = next;
+    }
+
+    while (i < count) {
+        int run = run_length(blocks, i, count);
+        size_t len = (size_t)run * block_size;
+        unsigned char *p = buf + (size_t)i * block_size;
+        ssize_t n = is_write ? pwrite(fs_fd, p, len, block_offset(blocks[i]))
+                             : pread(fs_fd, p, len, block_offset(blocks[i]));
+        if (n != (ssize_t)len) {
+            perror(is_write ? "pwrite data block" : "pread data block");
+            return 0;
+        }
+        i += run;
+    }
+    return 1;
+}
+
+// Filesystem metadata load/save
+
+static int load_superblock() {
+    if (lseek(fs_fd, block_offset(SUPERBLOCK_BLOCK), SEEK_SET) < 0)
+        return 0;
+    ssize_t n = read(fs_fd, &super, sizeof(Superblock));
+    if (n != sizeof(Superblock))
+        return 0;
+    int layout = memcmp(super.magic, "FS02", 4) == 0 ? LAYOUT_EXTENTS : LAYOUT_FAT;
+    if (memcmp(super.magic, layout == LAYOUT_EXTENTS ? "FS02" : "FS01", 4) != 0 ||
+        super.layout != layout)
+        return 0;
+    int bs = super.block_size ? super.block_size : DEFAULT_BLOCK_SIZE;
+    if (bs < MIN_BLOCK_SIZE || bs > MAX_BLOCK_SIZE || super.total_blocks != TOTAL_BLOCKS)
+        return 0;
+    int entries = super.dir_entries ? super.dir_entries : DIR_ENTRIES;
+    if (entries < 0 || entries > MAX_DIR_ENTRIES ||
+        entries * (long long)sizeof(DirEntry) > (long long)super.dir_blocks * bs)
+        return 0;
+    block_size = bs;
+    dir_entries = entries;
+    return 1;
+}
+
+static void save_superblock() {
+    if (lseek(fs_fd, block_offset(SUPERBLOCK_BLOCK), SEEK_SET) < 0)
+        die("lseek super");
+    if (write(fs_fd, &super, sizeof(Superblock)) != sizeof(Superblock))
+        die("write super");
+}
+
+static void load_fat() {
+    if (lseek(fs_fd, block_offset(super.fat_start), SEEK_SET) < 0)
+        die("lseek fat");
+    ssize_t n = read(fs_fd, fat, sizeof(fat));
+    if (n != sizeof(fat))
+        die("read fat");
+}
+
+// Extent images keep no FAT on disk; save_extents records the files
+// whose chains changed
+static void save_fat() {
+    if (super.layout == LAYOUT_EXTENTS)
+        return;
+    if (lseek(fs_fd, block_offset(super.fat_start), SEEK_SET) < 0)
+        die("lseek fat write");
+    if (write(fs_fd, fat, sizeof(fat)) != sizeof(fat))
+        die("write fat");
+}
+
+static void load_dir() {
+    size_t size = (size_t)dir_entries * sizeof(DirEntry);
+    if (lseek(fs_fd, block_offset(super.dir_start), SEEK_SET) < 0)
+        die("lseek dir");
+    ssize_t n = read(fs_fd, dir_table, size);
+    if (n != (ssize_t)size)
+        die("read dir");
+}
+
+static void save_dir() {
+    size_t size = (size_t)dir_entries * sizeof(DirEntry);
+    if (lseek(fs_fd, block_offset(super.dir_start), SEEK_SET) < 0)
+        die("lseek dir write");
+    if (write(fs_fd, dir_table, size) != (ssize_t)size)
+        die("write dir");
+}
+
+// Just the one entry that changed
+static void save_dir_entry(int idx) {
+    DirEntry e = dir_table[idx];
+    if (super.layout == LAYOUT_EXTENTS)
+        e.first_block = extent_head[idx];
+    off_t off = block_offset(super.dir_start) + (off_t)idx * sizeof(DirEntry);
+    if (pwrite(fs_fd, &e, sizeof(DirEntry), off) != sizeof(DirEntry))
+        die("write dir entry");
+}
+
+// The checksum table follows the directory. Images formatted before it
+// existed have crc_start 0 and are read without checks.
+static void load_crcs() {
+    if (super.crc_start == 0)
+        return;
+    if (lseek(fs_fd, block_offset(super.crc_start), SEEK_SET) < 0)
+        die("lseek crc");
+    if (read(fs_fd, block_crc, sizeof(block_crc)) != sizeof(block_crc))
+        die("read crc");
+}
+
+static void save_crcs() {
+    if (super.crc_start == 0)
+        return;
+    if (lseek(fs_fd, block_offset(super.crc_start), SEEK_SET) < 0)
+        die("lseek crc write");
+    if (write(fs_fd, block_crc, sizeof(block_crc)) != sizeof(block_crc))
+        die("write crc");
+}
+
+// FAT and checksum entries changed by a partial write, as one span, so
+// save_dirty writes just those instead of both whole tables
+static int dirty_lo = TOTAL_BLOCKS, dirty_hi = -1;
+
+static void mark_dirty(int b) {
+    if (b < dirty_lo) dirty_lo = b;
+    if (b > dirty_hi) dirty_hi = b;
+}
+
+static void save_dirty(void) {
+    if (dirty_hi < dirty_lo)
+        return;
+    size_t n = (size_t)(dirty_hi - dirty_lo + 1) * sizeof(int);
+    off_t off = (off_t)dirty_lo * sizeof(int);
+    if (super.layout == LAYOUT_FAT &&
+        pwrite(fs_fd, &fat[dirty_lo], n, block_offset(super.fat_start) + off) != (ssize_t)n)
+        die("write fat entries");
+    if (super.crc_start != 0 &&
+        pwrite(fs_fd, &block_crc[dirty_lo], n, block_offset(super.crc_start) + off) != (ssize_t)n)
+        die("write crc entries");
+    dirty_lo = TOTAL_BLOCKS;
+    dirty_hi = -1;
+}
+
+// Extent layout. The FAT in memory is rebuilt from the records at load,
+// and a file's records are rewritten from its chain whenever that changes.
+
+// An empty table: every record free, lowest on top
+static void init_extents(void) {
+    memset(extents, 0, sizeof(extents));
+    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        extent_head[i] = -1;
+    extent_free_count = 0;
+    for (int e = TOTAL_BLOCKS - 1; e >= 0; e--)
+        extent_free[extent_free_count++] = e;
+    __atomic_store_n(&stat_extents, 0, __ATOMIC_RELAXED);
+    if (pwrite(fs_fd, extents, sizeof(extents), block_offset(super.fat_start)) != sizeof(extents))
+        die("write extents");
+}
+
+// Call after load_dir: turns each entry's first_block from its first
+// extent record into its first block, and links the FAT through the runs
+static void load_extents(void) {
+    if (pread(fs_fd, extents, sizeof(extents), block_offset(super.fat_start)) != sizeof(extents))
+        die("read extents");
+    for (int b = 0; b < TOTAL_BLOCKS; b++)
+        fat[b] = b < super.data_start ? FAT_RESERVED : FAT_FREE;
+    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        extent_head[i] = -1;
+
+    char used[TOTAL_BLOCKS] = { 0 };
+    long long records = 0;
+    for (int i = 0; i < dir_entries; i++) {
+        if (!dir_table[i].in_use)
+            continue;
+        extent_head[i] = dir_table[i].first_block;
+        dir_table[i].first_block = -1;
+        int prev = -1, bad = 0;
+        for (int e = extent_head[i]; !bad && e >= 0 && e < TOTAL_BLOCKS && !used[e];
+             e = extents[e].next) {
+            used[e] = 1;
+            records++;
+            for (int b = extents[e].start; !bad && b < extents[e].start + extents[e].count; b++) {
+                if (b < super.data_start || b >= TOTAL_BLOCKS || fat[b] != FAT_FREE) {
+                    fprintf(stderr, "%s: bad extent %d\n", dir_table[i].name, e);
+                    bad = 1;
+                    break;
+                }
+                if (prev >= 0)
+                    fat[prev] = b;
+                else
+                    dir_table[i].first_block = b;
+                fat[b] = FAT_EOF;
+                prev = b;
+            }
+        }
+    }
+
+    extent_free_count = 0;
+    for (int e = TOTAL_BLOCKS - 1; e >= 0; e--) {
+        if (!used[e])
+            extent_free[extent_free_count++] = e;
+    }
+    __atomic_store_n(&stat_extents, records, __ATOMIC_RELAXED);
+}
+
+// Rewrite file idx's extent list after its chain changed. Its records
+// are reused in order and only those whose contents change are written,
+// so an append that grows the last run writes one 8-byte record.
+// Returns 1 if the first record moved; the caller saves the entry.
+static int save_extents(int idx) {
+    if (super.layout != LAYOUT_EXTENTS)
+        return 0;
+
+    // The runs of adjacent blocks in the chain
+    Extent runs[TOTAL_BLOCKS];
+    int n = 0;
+    int need = (dir_table[idx].length + block_size - 1) / block_size;
+    int cur = dir_table[idx].first_block;
+    for (int i = 0; cur >= super.data_start && cur < TOTAL_BLOCKS && i < need; i++) {
+        if (n > 0 && runs[n - 1].start + runs[n - 1].count == cur) {
+            runs[n - 1].count++;
+        } else {
+            runs[n].start = (unsigned short)cur;
+            runs[n].count = 1;
+            n++;
+        }
+        int next = fat[cur];
+        if (next == FAT_EOF || next == FAT_FREE || next == FAT_RESERVED)
+            break;
+        cur = next;
+    }
+
+    // Free the old records so they come back first, in the same order.
+    // A run holds at least one block, so there are always enough.
+    int old[TOTAL_BLOCKS], n_old = 0;
+    for (int e = extent_head[idx]; e >= 0 && n_old < TOTAL_BLOCKS; e = extents[e].next)
+        old[n_old++] = e;
+    for (int i = n_old - 1; i >= 0; i--)
+        extent_free[extent_free_count++] = old[i];
+    int recs[TOTAL_BLOCKS];
+    for (int i = 0; i < n; i++)
+        recs[i] = extent_free[--extent_free_count];
+
+    int lo = TOTAL_BLOCKS, hi = -1;
+    for (int i = 0; i < n; i++) {
+        runs[i].next = i + 1 < n ? recs[i + 1] : -1;
+        if (memcmp(&extents[recs[i]], &runs[i], sizeof(Extent)) != 0) {
+            extents[recs[i]] = runs[i];
+            if (recs[i] < lo) lo = recs[i];
+            if (recs[i] > hi) hi = recs[i];
+        }
+    }
+    if (hi >= lo) {
+        size_t len = (size_t)(hi - lo + 1) * sizeof(Extent);
+        off_t off = block_offset(super.fat_start) + (off_t)lo * sizeof(Extent);
+        if (pwrite(fs_fd, &extents[lo], len, off) != (ssize_t)len)
+            die("write extents");
+    }
+    counter_add(&stat_extents, n - n_old);
+
+    int head = n > 0 ? recs[0] : -1;
+    if (head == extent_head[idx])
+        return 0;
+    extent_head[idx] = head;
+    return 1;
+}
+
+// Free-space index: a bit per block, set while the block is free, and a
+// summary bit per word of it, set while the word holds a free block, so
+// the first free block is two find-first-set instructions away. Rebuilt
+// from the FAT at format and load; every FAT change to or from FAT_FREE
+// goes through free_map_set.
+#define FREE_WORDS    ((TOTAL_BLOCKS + 63) / 64)
+#define SUMMARY_WORDS ((FREE_WORDS + 63) / 64)
+static uint64_t free_map[FREE_WORDS];
+static uint64_t free_summary[SUMMARY_WORDS];
+
+static int block_is_free(int b) {
+    return (free_map[b / 64] >> (b % 64)) & 1;
+}
+
+static void free_map_set(int b, int is_free) {
+    int w = b / 64;
+    if (is_free) {
+        free_map[w] |= 1ULL << (b % 64);
+        free_summary[w / 64] |= 1ULL << (w % 64);
+    } else {
+        free_map[w] &= ~(1ULL << (b % 64));
+        if (free_map[w] == 0)
+            free_summary[w / 64] &= ~(1ULL << (w % 64));
+    }
+    counter_add(&stat_free_blocks, is_free ? 1 : -1);
+}
+
+static void free_map_build(void) {
+    memset(free_map, 0, sizeof(free_map));
+    memset(free_summary, 0, sizeof(free_summary));
+    __atomic_store_n(&stat_free_blocks, 0, __ATOMIC_RELAXED);
+    for (int b = super.data_start; b < TOTAL_BLOCKS; b++) {
+        if (fat[b] == FAT_FREE)
+            free_map_set(b, 1);
+    }
+}
+
+// First free block at or after b, or -1; skips full words via the summary
+static int next_free(int b) {
+    if (b >= TOTAL_BLOCKS)
+        return -1;
+    int w = b / 64;
+    uint64_t bits = free_map[w] & (~0ULL << (b % 64));
+    if (bits)
+        return w * 64 + __builtin_ctzll(bits);
+    for (int sw = (w + 1) / 64; sw < SUMMARY_WORDS; sw++) {
+        uint64_t words = free_summary[sw];
+        if (sw == (w + 1) / 64)
+            words &= (w + 1) % 64 ? ~0ULL << ((w + 1) % 64) : ~0ULL;
+        if (words) {
+            int fw = sw * 64 + __builtin_ctzll(words);
+            return fw * 64 + __builtin_ctzll(free_map[fw]);
+        }
+    }
+    return -1;
+}
+
+// First block at or after b (a free one) that is in use, or TOTAL_BLOCKS
+static int run_end(int b) {
+    int w = b / 64;
+    uint64_t used = ~free_map[w] & (~0ULL << (b % 64));
+    while (!used && ++w < FREE_WORDS)
+        used = ~free_map[w];
+    int end = w < FREE_WORDS ? w * 64 + __builtin_ctzll(used) : TOTAL_BLOCKS;
+    return end < TOTAL_BLOCKS ? end : TOTAL_BLOCKS;
+}
+
+// Reserve up to want adjacent free blocks: the first run long enough, or
+// else the longest. Returns its first block (-1 if the disk is full) and
+// its length in *got; the caller links them into the FAT.
+static int alloc_run(int want, int *got) {
+    int best = -1, best_len = 0;
+    for (int b = next_free(0); b >= 0; ) {
+        int end = run_end(b);
+        if (end - b > best_len) {
+            best = b;
+            best_len = end - b;
+            if (best_len >= want)
+                break;
+        }
+        b = next_free(end);
+    }
+    if (best < 0)
+        return -1;
+    *got = best_len < want ? best_len : want;
+    for (int i = 0; i < *got; i++)
+        free_map_set(best + i, 0);
+    return best;
+}
+
+// Reserve up to want free blocks starting exactly at b, so a growing file
+// stays contiguous; -1 if b isn't free
+static int alloc_run_at(int b, int want, int *got) {
+    if (b >= TOTAL_BLOCKS || !block_is_free(b))
+        return -1;
+    int end = run_end(b);
+    *got = end - b < want ? end - b : want;
+    for (int i = 0; i < *got; i++)
+        free_map_set(b + i, 0);
+    return b;
+}
+
+// Directory index: a hash of the names in use, chained through dir_next,
+// and a stack of free entries, so lookups and creates don't scan the
+// directory. Rebuilt at format and load; fs_create and fs_delete keep it.
+#define DIR_HASH_SIZE (2 * MAX_DIR_ENTRIES)   // a power of two
+static int dir_hash[DIR_HASH_SIZE];           // first entry in each bucket, or -1
+static int dir_next[MAX_DIR_ENTRIES];
+static int dir_free[MAX_DIR_ENTRIES];         // free entries, lowest on top
+static int dir_free_count;
+
+// FNV-1a
+static unsigned int name_hash(const char *name) {
+    unsigned int h = 2166136261u;
+    for (; *name; name++)
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    return h & (DIR_HASH_SIZE - 1);
+}
+
+static void dir_index_add(int idx) {
+    unsigned int h = name_hash(dir_table[idx].name);
+    dir_next[idx] = dir_hash[h];
+    dir_hash[h] = idx;
+}
+
+static void dir_index_remove(int idx) {
+    int *p = &dir_hash[name_hash(dir_table[idx].name)];
+    while (*p != idx)
+        p = &dir_next[*p];
+    *p = dir_next[idx];
+}
+
+static void dir_index_build(void) {
+    memset(dir_hash, 0xff, sizeof(dir_hash));
+    dir_free_count = 0;
+    long long files = 0;
+    for (int i = dir_entries - 1; i >= 0; i--) {
+        if (!dir_table[i].in_use) {
+            dir_free[dir_free_count++] = i;
+            continue;
+        }
+        // A damaged directory holding a name twice: lookups find the first
+        dir_table[i].name[MAX_FILENAME - 1] = '\0';
+        dir_index_add(i);
+        files++;
+    }
+    __atomic_store_n(&stat_files, files, __ATOMIC_RELAXED);
+}
+
+// Chain map: each file's blocks in chain order, so block i of a file is
+// an array lookup instead of i hops along the FAT from first_block. Built
+// on a file's first ranged access; appends and truncates keep it, and
+// anything else that changes the chain forgets it.
+typedef struct {
+    int *blocks;
+    int count;
+    int cap;
+    int valid;
+} ChainMap;
+static ChainMap chain_map[MAX_DIR_ENTRIES];
+
+static void chain_map_forget(int idx) {
+    free(chain_map[idx].blocks);
+    memset(&chain_map[idx], 0, sizeof(ChainMap));
+}
+
+static int chain_map_reserve(ChainMap *m, int n) {
+    if (n <= m->cap)
+        return 1;
+    int cap = m->cap ? m->cap : 16;
+    while (cap < n)
+        cap *= 2;
+    int *blocks = realloc(m->blocks, (size_t)cap * sizeof(int));
+    if (!blocks)
+        return 0;
+    m->blocks = blocks;
+    m->cap = cap;
+    return 1;
+}
+
+// The blocks holding file idx's data, in order. 0 if out of memory.
+static int chain_map_get(int idx, int **blocks, int *count) {
+    ChainMap *m = &chain_map[idx];
+    if (!m->valid) {
+        int need = (dir_table[idx].length + block_size - 1) / block_size;
+        if (!chain_map_reserve(m, need))
+            return 0;
+        m->count = 0;
+        int cur = dir_table[idx].first_block;
+        while (cur >= super.data_start && cur < TOTAL_BLOCKS && m->count < need) {
+            m->blocks[m->count++] = cur;
+            int next = fat[cur];
+            if (next == FAT_EOF || next == FAT_FREE || next == FAT_RESERVED)
+                break;
+            cur = next;
+        }
+        m->valid = 1;
+    }
+    *blocks = m->blocks;
+    *count = m->count;
+    return 1;
+}
+
+// Formatting
+
+static int fs_format(int new_block_size, int layout) {
+    if (new_block_size == 0)
+        new_block_size = format_block_size;
+    if (layout < 0)
+        layout = format_layout;
+    if (new_block_size < MIN_BLOCK_SIZE || new_block_size > MAX_BLOCK_SIZE ||
+        (new_block_size & (new_block_size - 1)) != 0 ||
+        (layout != LAYOUT_FAT && layout != LAYOUT_EXTENTS))
+        return 2;
+    block_size = new_block_size;
+
+    // Size the image for the new block size
+    if (ftruncate(fs_fd, (off_t)TOTAL_BLOCKS * block_size) < 0)
+        die("ftruncate fs_image");
+
+    // Fill superblock
+    size_t map_bytes = layout == LAYOUT_EXTENTS ? sizeof(extents) : sizeof(fat);
+    int fat_blocks = (int)((map_bytes + block_size - 1) / block_size);
+    int dir_blocks = (DIR_BYTES + block_size - 1) / block_size;
+    int crc_blocks = (int)((sizeof(block_crc) + block_size - 1) / block_size);
+    memcpy(super.magic, layout == LAYOUT_EXTENTS ? "FS02" : "FS01", 4);
+    super.layout = layout;
+    super.total_blocks = TOTAL_BLOCKS;
+    super.fat_start = SUPERBLOCK_BLOCK + 1;
+    super.fat_blocks = fat_blocks;
+    super.dir_start = super.fat_start + fat_blocks;
+    super.dir_blocks = dir_blocks;
+    super.crc_start = super.dir_start + dir_blocks;
+    super.crc_blocks = crc_blocks;
+    super.data_start = super.crc_start + crc_blocks;
+    super.block_size = block_size;
+    super.dir_entries = dir_blocks * block_size / (int)sizeof(DirEntry);
+    if (super.dir_entries > MAX_DIR_ENTRIES)
+        super.dir_entries = MAX_DIR_ENTRIES;
+    dir_entries = super.dir_entries;
+    memset(super.reserved, 0, sizeof(super.reserved));
+
+    save_superblock();
+
+    // Initialize FAT
+    for (int i = 0; i < TOTAL_BLOCKS; i++) {
+        if (i < super.data_start) {
+            fat[i] = FAT_RESERVED; // space used by superblock/FAT/dir/checksums
+        } else {
+            fat[i] = FAT_FREE;
+        }
+    }
+    if (layout == LAYOUT_EXTENTS)
+        init_extents();
+    else
+        save_fat();
+
+    // Initialize directory
+    for (int i = 0; i < dir_entries; i++) {
+        dir_table[i].in_use = 0;
+        dir_table[i].name[0] = '\0';
+        dir_table[i].length = 0;
+        dir_table[i].first_block = -1;
+        memset(dir_table[i].padding, 0, sizeof(dir_table[i].padding));
+    }
+    save_dir();
+    dir_index_build();
+    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        chain_map_forget(i);
+
+    memset(block_crc, 0, sizeof(block_crc));
+    save_crcs();
+    free_map_build();
+
+    // Zero the data blocks by punching them out of the image, which keeps
+    // it sparse; write zeros only where the filesystem can't punch holes
+    off_t data_off = block_offset(super.data_start);
+    if (fallocate(fs_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, data_off,
+                  block_offset(TOTAL_BLOCKS) - data_off) < 0) {
+        if (errno != EOPNOTSUPP)
+            die("fallocate data blocks");
+        unsigned char *zero = calloc(1, block_size);
+        if (!zero)
+            die("calloc");
+        for (int b = super.data_start; b < TOTAL_BLOCKS; b++) {
+            if (pwrite(fs_fd, zero, block_size, block_offset(b)) != block_size)
+                die("write data zero");
+        }
+        free(zero);
+    }
+
+    fs_formatted = 1;
+    return 0; // success
+}
+
+static void fs_load_or_unformatted() {
+    if (!load_superblock()) {
+        fs_formatted = 0;
+        return;
+    }
+    // If superblock looks good, load the directory and FAT (or extents)
+    load_dir();
+    if (super.layout == LAYOUT_EXTENTS)
+        load_extents();
+    else
+        load_fat();
+    load_crcs();
+    fs_formatted = 1;
+
+    free_map_build();
+    dir_index_build();
+}
+
+// Helper: find file, free blocks
+
+static int find_file(const char *name) {
+    for (int i = dir_hash[name_hash(name)]; i >= 0; i = dir_next[i]) {
+        if (strcmp(dir_table[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void free_chain(int first_block) {
+    int cur = first_block;
+    while (cur >= super.data_start && cur < TOTAL_BLOCKS) {
+        int next = fat[cur];
+        if (!block_is_free(cur))
+            free_map_set(cur, 1);
+        fat[cur] = FAT_FREE;
+        if (next == FAT_EOF || next == FAT_FREE || next == FAT_RESERVED)
+            break;
+        cur = next;
+    }
+}
+
+// FS operations implementing the prompt
+
+static int fs_create(const char *name) {
+    if (!fs_formatted) return 2;
+    if (strlen(name) >= MAX_FILENAME) return 2;
+
+    if (find_file(name) >= 0)
+        return 1; // already exists
+
+    if (dir_free_count == 0)
+        return 2; // no directory space
+    int i = dir_free[--dir_free_count];
+    dir_table[i].in_use = 1;
+    strncpy(dir_table[i].name, name, MAX_FILENAME - 1);
+    dir_table[i].name[MAX_FILENAME - 1] = '\0';
+    dir_table[i].length = 0;
+    dir_table[i].first_block = -1;
+    dir_index_add(i);
+    save_dir_entry(i);
+    counter_add(&stat_files, 1);
+    return 0;
+}
+
+static int fs_delete(const char *name) {
+    if (!fs_formatted) return 2;
+
+    int idx = find_file(name);
+    if (idx < 0)
+        return 1;
+
+    if (dir_table[idx].first_block >= 0) {
+        free_chain(dir_table[idx].first_block);
+    }
+    chain_map_forget(idx);
+
+    dir_index_remove(idx);
+    dir_free[dir_free_count++] = idx;
+    dir_table[idx].in_use = 0;
+    dir_table[idx].name[0] = '\0';
+    dir_table[idx].length = 0;
+    dir_table[idx].first_block = -1;
+
+    save_extents(idx);
+    save_dir_entry(idx);
+    save_fat();
+    counter_add(&stat_files, -1);
+    return 0;
+}
+
+static int fs_write(const char *name, const unsigned char *data, int len) {
+    if (!fs_formatted) return 2;
+
+    int idx = find_file(name);
+    if (idx < 0)
+        return 1; // no such filename
+
+    // free old chain; the file stays empty if the new data doesn't fit
+    if (dir_table[idx].first_block >= 0) {
+        free_chain(dir_table[idx].first_block);
+    }
+    chain_map_forget(idx);
+    dir_table[idx].first_block = -1;
+    dir_table[idx].length = 0;
+
+    if (len == 0) {
+        save_extents(idx);
+        save_dir_entry(idx);
+        save_fat();
+        return 0;
+    }
+
+    int blocks_needed = (len + block_size - 1) / block_size;
+    int blocks[TOTAL_BLOCKS];
+    int first = -1;
+    int prev = -1;
+
+    // In as few contiguous runs as the free space allows
+    for (int i = 0; i < blocks_needed; ) {
+        int got;
+        int b = alloc_run(blocks_needed - i, &got);
+        if (b < 0) {
+            // out of space – free what we allocated so far
+            if (first >= 0) free_chain(first);
+            save_extents(idx);
+            save_dir_entry(idx);
+            save_fat();
+            return 2;
+        }
+
+        for (int j = 0; j < got; j++, i++) {
+            if (first < 0) first = b + j;
+            if (prev >= 0) fat[prev] = b + j;
+            fat[b + j] = FAT_EOF;
+            prev = b + j;
+            blocks[i] = b + j;
+        }
+    }
+
+    // The last block is zero-padded to block_size
+    unsigned char *padded = calloc(blocks_needed, block_size);
+    if (!padded) {
+        free_chain(first);
+        save_extents(idx);
+        save_dir_entry(idx);
+        save_fat();
+        return 2;
+    }
+    memcpy(padded, data, len);
+    if (!transfer_blocks(1, blocks, padded, blocks_needed))
+        die("write data block");
+    uint32_t sums[TOTAL_BLOCKS];
+    crc32c_blocks(padded, blocks_needed, block_size, sums);
+    for (int i = 0; i < blocks_needed; i++)
+        block_crc[blocks[i]] = sums[i];
+    free(padded);
+
+    dir_table[idx].first_block = first;
+    dir_table[idx].length = len;
+    save_crcs();
+    save_fat();
+    save_extents(idx);
+    save_dir_entry(idx);
+    counter_add(&stat_bytes_written, len);
+    return 0;
+}
+
+// Check count blocks just read against their checksums. Returns 1 if good.
+static int check_blocks(const char *name, const int *blocks, const unsigned char *buf, int count) {
+    if (super.crc_start == 0)
+        return 1;
+    uint32_t sums[TOTAL_BLOCKS];
+    crc32c_blocks(buf, count, block_size, sums);
+    for (int i = 0; i < count; i++) {
+        if (sums[i] != block_crc[blocks[i]]) {
+            fprintf(stderr, "%s: checksum mismatch in block %d\n", name, blocks[i]);
+            counter_add(&stat_checksum_errors, 1);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int read_block_checked(const char *name, int b, unsigned char *buf) {
+    return transfer_blocks(0, &b, buf, 1) && check_blocks(name, &b, buf, 1);
+}
+
+// Grow file idx's chain of have blocks to want, in place: the old last
+// block is linked to the new ones, which continue it on disk where the
+// space after it is free. The chain map must be built; it may move.
+// Returns 0, having changed nothing, if the disk fills up.
+static int extend_chain(int idx, int have, int want) {
+    ChainMap *m = &chain_map[idx];
+    if (!chain_map_reserve(m, want))
+        return 0;
+    int *blocks = m->blocks;
+    int prev = have > 0 ? blocks[have - 1] : -1;
+    for (int i = have; i < want; ) {
+        int got;
+        int b = prev >= 0 ? alloc_run_at(prev + 1, want - i, &got) : -1;
+        if (b < 0)
+            b = alloc_run(want - i, &got);
+        if (b < 0) {
+            for (int j = have; j < i; j++) {
+                fat[blocks[j]] = FAT_FREE;
+                free_map_set(blocks[j], 1);
+            }
+            if (have > 0)
+                fat[blocks[have - 1]] = FAT_EOF;
+            else
+                dir_table[idx].first_block = -1;
+            return 0;
+        }
+
+        for (int j = 0; j < got; j++, i++) {
+            if (prev >= 0)
+                fat[prev] = b + j;
+            else
+                dir_table[idx].first_block = b + j;
+            fat[b + j] = FAT_EOF;
+            mark_dirty(b + j);
+            if (prev >= 0)
+                mark_dirty(prev);
+            prev = b + j;
+            blocks[i] = b + j;
+        }
+    }
+    m->count = want;
+    return 1;
+}
+
+// Write len bytes at offset, growing the file if they reach past its end
+// (a gap reads as zeros). Only the blocks the data lands in, and any the
+// file grows by, are written; a partly covered block is read first.
+static int fs_pwrite(const char *name, int offset, const unsigned char *data, int len) {
+    if (!fs_formatted) return 2;
+
+    int idx = find_file(name);
+    if (idx < 0)
+        return 1;
+    if (offset < 0 || len < 0 || (long long)offset + len > (long long)TOTAL_BLOCKS * block_size)
+        return 2;
+
+    int old_len = dir_table[idx].length;
+    int end = offset + len;
+    int new_len = end > old_len ? end : old_len;
+    int *blocks, have;
+    if (!chain_map_get(idx, &blocks, &have))
+        return 2;
+    int want = (new_len + block_size - 1) / block_size;
+
+    // Blocks [lo, hi) change. Past the old end they're all new, and the
+    // old last block is zero after old_len already.
+    int lo = offset / block_size;
+    if (lo > have) lo = have;
+    int hi = len > 0 ? (end + block_size - 1) / block_size : lo;
+    if (want > have) hi = want;
+
+    unsigned char *buf = NULL;
+    if (hi > lo) {
+        buf = calloc(hi - lo, block_size);
+        if (!buf) return 2;
+        // Only the first and last can be partly covered
+        int edges[2] = { lo, hi - 1 };
+        for (int e = 0; e < (hi - 1 > lo ? 2 : 1); e++) {
+            int k = edges[e];
+            int covered = len > 0 && offset <= k * block_size && end >= (k + 1) * block_size;
+            if (k < have && !covered &&
+                !read_block_checked(name, blocks[k], buf + (size_t)(k - lo) * block_size)) {
+                free(buf);
+                return 2;
+            }
+        }
+    }
+
+    if (!extend_chain(idx, have, want)) {
+        free(buf);
+        return 2;
+    }
+    blocks = chain_map[idx].blocks;
+
+    if (buf) {
+        if (len > 0)
+            memcpy(buf + (offset - (size_t)lo * block_size), data, len);
+        if (!transfer_blocks(1, blocks + lo, buf, hi - lo))
+            die("write data block");
+        uint32_t sums[TOTAL_BLOCKS];
+        crc32c_blocks(buf, hi - lo, block_size, sums);
+        for (int k = lo; k < hi; k++) {
+            block_crc[blocks[k]] = sums[k - lo];
+            mark_dirty(blocks[k]);
+        }
+        free(buf);
+    }
+
+    dir_table[idx].length = new_len;
+    save_dirty();
+    if (save_extents(idx) || new_len != old_len)
+        save_dir_entry(idx);
+    counter_add(&stat_bytes_written, len);
+    return 0;
+}
+
+static int fs_append(const char *name, const unsigned char *data, int len) {
+    int idx = fs_formatted ? find_file(name) : -1;
+    if (idx < 0)
+        return fs_formatted ? 1 : 2;
+    return fs_pwrite(name, dir_table[idx].length, data, len);
+}
+
+// Set the file's length: growing pads it with zeros, shrinking frees the
+// blocks past the new end and clears the tail of the new last block.
+static int fs_truncate(const char *name, int len) {
+    if (!fs_formatted) return 2;
+
+    int idx = find_file(name);
+    if (idx < 0)
+        return 1;
+    if (len < 0)
+        return 2;
+    if (len >= dir_table[idx].length)
+        return fs_pwrite(name, len, NULL, 0);
+
+    int *blocks, have;
+    if (!chain_map_get(idx, &blocks, &have))
+        return 2;
+    int keep = (len + block_size - 1) / block_size;
+
+    if (len % block_size != 0) {
+        unsigned char *buf = malloc(block_size);
+        if (!buf) return 2;
+        int last = blocks[keep - 1];
+        if (!read_block_checked(name, last, buf)) {
+            free(buf);
+            return 2;
+        }
+        memset(buf + len % block_size, 0, block_size - len % block_size);
+        if (!transfer_blocks(1, &last, buf, 1))
+            die("write data block");
+        block_crc[last] = crc32c(buf, block_size);
+        mark_dirty(last);
+        free(buf);
+    }
+
+    for (int k = keep; k < have; k++) {
+        fat[blocks[k]] = FAT_FREE;
+        free_map_set(blocks[k], 1);
+        mark_dirty(blocks[k]);
+    }
+    if (keep > 0) {
+        fat[blocks[keep - 1]] = FAT_EOF;
+        mark_dirty(blocks[keep - 1]);
+    } else {
+        dir_table[idx].first_block = -1;
+    }
+    chain_map[idx].count = keep;
+
+    dir_table[idx].length = len;
+    save_dirty();
+    save_extents(idx);
+    save_dir_entry(idx);
+    return 0;
+}
+
+// Up to len bytes from offset, fewer at the end of the file. Only the
+// blocks they fall in are read, found through the chain map.
+static int fs_read_range(const char *name, int offset, int len,
+                         unsigned char **out_buf, int *out_len) {
+    if (!fs_formatted) return 2;
+
+    int idx = find_file(name);
+    if (idx < 0)
+        return 1;
+    if (offset < 0 || len < 0)
+        return 2;
+
+    *out_buf = NULL;
+    *out_len = 0;
+    int file_len = dir_table[idx].length;
+    if (offset >= file_len || len == 0)
+        return 0;
+    int end = len > file_len - offset ? file_len : offset + len;
+
+    int *blocks, count;
+    if (!chain_map_get(idx, &blocks, &count))
+        return 2;
+    int first = offset / block_size;
+    int n = (end + block_size - 1) / block_size - first;
+    int avail = count - first < n ? count - first : n;   // a short chain reads as zeros
+    if (avail < 0)
+        avail = 0;
+
+    // All of its blocks are read as one batch
+    unsigned char *buf = (unsigned char *)calloc(n, block_size);
+    if (!buf) return 2;
+    if (!transfer_blocks(0, blocks + first, buf, avail) ||
+        !check_blocks(name, blocks + first, buf, avail)) {
+        free(buf);
+        return 2;
+    }
+    if (offset % block_size != 0)
+        memmove(buf, buf + offset % block_size, end - offset);
+
+    *out_buf = buf;
+    *out_len = end - offset;
+    counter_add(&stat_bytes_read, end - offset);
+    return 0;
+}
+
+static int fs_read(const char *name, unsigned char **out_buf, int *out_len) {
+    return fs_read_range(name, 0, INT_MAX, out_buf, out_len);
+}
+
+// Statistics
+
+static int cmd_index(int op) {
+    const char *letters = "FCDLRGWPATBS";
+    const char *p = op ? strchr(letters, op) : NULL;
+    return p ? (int)(p - letters) : CMD_OTHER;
+}
+
+static void count_command(int op, int rc, const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int i = cmd_index(op);
+    counter_add(&stat_count[i], 1);
+    if (rc != 0)
+        counter_add(&stat_failed[i], 1);
+    hist_record_shared(&stat_latency[i], (now.tv_sec - start->tv_sec) * 1000000LL +
+                                         (now.tv_nsec - start->tv_nsec) / 1000);
+}
+
+// One "key value" line per statistic, terminated by "END"
+static char *format_stats(int *out_len) {
+    size_t cap = 512 + NUM_CMDS * 7 * 48;
+    char *out = malloc(cap);
+    if (!out) return NULL;
+    int n = snprintf(out, cap,
+                     "files %lld\n"
+                     "free_blocks %lld\n"
+                     "bytes_read %lld\n"
+                     "bytes_written %lld\n"
+                     "checksum_errors %lld\n",
+                     counter_read(&stat_files), counter_read(&stat_free_blocks),
+                     counter_read(&stat_bytes_read), counter_read(&stat_bytes_written),
+                     counter_read(&stat_checksum_errors));
+    if (super.layout == LAYOUT_EXTENTS)
+        n += snprintf(out + n, cap - n, "extents %lld\n", counter_read(&stat_extents));
+    Histogram *h = malloc(sizeof(Histogram));
+    for (int i = 0; h && i < NUM_CMDS; i++) {
+        long long count = counter_read(&stat_count[i]);
+        if (count == 0)
+            continue;
+        hist_reset(h);
+        hist_merge_shared(h, &stat_latency[i]);
+        n += snprintf(out + n, cap - n,
+                      "cmd_%s %lld\n"
+                      "cmd_%s_failed %lld\n"
+                      "cmd_%s_mean_usec %.1f\n"
+                      "cmd_%s_p50_usec %lld\n"
+                      "cmd_%s_p99_usec %lld\n"
+                      "cmd_%s_p999_usec %lld\n"
+                      "cmd_%s_max_usec %lld\n",
+                      cmd_names[i], count, cmd_names[i], counter_read(&stat_failed[i]),
+                      cmd_names[i], hist_mean(h), cmd_names[i], hist_percentile(h, 0.5),
+                      cmd_names[i], hist_percentile(h, 0.99), cmd_names[i],
+                      hist_percentile(h, 0.999), cmd_names[i], h->max);
+    }
+    free(h);
+    n += snprintf(out + n, cap - n, "END\n");
+    *out_len = n;
+    return out;
+}
+
+// -S: append "time <unix seconds>" and the S report to the file every
+// stats_interval seconds
+static void *stats_dumper(void *arg) {
+    (void)arg;
+    while (1) {
+        sleep(stats_interval);
+        int len;
+        char *text = format_stats(&len);
+        if (!text)
+            continue;
+        if (dprintf(stats_fd, "time %lld\n%.*s", (long long)time(NULL), len, text) < 0)
+            perror("write stats file");
+        free(text);
+    }
+    return NULL;
+}
+
+// Network handling for FS protocol
+
+static void handle_list(FILE *client, int verbose) {
+    // status line just to keep consistent
+    fprintf(client, "0\n");
+    for (int i = 0; i < dir_entries; i++) {
+        if (dir_table[i].in_use) {
+            if (!verbose)
+                fprintf(client, "%s\n", dir_table[i].name);
+            else
+                fprintf(client, "%s %d\n", dir_table[i].name, dir_table[i].length);
+        }
+    }
+    fprintf(client, "END\n");
+    fflush(client);
+}
+
+// Binary framing
+//
+// "B" answers "0" and switches the connection to binary frames. Each
+// request is a 12-byte header, then the file name, then `data_len` bytes
+// of data; all fields are little-endian:
+//
+//   0  u8  op        'F', 'C', 'D', 'L', 'R', 'G', 'W', 'P', 'A', 'T' or 'S'
+//   1  u8  flags     L: 1 = include lengths
+//   2  u16 name_len
+//   4  u32 tag       echoed in the reply
+//   8  u32 data_len  W, A: the bytes to write; P: u32 offset, then the
+//                    bytes; T: u32 new length; G: u32 offset, u32 length;
+//                    F: optional u32 block size, then optional u32 layout
+//
+// Each reply is a 16-byte header followed by `length` payload bytes:
+//
+//   0  u8  status    the usual return code (0, 1 or 2)
+//   1  u8  op
+//   2  u16 flags     0
+//   4  u32 tag
+//   8  u32 length    R: file contents; G: the bytes read; L: "name[ length]\n" lines;
+//                    S: the statistics as "S" sends them
+//  12  u32 reserved  0
+
+#define FS_REQ_HDR_SIZE  12
+#define FS_RESP_HDR_SIZE 16
+#define MAX_FRAME_DATA   ((unsigned int)TOTAL_BLOCKS * block_size)
+
+static unsigned int get_le16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int get_le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static void put_le32(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static void send_frame(FILE *client, int rc, int op, unsigned int tag,
+                       const void *payload, int len) {
+    unsigned char h[FS_RESP_HDR_SIZE];
+    h[0] = (unsigned char)rc;
+    h[1] = (unsigned char)op;
+    h[2] = h[3] = 0;
+    put_le32(h + 4, tag);
+    put_le32(h + 8, len);
+    put_le32(h + 12, 0);
+    fwrite(h, 1, FS_RESP_HDR_SIZE, client);
+    if (len > 0)
+        fwrite(payload, 1, len, client);
+    fflush(client);
+}
+
+static char *format_list(int verbose, int *out_len) {
+    size_t cap = (size_t)dir_entries * (MAX_FILENAME + 16) + 1;
+    char *out = malloc(cap);
+    if (!out) return NULL;
+    int n = 0;
+    for (int i = 0; i < dir_entries; i++) {
+        if (!dir_table[i].in_use) continue;
+        if (!verbose)
+            n += snprintf(out + n, cap - n, "%s\n", dir_table[i].name);
+        else
+            n += snprintf(out + n, cap - n, "%s %d\n", dir_table[i].name, dir_table[i].length);
+    }
+    *out_len = n;
+    return out;
+}
+
+// Serve binary frames until the client disconnects or sends garbage.
+static void handle_binary(FILE *in, FILE *out) {
+    unsigned char h[FS_REQ_HDR_SIZE];
+    while (fread(h, 1, FS_REQ_HDR_SIZE, in) == FS_REQ_HDR_SIZE) {
+        int op = h[0];
+        int flags = h[1];
+        unsigned int name_len = get_le16(h + 2);
+        unsigned int tag = get_le32(h + 4);
+        unsigned int data_len = get_le32(h + 8);
+        if (name_len >= MAX_FILENAME || data_len > MAX_FRAME_DATA) {
+            fprintf(stderr, "bad binary frame, dropping connection\n");
+            return;
+        }
+
+        char fname[MAX_FILENAME];
+        if (fread(fname, 1, name_len, in) != name_len)
+            return;
+        fname[name_len] = '\0';
+
+        // W data goes straight into the buffer handed to fs_write
+        unsigned char *data = NULL;
+        if (data_len > 0) {
+            data = malloc(data_len);
+            if (!data)
+                return;
+            if (fread(data, 1, data_len, in) != data_len) {
+                free(data);
+                return;
+            }
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long long trace_addr = (op == 'P' || op == 'G') && data_len >= 4 ? get_le32(data) :
+                               op == 'F' && data_len == 8 ? get_le32(data + 4) + 1 : 0;
+        long long trace_len = op == 'W' || op == 'A' ? data_len :
+                              op == 'P' && data_len >= 4 ? data_len - 4 :
+                              op == 'G' && data_len == 8 ? get_le32(data + 4) :
+                              op == 'F' && data_len >= 4 ? get_le32(data) :
+                              op == 'T' && data_len == 4 ? get_le32(data) :
+                              op == 'L' ? (flags & 1) : 0;
+        trace_add(&tracer, op, client_id, trace_addr, trace_len, fname);
+
+        int rc = 2;
+        unsigned char *reply = NULL;
+        int reply_len = 0;
+        switch (op) {
+        case 'F':
+            // Optional u32 block size, then optional u32 layout, as the data
+            rc = fs_format(data_len >= 4 ? (int)get_le32(data) : 0,
+                           data_len == 8 ? (int)get_le32(data + 4) : -1);
+            break;
+        case 'C': rc = fs_create(fname); break;
+        case 'D': rc = fs_delete(fname); break;
+        case 'W': rc = fs_write(fname, data, (int)data_len); break;
+        case 'A': rc = fs_append(fname, data, (int)data_len); break;
+        case 'P':
+            if (data_len >= 4)
+                rc = fs_pwrite(fname, (int)get_le32(data), data + 4, (int)data_len - 4);
+            break;
+        case 'T':
+            if (data_len == 4)
+                rc = fs_truncate(fname, (int)get_le32(data));
+            break;
+        case 'R': rc = fs_read(fname, &reply, &reply_len); break;
+        case 'G':
+            if (data_len == 8)
+                rc = fs_read_range(fname, (int)get_le32(data), (int)get_le32(data + 4),
+                                   &reply, &reply_len);
+            break;
+        case 'L':
+            reply = (unsigned char *)format_list(flags & 1, &reply_len);
+            rc = reply ? 0 : 2;
+            break;
+        case 'S':
+            reply = (unsigned char *)format_stats(&reply_len);
+            rc = reply ? 0 : 2;
+            break;
+        }
+        if (rc != 0)
+            reply_len = 0;
+        send_frame(out, rc, op, tag, reply, reply_len);
+        count_command(op, rc, &start);
+        free(reply);
+        free(data);
+    }
+}
+
+// Serve one ASCII command line; returns the code it answered with
+static int serve_command(FILE *in, FILE *out, const char *line) {
+    int rc = 2;
+    if (line[0] == 'F') {
+        // "F [block size [layout]]"; 0 or none takes the -b/-e default
+        int bs = 0, layout = -1;
+        sscanf(line, "F %d %d", &bs, &layout);
+        trace_add(&tracer, 'F', client_id, layout + 1, bs, NULL);
+        rc = fs_format(bs, layout);
+        fprintf(out, "%d\n", rc);
+    } else if (line[0] == 'C') {
+        char fname[MAX_FILENAME];
+        if (sscanf(line, "C %31s", fname) == 1) {
+            trace_add(&tracer, 'C', client_id, 0, 0, fname);
+            rc = fs_create(fname);
+        }
+        fprintf(out, "%d\n", rc);
+    } else if (line[0] == 'D') {
+        char fname[MAX_FILENAME];
+        if (sscanf(line, "D %31s", fname) == 1) {
+            trace_add(&tracer, 'D', client_id, 0, 0, fname);
+            rc = fs_delete(fname);
+        }
+        fprintf(out, "%d\n", rc);
+    } else if (line[0] == 'L') {
+        int b = 0;
+        sscanf(line, "L %d", &b);
+        trace_add(&tracer, 'L', client_id, 0, b != 0, NULL);
+        handle_list(out, b != 0);
+        rc = 0;
+    } else if (line[0] == 'R' || line[0] == 'G') {
+        // "R name" or "G name offset len"; both answer "rc len data"
+        char fname[MAX_FILENAME];
+        int offset = 0, count = 0;
+        int ok = line[0] == 'R' ? sscanf(line, "R %31s", fname) == 1
+                                : sscanf(line, "G %31s %d %d", fname, &offset, &count) == 3;
+        if (!ok) {
+            fprintf(out, "2 0 \n");
+        } else {
+            trace_add(&tracer, line[0], client_id, offset, count, fname);
+            unsigned char *buf = NULL;
+            int len = 0;
+            rc = line[0] == 'R' ? fs_read(fname, &buf, &len)
+                                : fs_read_range(fname, offset, count, &buf, &len);
+            // Send: return_code, length (ASCII), space, data, all in one flush
+            fprintf(out, "%d %d ", rc, len);
+            if (rc == 0 && len > 0 && buf != NULL) {
+                if (fwrite(buf, 1, len, out) != (size_t)len) {
+                    perror("write read-data to client");
+                }
+            }
+            fputc('\n', out); // line break after data
+            if (buf) free(buf);
+        }
+    } else if (line[0] == 'W') {
+        char fname[MAX_FILENAME];
+        int len;
+        if (sscanf(line, "W %31s %d", fname, &len) == 2 && len >= 0) {
+            trace_add(&tracer, 'W', client_id, 0, len, fname);
+            unsigned char *buf = len > 0 ? (unsigned char *)malloc(len) : NULL;
+            // Through the FILE buffer: fgets may already hold the data
+            if (len == 0 || (buf && fread(buf, 1, len, in) == (size_t)len))
+                rc = fs_write(fname, buf, len);
+            if (buf) free(buf);
+        }
+        fprintf(out, "%d\n", rc);
+    } else if (line[0] == 'P' || line[0] == 'A') {
+        // "P name offset len" or "A name len", then len bytes
+        char fname[MAX_FILENAME];
+        int offset = 0, len;
+        int ok = line[0] == 'P' ? sscanf(line, "P %31s %d %d", fname, &offset, &len) == 3
+                                : sscanf(line, "A %31s %d", fname, &len) == 2;
+        if (ok && len >= 0) {
+            trace_add(&tracer, line[0], client_id, offset, len, fname);
+            unsigned char *buf = len > 0 ? (unsigned char *)malloc(len) : NULL;
+            if (len == 0 || (buf && fread(buf, 1, len, in) == (size_t)len))
+                rc = line[0] == 'P' ? fs_pwrite(fname, offset, buf, len)
+                                    : fs_append(fname, buf, len);
+            if (buf) free(buf);
+        }
+        fprintf(out, "%d\n", rc);
+    } else if (line[0] == 'T') {
+        char fname[MAX_FILENAME];
+        int len;
+        if (sscanf(line, "T %31s %d", fname, &len) == 2) {
+            trace_add(&tracer, 'T', client_id, 0, len, fname);
+            rc = fs_truncate(fname, len);
+        }
+        fprintf(out, "%d\n", rc);
+    } else if (line[0] == 'S') {
+        // "0", then the statistics, then "END"
+        int len;
+        char *text = format_stats(&len);
+        rc = text ? 0 : 2;
+        fprintf(out, "%d\n", rc);
+        if (text) {
+            fwrite(text, 1, len, out);
+            free(text);
+        }
+    } else {
+        // Unknown command
+        fprintf(out, "2\n");
+    }
+    fflush(out);
+    return rc;
+}
+
+static void handle_client(int client_sock) {
+    // Separate read and write streams: a single "r+" stream can't switch
+    // from reading to writing while pipelined commands are still buffered.
+    FILE *in = fdopen(client_sock, "r");
+    FILE *out = in ? fdopen(dup(client_sock), "w") : NULL;
+    if (!in || !out) {
+        perror("fdopen client");
+        if (in) fclose(in);
+        else close(client_sock);
+        return;
+    }
+
+    char line[1024];
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (line[0] == 'B') {
+            fprintf(out, "0\n");
+            fflush(out);
+            count_command('B', 0, &start);
+            handle_binary(in, out);
+            break;
+        }
+        int rc = serve_command(in, out, line);
+        count_command(line[0], rc, &start);
+    }
+
+    trace_flush(&tracer);
+    fclose(out);
+    fclose(in);
+}
+
+// main
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int want_ring = 0;
+    int usage = 0;
+    const char *trace_path = NULL;
+    const char *stats_path = NULL;
+    while ((opt = getopt(argc, argv, "ueb:T:S:i:")) != -1) {
+        switch (opt) {
+        case 'u': want_ring = 1; break;
+        case 'e': format_layout = LAYOUT_EXTENTS; break;
+        case 'T': trace_path = optarg; break;
+        case 'S': stats_path = optarg; break;
+        case 'i':
+            stats_interval = atoi(optarg);
+            if (stats_interval <= 0) {
+                fprintf(stderr, "invalid stats interval: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            format_block_size = atoi(optarg);
+            if (format_block_size < MIN_BLOCK_SIZE || format_block_size > MAX_BLOCK_SIZE ||
+                (format_block_size & (format_block_size - 1)) != 0) {
+                fprintf(stderr, "block size must be a power of two from %d to %d\n",
+                        MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+                return 1;
+            }
+            break;
+        default: usage = 1; break;
+        }
+    }
+    if (usage || argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-u] [-e] [-b block_size] [-T trace_file] [-S stats_file [-i seconds]] <port> <fs_image>\n", argv[0]);
+        return 1;
+    }
+    argv += optind - 1;
+
+    int port = atoi(argv[1]);
+    const char *fs_image = argv[2];
+
+    fs_fd = open(fs_image, O_RDWR | O_CREAT, 0666);
+    if (fs_fd < 0) die("open fs_image");
+
+    // Room for at least the superblock; a formatted image is resized to
+    // its own block size once the superblock has been read
+    struct stat st;
+    if (fstat(fs_fd, &st) < 0) die("fstat fs_image");
+    if (st.st_size < (off_t)TOTAL_BLOCKS * DEFAULT_BLOCK_SIZE &&
+        ftruncate(fs_fd, (off_t)TOTAL_BLOCKS * DEFAULT_BLOCK_SIZE) < 0)
+        die("ftruncate fs_image");
+
+    if (want_ring) {
+        if (ioring_init(&ring, RING_ENTRIES) == 0)
+            use_ring = 1;
+        else
+            perror("io_uring_setup (falling back to pread/pwrite)");
+    }
+
+    crc32c_init();
+    fs_load_or_unformatted();
+    if (!fs_formatted) {
+        fprintf(stderr, "Filesystem not formatted yet. Use 'F' command from client.\n");
+    } else if (ftruncate(fs_fd, (off_t)TOTAL_BLOCKS * block_size) < 0) {
+        die("ftruncate fs_image");
+    }
+
+    if (trace_path && !trace_open(&tracer, trace_path, 'F', 0))
+        return 1;
+    if (stats_path) {
+        stats_fd = open(stats_path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if (stats_fd < 0) die("open stats_file");
+        pthread_t stats_tid;
+        if (pthread_create(&stats_tid, NULL, stats_dumper, NULL) != 0)
+            die("pthread_create (stats)");
+        pthread_detach(stats_tid);
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) die("socket");
+
+    int optval = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        die("bind");
+
+    if (listen(listen_fd, 5) < 0)
+        die("listen");
+
+    printf("Filesystem server listening on port %d, image %s\n", port, fs_image);
+    printf("Data blocks: %s\n", use_ring ? "io_uring" : "pread/pwrite");
+    if (tracer.fd >= 0)
+        printf("Trace: %s\n", trace_path);
+    if (stats_fd >= 0)
+        printf("Stats: %s every %d s\n", stats_path, stats_interval);
+
+    while (1) {
+        int client_sock = accept(listen_fd, NULL, NULL);
+        if (client_sock < 0) {
+            perror("accept");
+            continue;
+        }
+        // Single-threaded: handle one client at a time
+        handle_client(client_sock);
+        client_id++;
+    }
+
+    close(listen_fd);
+    close(fs_fd);
+    return 0;
+}
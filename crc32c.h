@@ -0,0 +1,106 @@
+// crc32c.h
+// CRC32C (Castagnoli) block checksums shared by the disk and filesystem
+// servers. Uses the SSE4.2 crc32 instruction when the CPU has it, picked
+// at runtime by crc32c_init(), and a lookup table otherwise.
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+static uint32_t crc32c_table[256];
+static int crc32c_hw;            // the SSE4.2 kernels are in use
+
+static inline void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        crc32c_table[i] = c;
+    }
+#ifdef CRC32C_HAVE_SSE42
+    __builtin_cpu_init();
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static inline const char *crc32c_kernel(void) {
+    return crc32c_hw ? "sse4.2" : "table";
+}
+
+// Continue a CRC (without the final inversion) over len bytes
+static inline uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len--)
+        crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = (uint32_t)c;
+    for (; len > 0; p++, len--)
+        c32 = _mm_crc32_u8(c32, *p);
+    return c32;
+}
+
+// Three blocks at once. crc32 takes three cycles but a new one can start
+// every cycle, so three independent streams keep the unit busy; blocks are
+// checksummed separately, so there is nothing to combine afterwards.
+__attribute__((target("sse4.2")))
+static inline void crc32c_sse42_x3(const unsigned char *a, const unsigned char *b,
+                                   const unsigned char *c, size_t len, uint32_t *out) {
+    uint64_t ca = 0xffffffff, cb = 0xffffffff, cc = 0xffffffff;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t va, vb, vc;
+        memcpy(&va, a + i, 8);
+        memcpy(&vb, b + i, 8);
+        memcpy(&vc, c + i, 8);
+        ca = _mm_crc32_u64(ca, va);
+        cb = _mm_crc32_u64(cb, vb);
+        cc = _mm_crc32_u64(cc, vc);
+    }
+    out[0] = ~crc32c_sse42((uint32_t)ca, a + i, len - i);
+    out[1] = ~crc32c_sse42((uint32_t)cb, b + i, len - i);
+    out[2] = ~crc32c_sse42((uint32_t)cc, c + i, len - i);
+}
+#endif
+
+static inline uint32_t crc32c(const void *buf, size_t len) {
+#ifdef CRC32C_HAVE_SSE42
+    if (crc32c_hw)
+        return ~crc32c_sse42(0xffffffff, buf, len);
+#endif
+    return ~crc32c_sw(0xffffffff, buf, len);
+}
+
+// The checksum of each of n blocks of bs bytes, into out[0..n)
+static inline void crc32c_blocks(const unsigned char *buf, long long n, int bs, uint32_t *out) {
+    long long i = 0;
+#ifdef CRC32C_HAVE_SSE42
+    if (crc32c_hw) {
+        for (; i + 3 <= n; i += 3) {
+            const unsigned char *p = buf + (size_t)i * bs;
+            crc32c_sse42_x3(p, p + bs, p + 2 * (size_t)bs, bs, out + i);
+        }
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = crc32c(buf + (size_t)i * bs, bs);
+}
+
+#endif
@@ -11,7 +11,18 @@
 #include <arpa/inet.h>
 #include <ctype.h>
 
-#define BLOCK_SIZE 128
+#define DEFAULT_BLOCK_SIZE 128
+
+// Block size the server reported with "I" (older servers send only the
+// geometry, and their blocks are 128 bytes)
+static int block_size = DEFAULT_BLOCK_SIZE;
+
+static void parse_geometry(const char *resp) {
+    long long cyl, sec;
+    int bs;
+    if (sscanf(resp, "%lld %lld %d", &cyl, &sec, &bs) == 3 && bs > 0)
+        block_size = bs;
+}
 
 int main(int argc, char *argv[]) {
     if (argc != 3) {
@@ -51,11 +62,31 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    printf("Connected to disk server %s:%d\n", server_ip, port);
+    // Learn the block size before anything is read or written
+    char info[1024];
+    fputs("I\n", server);
+    fflush(server);
+    if (!fgets(info, sizeof(info), server)) {
+        fprintf(stderr, "Failed to read disk geometry\n");
+        fclose(server);
+        return 1;
+    }
+    parse_geometry(info);
+
+    unsigned char *buf = malloc(block_size);
+    if (!buf) {
+        perror("malloc");
+        fclose(server);
+        return 1;
+    }
+
+    printf("Connected to disk server %s:%d, block size %d\n", server_ip, port, block_size);
     printf("Commands:\n");
     printf("  I                -> get disk geometry\n");
     printf("  R c s            -> read cylinder c, sector s\n");
+    printf("  RN c s n         -> read n consecutive blocks starting at (c,s)\n");
     printf("  W c s l          -> write l bytes to (c,s), then you type data\n");
+    printf("  D c s n          -> discard n blocks starting at (c,s)\n");
     printf("Type Ctrl+D to quit.\n\n");
 
     char line[1024];
@@ -73,13 +104,49 @@ int main(int argc, char *argv[]) {
             fputs("I\n", server);
             fflush(server);
 
-            char resp[1024];
-            if (fgets(resp, sizeof(resp), server)) {
-                printf("Server: %s", resp);
+            if (fgets(info, sizeof(info), server)) {
+                printf("Server: %s", info);
             } else {
                 printf("Disconnected.\n");
                 break;
             }
+        } else if (line[0] == 'R' && line[1] == 'N') {
+            long long c, s;
+            int n;
+            if (sscanf(line, "RN %lld %lld %d", &c, &s, &n) != 3 || n < 1) {
+                printf("Usage: RN c s n\n");
+                continue;
+            }
+
+            fputs(line, server);
+            fflush(server);
+
+            int ch = fgetc(server);
+            if (ch == EOF) {
+                printf("Disconnected.\n");
+                break;
+            }
+            if (ch != '1') {
+                printf("Read failed.\n");
+                continue;
+            }
+            printf("Data (printable / '.' for others), one line per block:\n");
+            int ok = 1;
+            for (int b = 0; b < n; b++) {
+                if (fread(buf, 1, block_size, server) != (size_t)block_size) {
+                    ok = 0;
+                    break;
+                }
+                for (int i = 0; i < block_size; i++) {
+                    unsigned char c = buf[i];
+                    putchar(isprint(c) ? c : '.');
+                }
+                putchar('\n');
+            }
+            if (!ok) {
+                printf("Short read from server.\n");
+                break;
+            }
         } else if (line[0] == 'R') {
             // Forward line as-is
             fputs(line, server);
@@ -93,15 +160,14 @@ int main(int argc, char *argv[]) {
             if (ch == '0') {
                 printf("Read failed.\n");
             } else if (ch == '1') {
-                unsigned char buf[BLOCK_SIZE];
-                int srv_fd = fileno(server);
-                ssize_t n = read(srv_fd, buf, BLOCK_SIZE);
-                if (n != BLOCK_SIZE) {
+                // The block may already sit in the FILE buffer behind the status byte
+                size_t n = fread(buf, 1, block_size, server);
+                if (n != (size_t)block_size) {
                     printf("Short read from server.\n");
                     break;
                 }
                 printf("Data (printable / '.' for others):\n");
-                for (int i = 0; i < BLOCK_SIZE; i++) {
+                for (int i = 0; i < block_size; i++) {
                     unsigned char c = buf[i];
                     putchar(isprint(c) ? c : '.');
                 }
@@ -109,14 +175,32 @@ int main(int argc, char *argv[]) {
             } else {
                 printf("Unexpected response: %c\n", ch);
             }
+        } else if (line[0] == 'D') {
+            long long c, s;
+            int n;
+            if (sscanf(line, "D %lld %lld %d", &c, &s, &n) != 3 || n < 1) {
+                printf("Usage: D c s n\n");
+                continue;
+            }
+
+            fputs(line, server);
+            fflush(server);
+
+            int ch = fgetc(server);
+            if (ch == EOF) {
+                printf("Disconnected.\n");
+                break;
+            }
+            printf(ch == '1' ? "Discard OK.\n" : "Discard failed.\n");
         } else if (line[0] == 'W') {
-            int c, s, l;
-            if (sscanf(line, "W %d %d %d", &c, &s, &l) != 3) {
+            long long c, s;
+            int l;
+            if (sscanf(line, "W %lld %lld %d", &c, &s, &l) != 3) {
                 printf("Usage: W c s l\n");
                 continue;
             }
-            if (l < 0 || l > BLOCK_SIZE) {
-                printf("l must be between 0 and %d\n", BLOCK_SIZE);
+            if (l < 0 || l > block_size) {
+                printf("l must be between 0 and %d\n", block_size);
                 continue;
             }
 
@@ -125,8 +209,7 @@ int main(int argc, char *argv[]) {
             fflush(server);
 
             // Ask user for data
-            unsigned char buf[BLOCK_SIZE];
-            memset(buf, 0, sizeof(buf));
+            memset(buf, 0, block_size);
 
             printf("Enter %d bytes of data (end with newline, extra ignored):\n", l);
             fflush(stdout);
@@ -157,10 +240,11 @@ int main(int argc, char *argv[]) {
                 printf("Write failed.\n");
             }
         } else {
-            printf("Unknown command. Use I, R, or W.\n");
+            printf("Unknown command. Use I, R, RN, W, or D.\n");
         }
     }
 
+    free(buf);
     fclose(server);
     return 0;
 }
@@ -0,0 +1,1821 @@
+// disk_proxy.c
+// Striping / mirroring / parity proxy in front of several disk servers (Part 3)
+//
+// Presents one logical disk over the same protocol as
+// Basic_disk_storage_system and spreads it over N backend disk servers:
+//
+//   raid0   blocks are striped across all backends, in units of -k blocks
+//   raid1   every backend holds a full copy
+//   raid10  backends form mirror sets of -c copies (default 2), and the
+//           stripe units are spread across the sets
+//   raid5   stripe units are spread over N-1 backends per row, plus an
+//           XOR parity unit P
+//   raid6   as raid5 with N-2 data units per row and a second,
+//           Reed-Solomon syndrome Q; any two backends may be lost
+//
+// Mirrored layouts: logical block L lies in stripe unit L / k; unit u goes
+// to mirror set u % width, as that set's unit u / width. The logical disk
+// has the backends' cylinders and width times their sectors per cylinder,
+// so a range of blocks on it is one contiguous range on each set it touches.
+//
+// Parity layouts: row r is blocks [r*k, (r+1)*k) of every backend, and
+// holds d = N - parity consecutive stripe units. The parity units rotate
+// one backend per row, with the data units following them round the
+// backends. The logical disk has d times the backends' sectors per cylinder.
+//
+// Each client connection gets its own connection to every backend. All the
+// commands that arrive together are split into per-backend requests and
+// sent before any reply is awaited, so the backends seek in parallel and
+// each sees the whole queue depth. Writes go to every copy; a read goes to
+// the copy whose head was last sent nearest the target cylinder, and among
+// equally near ones to the one with the fewest requests in flight.
+//
+// On parity layouts, consecutive writes in a batch are merged, and whole
+// rows are written with freshly computed parity without reading anything.
+// What is left of a row is updated on its own, as read-modify-write of the
+// old data and parity, or, with a backend down, by reading the rest of the
+// row and rewriting it. Reads that touch a lost backend read the rows from
+// the others and rebuild the missing blocks.
+//
+// A backend that disconnects or fails a transfer is dropped for the life
+// of the proxy; there is no rebuild onto a replacement.
+//
+// Supported commands: I, R, W, RN, WN, D, F, V and S, each optionally
+// tagged "T <id> ". V reports the furthest-ahead backend clock and S the
+// proxy's own counters. Binary framing (B) is refused.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#define BACKLOG 10
+#define MAX_BACKENDS 16
+#define MAX_BATCH 64
+#define MAX_LINE 1024
+#define MAX_RANGE_BLOCKS 256       // as in the disk server
+#define MAX_RANGE_BYTES (1 << 20)
+#define IN_BUF_SIZE (MAX_RANGE_BYTES + MAX_LINE)
+// Reply bytes allowed in flight from the backends before the proxy stops
+// sending and collects them. A backend only reads more commands once its
+// replies are out, so this must fit in the socket buffers.
+#define PIPELINE_BYTES (64 * 1024)
+// Largest run of consecutive writes merged into one parity update
+#define MAX_GROUP_BYTES (4 * MAX_RANGE_BYTES)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define RAID0  0
+#define RAID1  1
+#define RAID10 2
+#define RAID5  3
+#define RAID6  4
+
+static const char *level_names[] = { "raid0", "raid1", "raid10", "raid5", "raid6" };
+
+static int level = RAID0;
+static int nbackends;
+static int copies = 1;           // backends per mirror set
+static int width;                // mirror sets (or, with parity, backends)
+static int parity;               // parity units per row: 1 for raid5, 2 for raid6
+static int data_cols;            // data units per row with parity
+static int stripe_blocks = 1;
+static struct sockaddr_in backend_addr[MAX_BACKENDS];
+static const char *backend_names[MAX_BACKENDS];
+
+// Backend geometry (all backends must agree) and the logical disk's
+static long long backend_cylinders, backend_sectors;
+static int block_size;
+static int max_range_blocks;
+static long long num_cylinders, sectors_per_cylinder;
+
+// Where each backend's head was last sent, how many requests it has in
+// flight over all connections, and whether it has been given up on.
+// Protected by backends_lock, as are the statistics.
+static pthread_mutex_t backends_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long backend_head[MAX_BACKENDS];
+static int backend_busy[MAX_BACKENDS];
+static int backend_failed[MAX_BACKENDS];
+static int failed_backends;
+static long long stat_backend_requests[MAX_BACKENDS];
+static long long stat_backend_blocks[MAX_BACKENDS];
+static long long stat_reads, stat_writes, stat_discards;
+static long long stat_mirror_choices;      // reads that had more than one copy
+static long long stat_degraded_reads;      // reads rebuilt from parity
+static long long stat_full_stripe_writes;  // whole rows written without reading
+static long long stat_rmw_writes;          // partial rows, read-modify-write
+static long long stat_rcw_writes;          // partial rows, rewritten whole
+static long long stat_grouped_writes;      // writes merged into the one before
+
+// Rows being updated. A parity update holds its rows from planning until
+// its replies are in, so no other connection reads or rewrites a row
+// whose data and parity disagree.
+typedef struct RowLock {
+    long long first, last;
+    struct RowLock *next;
+} RowLock;
+
+static pthread_mutex_t rows_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rows_released = PTHREAD_COND_INITIALIZER;
+static RowLock *locked_rows;
+
+// One request to one backend
+typedef struct {
+    int backend;
+    int op;                      // 'R', 'W', 'D', 'F' or 'V'
+    long long lba;               // first block on the backend
+    int n;
+    unsigned char *data;         // R: reply lands here; W: payload
+    int column;                  // mirror set (or backend) it is for
+    int sent;                    // 0 if the backend was already gone
+    int ok;
+    long long value;             // V: the backend's clock
+} SubReq;
+
+// One client command and its reply
+typedef struct {
+    int op;                      // as SubReq, or 'I', 'S', or 0 (answered)
+    long long lba;               // logical
+    int n;
+    char head[96];               // tag prefix, then status byte or text
+    int head_len;
+    unsigned char *buf;          // n logical blocks: W payload / R reply
+    unsigned char *scratch;      // the same blocks laid out per mirror set
+    long long set_first[MAX_BACKENDS];   // per set: first block and count
+    int set_count[MAX_BACKENDS];
+    int set_offset[MAX_BACKENDS];        // ...and where it sits in scratch
+    int first_sub, nsubs;
+    int ok;                      // 0 if a part done outside the subs failed
+    int leader;                  // merged into this earlier write, or -1
+    int degraded;                // read that must be rebuilt from parity
+    RowLock lock;
+    int locked;
+    char *text;                  // S reply, malloc'd
+    int text_len;
+} Cmd;
+
+typedef struct {
+    int fd;
+    unsigned char in[IN_BUF_SIZE];
+    size_t in_start, in_end;
+    Cmd cmds[MAX_BATCH];
+    int ncmds;
+    SubReq subs[MAX_BATCH * MAX_BACKENDS];
+    int nsubs;
+    FILE *from_backend[MAX_BACKENDS];
+    FILE *to_backend[MAX_BACKENDS];
+} Conn;
+
+static int connect_backend(int i) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&backend_addr[i], sizeof(backend_addr[i])) < 0) {
+        fprintf(stderr, "connect to backend %s: %s\n", backend_names[i], strerror(errno));
+        close(fd);
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return fd;
+}
+
+static void drop_backend(Conn *conn, int b) {
+    if (conn->to_backend[b]) fclose(conn->to_backend[b]);
+    if (conn->from_backend[b]) fclose(conn->from_backend[b]);
+    conn->to_backend[b] = conn->from_backend[b] = NULL;
+}
+
+// Backend b stopped answering: stop using it, on this connection and
+// every other, for as long as the proxy runs
+static void fail_backend(Conn *conn, int b) {
+    pthread_mutex_lock(&backends_lock);
+    if (!backend_failed[b]) {
+        backend_failed[b] = 1;
+        failed_backends++;
+        int spare = parity ? parity : copies - 1;
+        fprintf(stderr, "backend %s failed; %s\n", backend_names[b],
+                failed_backends <= spare ? "running degraded" : "some data is unavailable");
+    }
+    pthread_mutex_unlock(&backends_lock);
+    drop_backend(conn, b);
+}
+
+static int is_failed(int b) {
+    pthread_mutex_lock(&backends_lock);
+    int failed = backend_failed[b];
+    pthread_mutex_unlock(&backends_lock);
+    return failed;
+}
+
+static int any_failed(void) {
+    pthread_mutex_lock(&backends_lock);
+    int n = failed_backends;
+    pthread_mutex_unlock(&backends_lock);
+    return n > 0;
+}
+
+// Row locks
+
+static int rows_taken(long long first, long long last) {
+    for (RowLock *l = locked_rows; l; l = l->next) {
+        if (l->first <= last && first <= l->last)
+            return 1;
+    }
+    return 0;
+}
+
+static int try_lock_rows(RowLock *lock, long long first, long long last) {
+    pthread_mutex_lock(&rows_lock);
+    int taken = rows_taken(first, last);
+    if (!taken) {
+        lock->first = first;
+        lock->last = last;
+        lock->next = locked_rows;
+        locked_rows = lock;
+    }
+    pthread_mutex_unlock(&rows_lock);
+    return !taken;
+}
+
+// Only called by a connection with nothing in flight, and so holding no
+// rows itself
+static void lock_rows(RowLock *lock, long long first, long long last) {
+    pthread_mutex_lock(&rows_lock);
+    while (rows_taken(first, last))
+        pthread_cond_wait(&rows_released, &rows_lock);
+    lock->first = first;
+    lock->last = last;
+    lock->next = locked_rows;
+    locked_rows = lock;
+    pthread_mutex_unlock(&rows_lock);
+}
+
+static void unlock_rows(RowLock *lock) {
+    pthread_mutex_lock(&rows_lock);
+    for (RowLock **p = &locked_rows; *p; p = &(*p)->next) {
+        if (*p == lock) {
+            *p = lock->next;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&rows_released);
+    pthread_mutex_unlock(&rows_lock);
+}
+
+// Parity arithmetic
+//
+// P is the XOR of a row's data units. Q is the Reed-Solomon syndrome
+// sum(g^d * D_d) over GF(2^8) with polynomial 0x11d and generator g = 2,
+// as in Linux's raid6. The block kernels are picked at startup from what
+// the CPU supports.
+
+static unsigned char gf_exp[512], gf_log[256];
+
+static void gf_init(void) {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = (unsigned char)x;
+        gf_log[x] = (unsigned char)i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x11d;
+    }
+    for (int i = 255; i < 512; i++)
+        gf_exp[i] = gf_exp[i - 255];
+}
+
+static unsigned char gf_mul(unsigned char a, unsigned char b) {
+    return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static unsigned char gf_inv(unsigned char a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+// c times every value of the low and the high nibble, for the PSHUFB kernels
+static void gf_nibble_tables(unsigned char c, unsigned char *lo, unsigned char *hi) {
+    for (int i = 0; i < 16; i++) {
+        lo[i] = gf_mul(c, (unsigned char)i);
+        hi[i] = gf_mul(c, (unsigned char)(i << 4));
+    }
+}
+
+static void xor_scalar(unsigned char *dst, const unsigned char *src, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++)
+        dst[i] ^= src[i];
+}
+
+// dst ^= c * src
+static void gf_mul_xor_scalar(unsigned char *dst, const unsigned char *src,
+                              unsigned char c, size_t len) {
+    if (c == 0)
+        return;
+    int lc = gf_log[c];
+    for (size_t i = 0; i < len; i++) {
+        if (src[i])
+            dst[i] ^= gf_exp[lc + gf_log[src[i]]];
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void xor_sse2(unsigned char *dst, const unsigned char *src, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, b));
+    }
+    xor_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void xor_avx2(unsigned char *dst, const unsigned char *src, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, b));
+    }
+    xor_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("ssse3")))
+static void gf_mul_xor_ssse3(unsigned char *dst, const unsigned char *src,
+                             unsigned char c, size_t len) {
+    unsigned char lo[16], hi[16];
+    gf_nibble_tables(c, lo, hi);
+    __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+    __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i l = _mm_and_si128(s, mask);
+        __m128i h = _mm_and_si128(_mm_srli_epi64(s, 4), mask);
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(tlo, l), _mm_shuffle_epi8(thi, h));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, p));
+    }
+    gf_mul_xor_scalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+static void gf_mul_xor_avx2(unsigned char *dst, const unsigned char *src,
+                            unsigned char c, size_t len) {
+    unsigned char lo[16], hi[16];
+    gf_nibble_tables(c, lo, hi);
+    __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i l = _mm256_and_si256(s, mask);
+        __m256i h = _mm256_and_si256(_mm256_srli_epi64(s, 4), mask);
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, l), _mm256_shuffle_epi8(thi, h));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, p));
+    }
+    gf_mul_xor_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+static void (*xor_into)(unsigned char *, const unsigned char *, size_t) = xor_scalar;
+static void (*gf_mul_xor)(unsigned char *, const unsigned char *, unsigned char, size_t) =
+    gf_mul_xor_scalar;
+static const char *parity_kernel = "scalar";
+
+static void select_kernels(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        xor_into = xor_avx2;
+        gf_mul_xor = gf_mul_xor_avx2;
+        parity_kernel = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        xor_into = xor_sse2;
+        gf_mul_xor = gf_mul_xor_ssse3;
+        parity_kernel = "ssse3";
+    } else if (__builtin_cpu_supports("sse2")) {
+        xor_into = xor_sse2;
+        parity_kernel = "sse2";
+    }
+#endif
+}
+
+// Block mapping
+
+// Backend holding role j of parity row r: 0 is P, 1 is Q (raid6) and
+// parity + d is data unit d
+static int role_backend(long long row, int j) {
+    return (int)((nbackends - 1 - row % nbackends + j) % nbackends);
+}
+
+// Which data unit of row r backend b holds (negative for a parity unit)
+static int data_index(long long row, int b) {
+    return (int)((b + 1 + row % nbackends) % nbackends) - parity;
+}
+
+// Logical block -> mirror set (or, with parity, backend) and block within it
+static void map_block(long long lba, int *set, long long *set_lba) {
+    long long unit = lba / stripe_blocks;
+    if (parity) {
+        long long row = unit / data_cols;
+        *set = role_backend(row, parity + (int)(unit % data_cols));
+        *set_lba = row * stripe_blocks + lba % stripe_blocks;
+        return;
+    }
+    *set = (int)(unit % width);
+    *set_lba = (unit / width) * stripe_blocks + lba % stripe_blocks;
+}
+
+// Fill in the contiguous range each mirror set holds of cmd's n blocks,
+// and return the blocks they add up to. Works per set rather than per
+// block, since a discard can span the disk. With parity a backend's range
+// can enclose parity units between the data, so it goes block by block;
+// whole-disk discards don't come through here then.
+static int split_range(Cmd *cmd) {
+    long long first = cmd->lba, last = cmd->lba + cmd->n - 1;
+    int offset = 0;
+    if (parity) {
+        for (int m = 0; m < width; m++)
+            cmd->set_count[m] = 0;
+        for (long long l = first; l <= last; l++) {
+            int b;
+            long long bl;
+            map_block(l, &b, &bl);
+            if (cmd->set_count[b] == 0)
+                cmd->set_first[b] = bl;
+            cmd->set_count[b] = (int)(bl - cmd->set_first[b] + 1);
+        }
+        for (int m = 0; m < width; m++) {
+            cmd->set_offset[m] = offset;
+            offset += cmd->set_count[m];
+        }
+        return offset;
+    }
+    long long u0 = first / stripe_blocks, u1 = last / stripe_blocks;
+    for (int m = 0; m < width; m++) {
+        // First and last stripe units of set m inside the range
+        long long ua = u0 + ((m - u0 % width) + width) % width;
+        long long ub = u1 - ((u1 % width - m) + width) % width;
+        cmd->set_count[m] = 0;
+        if (ua > u1 || ub < u0 || ua > ub)
+            continue;
+        long long a = ua == u0 ? first : ua * stripe_blocks;
+        long long b = ub == u1 ? last : ub * stripe_blocks + stripe_blocks - 1;
+        long long la, lb;
+        int set;
+        map_block(a, &set, &la);
+        map_block(b, &set, &lb);
+        cmd->set_first[m] = la;
+        cmd->set_count[m] = (int)(lb - la + 1);
+        cmd->set_offset[m] = offset;
+        offset += cmd->set_count[m];
+    }
+    return offset;
+}
+
+// Copy blocks between the logical order (buf) and per-set order (scratch)
+static void shuffle_blocks(Cmd *cmd, int to_scratch) {
+    for (int i = 0; i < cmd->n; i++) {
+        int set;
+        long long set_lba;
+        map_block(cmd->lba + i, &set, &set_lba);
+        size_t pos = (size_t)(cmd->set_offset[set] + (set_lba - cmd->set_first[set])) * block_size;
+        if (to_scratch)
+            memcpy(cmd->scratch + pos, cmd->buf + (size_t)i * block_size, block_size);
+        else
+            memcpy(cmd->buf + (size_t)i * block_size, cmd->scratch + pos, block_size);
+    }
+}
+
+// The live copy of set m to read from: nearest head, then least busy.
+// -1 if every copy is gone. Caller holds backends_lock.
+static int pick_copy(int m, long long cylinder) {
+    int best = -1;
+    for (int i = m * copies; i < (m + 1) * copies; i++) {
+        if (backend_failed[i])
+            continue;
+        if (best < 0) {
+            best = i;
+            continue;
+        }
+        long long d = llabs(backend_head[i] - cylinder);
+        long long bd = llabs(backend_head[best] - cylinder);
+        if (d < bd || (d == bd && backend_busy[i] < backend_busy[best]))
+            best = i;
+    }
+    return best;
+}
+
+static void init_sub(SubReq *sub, int backend, int op, long long lba, int n,
+                     unsigned char *data) {
+    memset(sub, 0, sizeof(*sub));
+    sub->backend = backend;
+    sub->op = op;
+    sub->lba = lba;
+    sub->n = n;
+    sub->data = data;
+    sub->column = backend;
+}
+
+static SubReq *add_sub(Conn *conn, Cmd *cmd, int backend, int op) {
+    SubReq *sub = &conn->subs[conn->nsubs++];
+    init_sub(sub, backend, op, 0, 0, NULL);
+    cmd->nsubs++;
+    return sub;
+}
+
+// Count a block request against its backend. Caller holds backends_lock.
+static void track_sub(const SubReq *sub) {
+    backend_head[sub->backend] = (sub->lba + sub->n - 1) / backend_sectors;
+    backend_busy[sub->backend]++;
+    stat_backend_requests[sub->backend]++;
+    stat_backend_blocks[sub->backend] += sub->n;
+}
+
+// Backend I/O
+
+static void send_sub(Conn *conn, SubReq *sub) {
+    if (conn->to_backend[sub->backend] && is_failed(sub->backend))
+        drop_backend(conn, sub->backend);
+    FILE *out = conn->to_backend[sub->backend];
+    sub->sent = out != NULL;
+    if (!out)
+        return;
+    long long c = sub->lba / backend_sectors, s = sub->lba % backend_sectors;
+    switch (sub->op) {
+    case 'R':
+    case 'W':
+        // Longer than one backend command takes: send it in pieces
+        for (int done = 0; done < sub->n; done += max_range_blocks) {
+            int n = sub->n - done < max_range_blocks ? sub->n - done : max_range_blocks;
+            c = (sub->lba + done) / backend_sectors;
+            s = (sub->lba + done) % backend_sectors;
+            if (sub->op == 'R') {
+                if (n == 1)
+                    fprintf(out, "R %lld %lld\n", c, s);
+                else
+                    fprintf(out, "RN %lld %lld %d\n", c, s, n);
+                continue;
+            }
+            if (n == 1)
+                fprintf(out, "W %lld %lld %d\n", c, s, block_size);
+            else
+                fprintf(out, "WN %lld %lld %d\n", c, s, n);
+            fwrite(sub->data + (size_t)done * block_size, 1, (size_t)n * block_size, out);
+        }
+        break;
+    case 'D':
+        fprintf(out, "D %lld %lld %d\n", c, s, sub->n);
+        break;
+    case 'F':
+        fputs("F\n", out);
+        break;
+    case 'V':
+        fputs("V\n", out);
+        break;
+    }
+}
+
+// The backend is done with sub (or will never answer it)
+static void release_sub(const SubReq *sub) {
+    if (sub->op == 'F' || sub->op == 'V')
+        return;
+    pthread_mutex_lock(&backends_lock);
+    backend_busy[sub->backend]--;
+    pthread_mutex_unlock(&backends_lock);
+}
+
+// Read one backend reply into sub->ok. A backend that has gone away is
+// failed rather than the client's connection.
+static void recv_sub(Conn *conn, SubReq *sub) {
+    FILE *in = conn->from_backend[sub->backend];
+    int ok = 1, broken = 0;
+    if (!sub->sent || !in) {
+        ok = 0;
+    } else if (sub->op == 'V') {
+        char line[64];
+        broken = fgets(line, sizeof(line), in) == NULL;
+        ok = !broken && sscanf(line, "%lld", &sub->value) == 1;
+    } else if (sub->op == 'R' || sub->op == 'W') {
+        for (int done = 0; done < sub->n && !broken; done += max_range_blocks) {
+            int n = sub->n - done < max_range_blocks ? sub->n - done : max_range_blocks;
+            int ch = fgetc(in);
+            if (ch == EOF) {
+                broken = 1;
+            } else if (ch != '1') {
+                ok = 0;
+            } else if (sub->op == 'R') {
+                size_t len = (size_t)n * block_size;
+                broken = fread(sub->data + (size_t)done * block_size, 1, len, in) != len;
+            }
+        }
+    } else {
+        int ch = fgetc(in);
+        broken = ch == EOF;
+        ok = ch == '1';
+    }
+    if (broken) {
+        fail_backend(conn, sub->backend);
+        ok = 0;
+    }
+    sub->ok = ok;
+    release_sub(sub);
+}
+
+static void flush_backends(Conn *conn) {
+    for (int i = 0; i < nbackends; i++) {
+        if (conn->to_backend[i] && fflush(conn->to_backend[i]) == EOF) {
+            fprintf(stderr, "backend %s: %s\n", backend_names[i], strerror(errno));
+            fail_backend(conn, i);
+        }
+    }
+}
+
+// Send subs and collect every reply; returns how many succeeded. Only
+// used with nothing else in flight on conn.
+static int exchange(Conn *conn, SubReq *subs, int count) {
+    for (int i = 0; i < count; i++)
+        send_sub(conn, &subs[i]);
+    flush_backends(conn);
+    int good = 0;
+    for (int i = 0; i < count; i++) {
+        recv_sub(conn, &subs[i]);
+        good += subs[i].ok;
+    }
+    return good;
+}
+
+// Parity rows
+//
+// A span is member blocks [a, a + span) of every backend, held in one
+// buffer with backend b's blocks at b * span. Within a row each role's
+// blocks are contiguous, so the kernels run over a row's worth at a time.
+
+// Each role's blocks at member offset o of the span; lost[j] tells whether
+// role j's backend is in the mask down
+static void row_blocks(unsigned char *buf, long long a, int span, long long o,
+                       unsigned down, unsigned char **blk, int *lost) {
+    long long row = o / stripe_blocks;
+    for (int j = 0; j < nbackends; j++) {
+        int b = role_backend(row, j);
+        blk[j] = buf + ((size_t)b * span + (size_t)(o - a)) * block_size;
+        lost[j] = (down >> b) & 1;
+    }
+}
+
+static void encode_row(unsigned char **blk, size_t len) {
+    memcpy(blk[0], blk[parity], len);
+    for (int d = 1; d < data_cols; d++)
+        xor_into(blk[0], blk[parity + d], len);
+    if (parity == 2) {
+        memset(blk[1], 0, len);
+        for (int d = 0; d < data_cols; d++)
+            gf_mul_xor(blk[1], blk[parity + d], gf_exp[d], len);
+    }
+}
+
+// Recompute the lost data units of a row from what survives (at most
+// parity roles are lost). Lost parity is left alone.
+static void rebuild_row(unsigned char **blk, const int *lost, size_t len, unsigned char *tmp) {
+    int x = -1, y = -1;
+    for (int d = 0; d < data_cols; d++) {
+        if (!lost[parity + d])
+            continue;
+        if (x < 0) x = d;
+        else y = d;
+    }
+    if (x < 0)
+        return;
+    unsigned char *dx = blk[parity + x];
+    if (y < 0 && !lost[0]) {
+        // One data unit gone, P intact: it is P xor the others
+        memcpy(dx, blk[0], len);
+        for (int d = 0; d < data_cols; d++) {
+            if (d != x)
+                xor_into(dx, blk[parity + d], len);
+        }
+        return;
+    }
+
+    // Q' = Q xor the surviving data's share of it
+    memcpy(tmp, blk[1], len);
+    for (int d = 0; d < data_cols; d++) {
+        if (d != x && d != y)
+            gf_mul_xor(tmp, blk[parity + d], gf_exp[d], len);
+    }
+    if (y < 0) {
+        // Data x and P gone: Q' = g^x Dx
+        memset(dx, 0, len);
+        gf_mul_xor(dx, tmp, gf_inv(gf_exp[x]), len);
+        return;
+    }
+
+    // Data x and y gone. With P' = Dx + Dy (P xor the surviving data),
+    // Dx = (Q' + g^y P') / (g^x + g^y) and Dy = P' + Dx.
+    unsigned char *dy = blk[parity + y];
+    memcpy(dy, blk[0], len);
+    for (int d = 0; d < data_cols; d++) {
+        if (d != x && d != y)
+            xor_into(dy, blk[parity + d], len);
+    }
+    gf_mul_xor(tmp, dy, gf_exp[y], len);
+    memset(dx, 0, len);
+    gf_mul_xor(dx, tmp, gf_inv(gf_exp[x] ^ gf_exp[y]), len);
+    xor_into(dy, dx, len);
+}
+
+static void encode_span(unsigned char *buf, long long a, int span) {
+    unsigned char *blk[MAX_BACKENDS];
+    int lost[MAX_BACKENDS];
+    for (long long o = a; o < a + span; ) {
+        long long stop = (o / stripe_blocks + 1) * stripe_blocks;
+        if (stop > a + span)
+            stop = a + span;
+        row_blocks(buf, a, span, o, 0, blk, lost);
+        encode_row(blk, (size_t)(stop - o) * block_size);
+        o = stop;
+    }
+}
+
+// Returns 0 if more backends are down than the parity covers
+static int rebuild_span(unsigned char *buf, long long a, int span, unsigned down) {
+    if (down == 0)
+        return 1;
+    if (__builtin_popcount(down) > parity)
+        return 0;
+    unsigned char *tmp = malloc((size_t)stripe_blocks * block_size);
+    if (!tmp)
+        return 0;
+    unsigned char *blk[MAX_BACKENDS];
+    int lost[MAX_BACKENDS];
+    for (long long o = a; o < a + span; ) {
+        long long stop = (o / stripe_blocks + 1) * stripe_blocks;
+        if (stop > a + span)
+            stop = a + span;
+        row_blocks(buf, a, span, o, down, blk, lost);
+        rebuild_row(blk, lost, (size_t)(stop - o) * block_size, tmp);
+        o = stop;
+    }
+    free(tmp);
+    return 1;
+}
+
+// Read the span from every live backend; returns the mask of backends
+// that couldn't be read
+static unsigned read_span(Conn *conn, long long a, int span, unsigned char *buf) {
+    SubReq subs[MAX_BACKENDS];
+    int count = 0;
+    unsigned down = 0;
+    pthread_mutex_lock(&backends_lock);
+    for (int b = 0; b < nbackends; b++) {
+        if (backend_failed[b]) {
+            down |= 1u << b;
+            continue;
+        }
+        init_sub(&subs[count], b, 'R', a, span, buf + (size_t)b * span * block_size);
+        track_sub(&subs[count++]);
+    }
+    pthread_mutex_unlock(&backends_lock);
+    exchange(conn, subs, count);
+    for (int i = 0; i < count; i++) {
+        if (!subs[i].ok)
+            down |= 1u << subs[i].backend;
+    }
+    return down;
+}
+
+// Write the span to every live backend; 0 if too few took it
+static int write_span(Conn *conn, long long a, int span, unsigned char *buf) {
+    SubReq subs[MAX_BACKENDS];
+    int count = 0;
+    pthread_mutex_lock(&backends_lock);
+    for (int b = 0; b < nbackends; b++) {
+        if (backend_failed[b])
+            continue;
+        init_sub(&subs[count], b, 'W', a, span, buf + (size_t)b * span * block_size);
+        track_sub(&subs[count++]);
+    }
+    pthread_mutex_unlock(&backends_lock);
+    return exchange(conn, subs, count) >= nbackends - parity;
+}
+
+// Member blocks spanned by the ranges split_range found
+static void cmd_span(const Cmd *cmd, long long *a, int *span) {
+    long long lo = -1, hi = -1;
+    for (int b = 0; b < nbackends; b++) {
+        if (cmd->set_count[b] == 0)
+            continue;
+        long long end = cmd->set_first[b] + cmd->set_count[b];
+        if (lo < 0 || cmd->set_first[b] < lo) lo = cmd->set_first[b];
+        if (end > hi) hi = end;
+    }
+    *a = lo;
+    *span = (int)(hi - lo);
+}
+
+// Rebuild-write of part of a row: read the rest of it from every live
+// backend, rebuild what is lost, lay the new data over it and write it all
+// back with fresh parity
+static int reconstruct_write(Conn *conn, Cmd *piece) {
+    long long a;
+    int span;
+    cmd_span(piece, &a, &span);
+    unsigned char *buf = malloc((size_t)nbackends * span * block_size);
+    if (!buf)
+        return 0;
+    unsigned down = read_span(conn, a, span, buf);
+    int ok = rebuild_span(buf, a, span, down);
+    if (ok) {
+        for (int b = 0; b < nbackends; b++) {
+            if (piece->set_count[b] == 0)
+                continue;
+            memcpy(buf + ((size_t)b * span + (piece->set_first[b] - a)) * block_size,
+                   piece->scratch + (size_t)piece->set_offset[b] * block_size,
+                   (size_t)piece->set_count[b] * block_size);
+        }
+        encode_span(buf, a, span);
+        ok = write_span(conn, a, span, buf);
+    }
+    free(buf);
+    pthread_mutex_lock(&backends_lock);
+    stat_rcw_writes++;
+    pthread_mutex_unlock(&backends_lock);
+    return ok;
+}
+
+// Read-modify-write of part of a row: read the old data and parity, fold
+// the difference into the parity and write both. Returns -1 if the old
+// blocks couldn't be read.
+static int modify_write(Conn *conn, Cmd *piece) {
+    long long a;
+    int span;
+    cmd_span(piece, &a, &span);
+    long long row = a / stripe_blocks;
+    size_t span_len = (size_t)span * block_size;
+    unsigned char *old = malloc((size_t)piece->n * block_size);
+    unsigned char *par = malloc(parity * span_len);
+    if (!old || !par) {
+        free(old);
+        free(par);
+        return -1;
+    }
+
+    SubReq subs[MAX_BACKENDS];
+    int count = 0;
+    pthread_mutex_lock(&backends_lock);
+    for (int b = 0; b < nbackends; b++) {
+        if (piece->set_count[b] == 0)
+            continue;
+        init_sub(&subs[count], b, 'R', piece->set_first[b], piece->set_count[b],
+                 old + (size_t)piece->set_offset[b] * block_size);
+        track_sub(&subs[count++]);
+    }
+    for (int j = 0; j < parity; j++) {
+        init_sub(&subs[count], role_backend(row, j), 'R', a, span, par + j * span_len);
+        track_sub(&subs[count++]);
+    }
+    pthread_mutex_unlock(&backends_lock);
+    if (exchange(conn, subs, count) < count) {
+        free(old);
+        free(par);
+        return -1;
+    }
+
+    for (int b = 0; b < nbackends; b++) {
+        if (piece->set_count[b] == 0)
+            continue;
+        unsigned char *delta = old + (size_t)piece->set_offset[b] * block_size;
+        size_t len = (size_t)piece->set_count[b] * block_size;
+        size_t pos = (size_t)(piece->set_first[b] - a) * block_size;
+        xor_into(delta, piece->scratch + (size_t)piece->set_offset[b] * block_size, len);
+        xor_into(par + pos, delta, len);
+        if (parity == 2)
+            gf_mul_xor(par + span_len + pos, delta, gf_exp[data_index(row, b)], len);
+    }
+
+    count = 0;
+    pthread_mutex_lock(&backends_lock);
+    for (int b = 0; b < nbackends; b++) {
+        if (piece->set_count[b] == 0)
+            continue;
+        init_sub(&subs[count], b, 'W', piece->set_first[b], piece->set_count[b],
+                 piece->scratch + (size_t)piece->set_offset[b] * block_size);
+        track_sub(&subs[count++]);
+    }
+    for (int j = 0; j < parity; j++) {
+        init_sub(&subs[count], role_backend(row, j), 'W', a, span, par + j * span_len);
+        track_sub(&subs[count++]);
+    }
+    stat_rmw_writes++;
+    pthread_mutex_unlock(&backends_lock);
+    int good = exchange(conn, subs, count);
+    free(old);
+    free(par);
+    return good >= count - parity;
+}
+
+// Write n blocks at lba, all inside one row, or zero them if data is NULL.
+// Runs with nothing else in flight on conn.
+static int update_partial_row(Conn *conn, long long lba, int n, unsigned char *data) {
+    Cmd piece;
+    memset(&piece, 0, sizeof(piece));
+    piece.lba = lba;
+    piece.n = n;
+    piece.buf = data ? data : calloc(n, block_size);
+    piece.scratch = malloc((size_t)n * block_size);
+    int ok = 0;
+    if (piece.buf && piece.scratch) {
+        split_range(&piece);
+        shuffle_blocks(&piece, 1);
+        long long row = lba / ((long long)stripe_blocks * data_cols);
+        RowLock lock;
+        lock_rows(&lock, row, row);
+        ok = -1;
+        if (!any_failed())
+            ok = modify_write(conn, &piece);
+        if (ok < 0)
+            ok = reconstruct_write(conn, &piece);
+        unlock_rows(&lock);
+    }
+    if (!data)
+        free(piece.buf);
+    free(piece.scratch);
+    return ok;
+}
+
+// How a parity update divides into rows
+typedef struct {
+    long long head_lba;          // part of the first row
+    int head_n;
+    long long first_row, last_row;       // whole rows (none if first > last)
+    long long tail_lba;          // part of the last row
+    int tail_n;
+} RowSplit;
+
+static void split_rows(long long lba, int n, RowSplit *rs) {
+    long long per_row = (long long)stripe_blocks * data_cols;
+    long long end = lba + n;
+    long long f0 = (lba + per_row - 1) / per_row, f1 = end / per_row;
+    long long head_end = f0 * per_row < end ? f0 * per_row : end;
+    long long tail_start = f1 * per_row > head_end ? f1 * per_row : head_end;
+    rs->head_lba = lba;
+    rs->head_n = (int)(head_end - lba);
+    rs->first_row = f0;
+    rs->last_row = f1 - 1;
+    rs->tail_lba = tail_start;
+    rs->tail_n = (int)(end - tail_start);
+}
+
+// Rebuild a read that touches a lost backend from the rows around it.
+// Runs with nothing else in flight on conn.
+static void read_degraded(Conn *conn, Cmd *cmd) {
+    long long a;
+    int span;
+    cmd_span(cmd, &a, &span);
+    pthread_mutex_lock(&backends_lock);
+    stat_degraded_reads++;
+    pthread_mutex_unlock(&backends_lock);
+
+    unsigned char *buf = malloc((size_t)nbackends * span * block_size);
+    cmd->ok = 0;
+    if (!buf)
+        return;
+    RowLock lock;
+    lock_rows(&lock, a / stripe_blocks, (a + span - 1) / stripe_blocks);
+    unsigned down = read_span(conn, a, span, buf);
+    cmd->ok = rebuild_span(buf, a, span, down);
+    unlock_rows(&lock);
+    for (int i = 0; cmd->ok && i < cmd->n; i++) {
+        int b;
+        long long bl;
+        map_block(cmd->lba + i, &b, &bl);
+        memcpy(cmd->buf + (size_t)i * block_size,
+               buf + ((size_t)b * span + (bl - a)) * block_size, block_size);
+    }
+    free(buf);
+}
+
+// Whether cmd has to run with nothing else in flight: parity updates of
+// part of a row, degraded reads, and whole-row updates whose rows another
+// command holds. A whole-row update that can have its rows keeps them.
+static int must_run_alone(Cmd *cmd) {
+    if (cmd->op == 'R') {
+        split_range(cmd);
+        for (int b = 0; b < nbackends; b++) {
+            if (cmd->set_count[b] > 0 && is_failed(b))
+                cmd->degraded = 1;
+        }
+        return cmd->degraded;
+    }
+    if (cmd->op != 'W' && cmd->op != 'D')
+        return 0;
+    RowSplit rs;
+    split_rows(cmd->lba, cmd->n, &rs);
+    if (rs.head_n > 0 || rs.tail_n > 0)
+        return 1;
+    cmd->locked = try_lock_rows(&cmd->lock, rs.first_row, rs.last_row);
+    return !cmd->locked;
+}
+
+// Parity write or discard: partial rows now, whole rows as subs
+static void plan_parity_update(Conn *conn, Cmd *cmd) {
+    RowSplit rs;
+    split_rows(cmd->lba, cmd->n, &rs);
+    pthread_mutex_lock(&backends_lock);
+    if (cmd->op == 'W') stat_writes++;
+    else stat_discards++;
+    pthread_mutex_unlock(&backends_lock);
+
+    unsigned char *data = NULL;
+    if (rs.head_n > 0 && !update_partial_row(conn, rs.head_lba, rs.head_n, cmd->buf))
+        cmd->ok = 0;
+    if (rs.tail_n > 0 &&
+        !update_partial_row(conn, rs.tail_lba, rs.tail_n,
+                            cmd->buf ? cmd->buf + (size_t)(rs.tail_lba - cmd->lba) * block_size : NULL))
+        cmd->ok = 0;
+    if (rs.first_row > rs.last_row)
+        return;
+
+    if (!cmd->locked) {
+        lock_rows(&cmd->lock, rs.first_row, rs.last_row);
+        cmd->locked = 1;
+    }
+    long long a = rs.first_row * stripe_blocks;
+    int span = (int)((rs.last_row - rs.first_row + 1) * stripe_blocks);
+    if (cmd->op == 'W') {
+        // Lay the rows out per backend and compute their parity
+        free(cmd->scratch);
+        cmd->scratch = data = malloc((size_t)nbackends * span * block_size);
+        if (!data) {
+            cmd->ok = 0;
+            return;
+        }
+        long long first = rs.first_row * stripe_blocks * data_cols;
+        long long end = first + (long long)span * data_cols;
+        for (long long l = first; l < end; l++) {
+            int b;
+            long long bl;
+            map_block(l, &b, &bl);
+            memcpy(data + ((size_t)b * span + (bl - a)) * block_size,
+                   cmd->buf + (size_t)(l - cmd->lba) * block_size, block_size);
+        }
+        encode_span(data, a, span);
+    }
+
+    pthread_mutex_lock(&backends_lock);
+    for (int b = 0; b < nbackends; b++) {
+        if (backend_failed[b])
+            continue;
+        SubReq *sub = add_sub(conn, cmd, b, cmd->op);
+        sub->lba = a;
+        sub->n = span;
+        sub->data = data ? data + (size_t)b * span * block_size : NULL;
+        track_sub(sub);
+    }
+    if (cmd->op == 'W')
+        stat_full_stripe_writes++;
+    pthread_mutex_unlock(&backends_lock);
+}
+
+// Split cmd into backend requests, appended to conn->subs.
+static void plan_command(Conn *conn, Cmd *cmd) {
+    cmd->first_sub = conn->nsubs;
+    cmd->nsubs = 0;
+    if (cmd->op == 'F' || cmd->op == 'V') {
+        for (int i = 0; i < nbackends; i++)
+            add_sub(conn, cmd, i, cmd->op)->column = i / copies;
+        return;
+    }
+    if (parity && cmd->op != 'R') {
+        plan_parity_update(conn, cmd);
+        return;
+    }
+    if (cmd->degraded) {
+        pthread_mutex_lock(&backends_lock);
+        stat_reads++;
+        pthread_mutex_unlock(&backends_lock);
+        read_degraded(conn, cmd);
+        return;
+    }
+
+    int total = split_range(cmd);
+    if (parity) {
+        // Room for the parity units between the data too
+        free(cmd->scratch);
+        cmd->scratch = malloc((size_t)total * block_size);
+        if (!cmd->scratch) {
+            cmd->ok = 0;
+            return;
+        }
+    }
+    if (cmd->op == 'W')
+        shuffle_blocks(cmd, 1);
+
+    pthread_mutex_lock(&backends_lock);
+    for (int m = 0; m < width; m++) {
+        if (cmd->set_count[m] == 0)
+            continue;
+        long long cylinder = cmd->set_first[m] / backend_sectors;
+        unsigned char *data = cmd->scratch ? cmd->scratch + (size_t)cmd->set_offset[m] * block_size : NULL;
+        int from = m * copies, to = (m + 1) * copies;
+        if (cmd->op == 'R') {
+            from = pick_copy(m, cylinder);
+            if (from < 0)
+                continue;
+            to = from + 1;
+            if (copies > 1)
+                stat_mirror_choices++;
+        }
+        for (int i = from; i < to; i++) {
+            if (backend_failed[i])
+                continue;
+            SubReq *sub = add_sub(conn, cmd, i, cmd->op);
+            sub->lba = cmd->set_first[m];
+            sub->n = cmd->set_count[m];
+            sub->data = data;
+            sub->column = m;
+            track_sub(sub);
+        }
+    }
+    if (cmd->op == 'R') stat_reads++;
+    else if (cmd->op == 'W') stat_writes++;
+    else stat_discards++;
+    pthread_mutex_unlock(&backends_lock);
+}
+
+// Whether cmd's backend requests add up to success. Reads need every
+// piece; updates need a live copy of every set, or with parity no more
+// backends missed than the parity covers.
+static int cmd_succeeded(Conn *conn, const Cmd *cmd) {
+    unsigned covered = 0;
+    int good = 0;
+    for (int k = 0; k < cmd->nsubs; k++) {
+        const SubReq *sub = &conn->subs[cmd->first_sub + k];
+        if (sub->ok) {
+            good++;
+            covered |= 1u << sub->column;
+        }
+    }
+    if (!cmd->ok)
+        return 0;
+    if (cmd->op == 'V')
+        return good > 0;
+    if (parity && cmd->nsubs == 0)
+        return 1;                // done outside the pipeline
+    if (parity && cmd->op != 'R')
+        return good >= nbackends - parity;
+    unsigned need = 0;
+    for (int m = 0; m < width; m++) {
+        if (cmd->op == 'F' || cmd->set_count[m] > 0)
+            need |= 1u << m;
+    }
+    return (covered & need) == need;
+}
+
+// "S": the proxy's counters, in the disk server's "key value" format
+static char *format_stats(int *out_len) {
+    size_t cap = 1024 + (size_t)nbackends * 128;
+    char *out = malloc(cap);
+    if (!out) return NULL;
+    pthread_mutex_lock(&backends_lock);
+    int n = snprintf(out, cap,
+                     "level %s\n"
+                     "backends %d\n"
+                     "copies %d\n"
+                     "parity %d\n"
+                     "stripe_blocks %d\n"
+                     "parity_kernel %s\n"
+                     "failed_backends %d\n"
+                     "reads %lld\n"
+                     "writes %lld\n"
+                     "discards %lld\n"
+                     "mirror_choices %lld\n"
+                     "degraded_reads %lld\n"
+                     "full_stripe_writes %lld\n"
+                     "rmw_writes %lld\n"
+                     "rcw_writes %lld\n"
+                     "grouped_writes %lld\n",
+                     level_names[level], nbackends, copies, parity, stripe_blocks,
+                     parity_kernel, failed_backends,
+                     stat_reads, stat_writes, stat_discards, stat_mirror_choices,
+                     stat_degraded_reads, stat_full_stripe_writes, stat_rmw_writes,
+                     stat_rcw_writes, stat_grouped_writes);
+    for (int i = 0; i < nbackends; i++)
+        n += snprintf(out + n, cap - n, "backend%d_requests %lld\nbackend%d_blocks %lld\n",
+                      i, stat_backend_requests[i], i, stat_backend_blocks[i]);
+    pthread_mutex_unlock(&backends_lock);
+    n += snprintf(out + n, cap - n, "END\n");
+    *out_len = n;
+    return out;
+}
+
+// Client side
+
+static int valid_range(long long c, long long s, int n, int limit) {
+    if (c < 0 || c >= num_cylinders || s < 0 || s >= sectors_per_cylinder)
+        return 0;
+    if (n < 1 || (limit && n > max_range_blocks))
+        return 0;
+    return c * sectors_per_cylinder + s + n - 1 < num_cylinders * sectors_per_cylinder;
+}
+
+static Cmd *next_cmd(Conn *conn) {
+    Cmd *cmd = &conn->cmds[conn->ncmds];
+    cmd->op = 0;
+    cmd->n = 0;
+    cmd->head_len = 0;
+    cmd->buf = NULL;
+    cmd->scratch = NULL;
+    cmd->nsubs = 0;
+    cmd->ok = 1;
+    cmd->leader = -1;
+    cmd->degraded = 0;
+    cmd->locked = 0;
+    cmd->text = NULL;
+    cmd->text_len = 0;
+    return cmd;
+}
+
+// Allocate the buffers for an n-block transfer at (c,s). With parity the
+// layout buffer is sized when the command is planned.
+static int prepare_cmd(Cmd *cmd, int op, long long c, long long s, int n) {
+    if (!valid_range(c, s, n, op != 'D'))
+        return 0;
+    if (op != 'D') {
+        cmd->buf = calloc(n, block_size);
+        cmd->scratch = parity ? NULL : malloc((size_t)n * block_size);
+        if (!cmd->buf || (!parity && !cmd->scratch)) {
+            free(cmd->buf);
+            free(cmd->scratch);
+            cmd->buf = cmd->scratch = NULL;
+            return 0;
+        }
+    }
+    cmd->op = op;
+    cmd->lba = c * sectors_per_cylinder + s;
+    cmd->n = n;
+    return 1;
+}
+
+// Parse one command from the input buffer, as the disk server does.
+// Returns 0 if it isn't complete yet.
+static int parse_command(Conn *conn) {
+    unsigned char *start = conn->in + conn->in_start;
+    size_t avail = conn->in_end - conn->in_start;
+    unsigned char *nl = memchr(start, '\n', avail);
+    if (!nl) {
+        if (conn->in_start == 0 && conn->in_end == IN_BUF_SIZE)
+            conn->in_start = conn->in_end;
+        return 0;
+    }
+    size_t line_len = (size_t)(nl - start) + 1;
+
+    char line[MAX_LINE];
+    size_t copy = line_len < MAX_LINE ? line_len : MAX_LINE - 1;
+    memcpy(line, start, copy);
+    line[copy] = '\0';
+
+    Cmd *cmd = next_cmd(conn);
+    char *p = line;
+    unsigned int tag;
+    int off = 0;
+    if (line[0] == 'T' && sscanf(line, "T %u %n", &tag, &off) == 1 && off > 0) {
+        p = line + off;
+        cmd->head_len = snprintf(cmd->head, sizeof(cmd->head), "%u ", tag);
+    }
+
+    size_t consumed = line_len;
+    long long c, s;
+    int n, l;
+    int ok = 1;
+    if (p[0] == 'I') {
+        cmd->op = 'I';
+    } else if (p[0] == 'R' && p[1] == 'N') {
+        ok = sscanf(p, "RN %lld %lld %d", &c, &s, &n) == 3 && prepare_cmd(cmd, 'R', c, s, n);
+    } else if (p[0] == 'W' && p[1] == 'N') {
+        if (sscanf(p, "WN %lld %lld %d", &c, &s, &n) != 3 || n < 1 || n > max_range_blocks) {
+            ok = 0;
+        } else {
+            size_t len = (size_t)n * block_size;
+            if (avail - line_len < len)
+                return 0;
+            consumed += len;
+            ok = prepare_cmd(cmd, 'W', c, s, n);
+            if (ok)
+                memcpy(cmd->buf, start + line_len, len);
+        }
+    } else if (p[0] == 'R') {
+        ok = sscanf(p, "R %lld %lld", &c, &s) == 2 && prepare_cmd(cmd, 'R', c, s, 1);
+    } else if (p[0] == 'W') {
+        if (sscanf(p, "W %lld %lld %d", &c, &s, &l) != 3 || l < 0 || l > block_size) {
+            ok = 0;
+        } else {
+            if (avail - line_len < (size_t)l)
+                return 0;
+            consumed += l;
+            ok = prepare_cmd(cmd, 'W', c, s, 1);
+            if (ok)
+                memcpy(cmd->buf, start + line_len, l);
+        }
+    } else if (p[0] == 'D') {
+        ok = sscanf(p, "D %lld %lld %d", &c, &s, &n) == 3 && prepare_cmd(cmd, 'D', c, s, n);
+    } else if (p[0] == 'F' || p[0] == 'V' || p[0] == 'S') {
+        cmd->op = p[0];
+    } else {
+        ok = 0;                  // unknown, or B: no binary framing here
+    }
+    if (!ok) {
+        cmd->op = 0;
+        cmd->head[cmd->head_len++] = '0';
+    }
+
+    conn->in_start += consumed;
+    conn->ncmds++;
+    return 1;
+}
+
+static int writev_all(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        int chunk = cnt < IOV_MAX ? cnt : IOV_MAX;
+        ssize_t n = writev(fd, iov, chunk);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (chunk > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+            chunk--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static void release_cmds(Conn *conn, int from, int to) {
+    for (int i = from; i < to; i++) {
+        Cmd *cmd = &conn->cmds[i];
+        if (cmd->locked) {
+            unlock_rows(&cmd->lock);
+            cmd->locked = 0;
+        }
+        free(cmd->buf);
+        free(cmd->scratch);
+        free(cmd->text);
+        cmd->buf = cmd->scratch = NULL;
+        cmd->text = NULL;
+    }
+}
+
+// Merge runs of writes to consecutive blocks into the first of them, so a
+// parity layout sees whole rows where it can. The others answer with the
+// first one's result.
+static void group_writes(Conn *conn) {
+    for (int i = 0; i < conn->ncmds; i++) {
+        Cmd *lead = &conn->cmds[i];
+        if (lead->op != 'W')
+            continue;
+        int j = i + 1;
+        for (; j < conn->ncmds; j++) {
+            Cmd *next = &conn->cmds[j];
+            if (next->op != 'W' || next->lba != lead->lba + lead->n ||
+                (size_t)(lead->n + next->n) * block_size > MAX_GROUP_BYTES)
+                break;
+            unsigned char *buf = realloc(lead->buf, (size_t)(lead->n + next->n) * block_size);
+            if (!buf)
+                break;
+            lead->buf = buf;
+            memcpy(buf + (size_t)lead->n * block_size, next->buf, (size_t)next->n * block_size);
+            lead->n += next->n;
+            free(next->buf);
+            next->buf = NULL;
+            next->leader = i;
+        }
+        pthread_mutex_lock(&backends_lock);
+        stat_grouped_writes += j - i - 1;
+        pthread_mutex_unlock(&backends_lock);
+        i = j - 1;
+    }
+}
+
+// Collect the backend replies for cmds [from, to), in the order their
+// requests were sent, and answer the client in one writev.
+static int finish_cmds(Conn *conn, int from, int to) {
+    struct iovec iov[MAX_BATCH * 2];
+    int cnt = 0;
+    int rc = 0;
+    // Every reply first, so the rows can be let go and a parity read that
+    // met a failed backend can be rebuilt with nothing in flight
+    for (int i = 0; i < conn->nsubs; i++)
+        recv_sub(conn, &conn->subs[i]);
+    for (int i = from; i < to; i++) {
+        Cmd *cmd = &conn->cmds[i];
+        if (cmd->locked) {
+            unlock_rows(&cmd->lock);
+            cmd->locked = 0;
+        }
+    }
+
+    for (int i = from; i < to; i++) {
+        Cmd *cmd = &conn->cmds[i];
+        long long clock = 0;
+        for (int k = 0; k < cmd->nsubs; k++) {
+            SubReq *sub = &conn->subs[cmd->first_sub + k];
+            if (sub->ok && sub->value > clock)
+                clock = sub->value;
+        }
+        int ok = cmd->leader >= 0 ? conn->cmds[cmd->leader].ok : cmd_succeeded(conn, cmd);
+        if (parity && cmd->op == 'R' && !ok && cmd->ok && !cmd->degraded) {
+            cmd->degraded = 1;
+            read_degraded(conn, cmd);
+            ok = cmd->ok;
+        }
+        cmd->ok = ok;
+
+        char *h = cmd->head + cmd->head_len;
+        size_t room = sizeof(cmd->head) - cmd->head_len;
+        switch (cmd->op) {
+        case 'I':
+            cmd->head_len += snprintf(h, room, "%lld %lld %d\n",
+                                      num_cylinders, sectors_per_cylinder, block_size);
+            break;
+        case 'V':
+            cmd->head_len += snprintf(h, room, "%lld\n", ok ? clock : -1);
+            break;
+        case 'S':
+            cmd->text = format_stats(&cmd->text_len);
+            break;
+        case 'R':
+            if (ok && !cmd->degraded)
+                shuffle_blocks(cmd, 0);
+            /* fall through */
+        case 'W':
+        case 'D':
+        case 'F':
+            cmd->head[cmd->head_len++] = ok ? '1' : '0';
+            break;
+        }
+
+        iov[cnt].iov_base = cmd->head;
+        iov[cnt].iov_len = cmd->head_len;
+        cnt++;
+        if (cmd->op == 'R' && ok) {
+            iov[cnt].iov_base = cmd->buf;
+            iov[cnt].iov_len = (size_t)cmd->n * block_size;
+            cnt++;
+        } else if (cmd->text) {
+            iov[cnt].iov_base = cmd->text;
+            iov[cnt].iov_len = cmd->text_len;
+            cnt++;
+        }
+    }
+
+    if (writev_all(conn->fd, iov, cnt) < 0) {
+        perror("writev (to client)");
+        rc = -1;
+    }
+    release_cmds(conn, from, to);
+    return rc;
+}
+
+static int run_batch(Conn *conn) {
+    int from = 0;
+    size_t inflight = 0;
+    int rc = 0;
+    conn->nsubs = 0;
+    if (parity)
+        group_writes(conn);
+    for (int i = 0; i < conn->ncmds; i++) {
+        Cmd *cmd = &conn->cmds[i];
+        if (cmd->op == 0 || cmd->op == 'I' || cmd->op == 'S' || cmd->leader >= 0)
+            continue;
+
+        // Don't let replies pile up beyond what the sockets can hold. A
+        // parity read brings the parity units between its data along.
+        size_t reply = MAX_LINE;
+        if (cmd->op == 'R')
+            reply = (size_t)cmd->n * block_size * (parity ? nbackends : 1) / (parity ? data_cols : 1);
+        int alone = parity && must_run_alone(cmd);
+        if (inflight > 0 && (alone || inflight + reply > PIPELINE_BYTES)) {
+            flush_backends(conn);
+            rc = finish_cmds(conn, from, i);
+            from = i;
+            inflight = 0;
+            conn->nsubs = 0;
+            if (rc < 0)
+                break;
+        }
+        inflight += reply;
+
+        plan_command(conn, cmd);
+        for (int k = 0; k < cmd->nsubs; k++)
+            send_sub(conn, &conn->subs[cmd->first_sub + k]);
+    }
+    if (rc == 0) {
+        flush_backends(conn);
+        rc = finish_cmds(conn, from, conn->ncmds);
+    } else {
+        release_cmds(conn, from, conn->ncmds);
+    }
+    conn->ncmds = 0;
+    return rc;
+}
+
+static void *handle_client(void *arg) {
+    int client_sock = *(int *)arg;
+    free(arg);
+
+    Conn *conn = calloc(1, sizeof(Conn));
+    if (!conn) {
+        perror("calloc");
+        close(client_sock);
+        return NULL;
+    }
+    conn->fd = client_sock;
+
+    // A backend that can't be reached counts as failed
+    for (int i = 0; i < nbackends; i++) {
+        if (is_failed(i))
+            continue;
+        int fd = connect_backend(i);
+        conn->from_backend[i] = fd >= 0 ? fdopen(fd, "r") : NULL;
+        conn->to_backend[i] = conn->from_backend[i] ? fdopen(dup(fd), "w") : NULL;
+        if (!conn->to_backend[i]) {
+            if (!conn->from_backend[i] && fd >= 0) close(fd);
+            fail_backend(conn, i);
+        }
+    }
+
+    while (1) {
+        while (conn->ncmds < MAX_BATCH && parse_command(conn) > 0) {}
+
+        if (conn->ncmds > 0) {
+            if (run_batch(conn) < 0)
+                break;
+            continue;
+        }
+
+        if (conn->in_start > 0) {
+            memmove(conn->in, conn->in + conn->in_start, conn->in_end - conn->in_start);
+            conn->in_end -= conn->in_start;
+            conn->in_start = 0;
+        }
+        ssize_t n = recv(conn->fd, conn->in + conn->in_end, IN_BUF_SIZE - conn->in_end, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        conn->in_end += n;
+    }
+
+    for (int i = 0; i < nbackends; i++)
+        drop_backend(conn, i);
+    close(conn->fd);
+    free(conn);
+    return NULL;
+}
+
+// Ask backend i for its geometry. Returns 0 on failure.
+static int query_geometry(int i, long long *cyl, long long *sec, int *bs) {
+    int fd = connect_backend(i);
+    if (fd < 0)
+        return 0;
+    char line[128];
+    ssize_t n = 0;
+    *bs = 128;                   // servers that don't report it use 128
+    if (write(fd, "I\n", 2) == 2) {
+        size_t got = 0;
+        while (got < sizeof(line) - 1 && (n = recv(fd, line + got, sizeof(line) - 1 - got, 0)) > 0) {
+            got += n;
+            if (memchr(line, '\n', got))
+                break;
+        }
+        line[got] = '\0';
+    } else {
+        line[0] = '\0';
+    }
+    close(fd);
+    return sscanf(line, "%lld %lld %d", cyl, sec, bs) >= 2 && *cyl > 0 && *sec > 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-r raid0|raid1|raid10|raid5|raid6] [-k stripe_blocks] [-c copies] "
+            "<port> <host:port>...\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "r:k:c:")) != -1) {
+        switch (opt) {
+        case 'r':
+            level = -1;
+            for (int i = 0; i < 5; i++) {
+                if (strcmp(optarg, level_names[i]) == 0)
+                    level = i;
+            }
+            if (level < 0) {
+                fprintf(stderr, "Unknown RAID level: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            stripe_blocks = atoi(optarg);
+            if (stripe_blocks < 1) {
+                fprintf(stderr, "Invalid stripe size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            copies = atoi(optarg);
+            if (copies < 2) {
+                fprintf(stderr, "A mirror set needs at least 2 copies\n");
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    int port = atoi(argv[optind]);
+    nbackends = argc - optind - 1;
+    if (nbackends > MAX_BACKENDS) {
+        fprintf(stderr, "At most %d backends\n", MAX_BACKENDS);
+        return 1;
+    }
+
+    if (level == RAID5 || level == RAID6) {
+        parity = level == RAID5 ? 1 : 2;
+        copies = 1;
+        if (nbackends < parity + 2) {
+            fprintf(stderr, "%s needs at least %d backends\n", level_names[level], parity + 2);
+            return 1;
+        }
+        data_cols = nbackends - parity;
+    } else if (level == RAID0) {
+        copies = 1;
+    } else if (level == RAID1) {
+        copies = nbackends;
+    } else if (copies == 1) {
+        copies = 2;
+    }
+    if (nbackends % copies != 0 || (level != RAID0 && nbackends < 2)) {
+        fprintf(stderr, "%s needs a multiple of %d backends\n", level_names[level], copies);
+        return 1;
+    }
+    width = nbackends / copies;
+
+    for (int i = 0; i < nbackends; i++) {
+        char *spec = argv[optind + 1 + i];
+        char *colon = strrchr(spec, ':');
+        backend_names[i] = spec;
+        memset(&backend_addr[i], 0, sizeof(backend_addr[i]));
+        backend_addr[i].sin_family = AF_INET;
+        if (!colon) {
+            fprintf(stderr, "Backend must be host:port: %s\n", spec);
+            return 1;
+        }
+        *colon = '\0';
+        backend_addr[i].sin_port = htons(atoi(colon + 1));
+        int ok = inet_pton(AF_INET, spec, &backend_addr[i].sin_addr) == 1;
+        *colon = ':';
+        if (!ok) {
+            fprintf(stderr, "Bad backend address: %s\n", spec);
+            return 1;
+        }
+
+        long long cyl, sec;
+        int bs;
+        if (!query_geometry(i, &cyl, &sec, &bs)) {
+            fprintf(stderr, "Cannot get geometry from backend %s\n", spec);
+            return 1;
+        }
+        if (i == 0) {
+            backend_cylinders = cyl;
+            backend_sectors = sec;
+            block_size = bs;
+        } else if (cyl != backend_cylinders || sec != backend_sectors || bs != block_size) {
+            fprintf(stderr, "Backend %s has a different geometry\n", spec);
+            return 1;
+        }
+    }
+    if ((backend_cylinders * backend_sectors) % stripe_blocks != 0) {
+        fprintf(stderr, "Stripe size must divide the backend size (%lld blocks)\n",
+                backend_cylinders * backend_sectors);
+        return 1;
+    }
+    num_cylinders = backend_cylinders;
+    sectors_per_cylinder = backend_sectors * (parity ? data_cols : width);
+    max_range_blocks = MAX_RANGE_BYTES / block_size < MAX_RANGE_BLOCKS ?
+                       MAX_RANGE_BYTES / block_size : MAX_RANGE_BLOCKS;
+    gf_init();
+    select_kernels();
+
+    // A backend vanishing mid-write is handled where the write fails
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    int optval = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(listen_fd);
+        return 1;
+    }
+    if (listen(listen_fd, BACKLOG) < 0) {
+        perror("listen");
+        close(listen_fd);
+        return 1;
+    }
+
+    printf("Disk proxy listening on port %d\n", port);
+    if (parity)
+        printf("Layout: %s over %d backends (%d data + %d parity units per row, "
+               "%d-block units, %s kernels)\n",
+               level_names[level], nbackends, data_cols, parity, stripe_blocks, parity_kernel);
+    else
+        printf("Layout: %s over %d backends (%d-way stripe, %d copies, %d-block units)\n",
+               level_names[level], nbackends, width, copies, stripe_blocks);
+    printf("Geometry: %lld cylinders, %lld sectors/cylinder, block size %d\n",
+           num_cylinders, sectors_per_cylinder, block_size);
+
+    while (1) {
+        int *client_sock = malloc(sizeof(int));
+        if (!client_sock) {
+            perror("malloc");
+            break;
+        }
+        *client_sock = accept(listen_fd, NULL, NULL);
+        if (*client_sock < 0) {
+            perror("accept");
+            free(client_sock);
+            continue;
+        }
+        int nodelay = 1;
+        setsockopt(*client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        pthread_t t;
+        if (pthread_create(&t, NULL, handle_client, client_sock) != 0) {
+            perror("pthread_create");
+            close(*client_sock);
+            free(client_sock);
+            continue;
+        }
+        pthread_detach(t);
+    }
+
+    close(listen_fd);
+    return 0;
+}
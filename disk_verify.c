@@ -0,0 +1,219 @@
+// disk_verify.c
+// Consistency check for the disk server (or the proxy)
+//
+// Sends <N> random R, W, RN and WN commands in tagged batches of up to
+// --depth to a freshly created disk, which reads as zeros, and checks every
+// read against a model of what the disk must hold. Commands on one connection take effect
+// in the order they were sent, so a read must see every earlier write in
+// its batch even though the server runs the batch concurrently. Keep the
+// disk small and the cache smaller than it (e.g. -c 8 on an 8x16 disk) so
+// reads, writes, evictions and write-backs keep landing on the same blocks.
+//
+// Exits 0 if every reply matched, 1 otherwise; "make check" runs it against
+// the server in several configurations.
+//
+// Usage: ./disk_verify [--depth D] <server_ip> <port> <N> <seed>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_BLOCK_SIZE 128
+#define MAX_DEPTH     64
+#define MAX_RANGE      8        // blocks per RN/WN
+#define MAX_LINE      64
+
+typedef struct {
+    int is_write;
+    long long lba;
+    int n;
+    unsigned char *expect;   // reads: the model's blocks when it was sent
+} Cmd;
+
+static long long num_cyl, sectors_per_cyl, total_blocks;
+static int block_size = DEFAULT_BLOCK_SIZE;
+static unsigned char *model;    // total_blocks * block_size
+static unsigned long long rng_state;
+
+static unsigned long long next_rand(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+// "<tag> " then the status byte; -1 if the reply isn't for tag
+static int read_status(FILE *in, unsigned int tag) {
+    unsigned int got;
+    if (fscanf(in, "%u", &got) != 1 || got != tag || fgetc(in) != ' ')
+        return -1;
+    return fgetc(in);
+}
+
+int main(int argc, char *argv[]) {
+    int depth = 16;
+    int argi = 1;
+    while (argi < argc && strncmp(argv[argi], "--", 2) == 0) {
+        if (strcmp(argv[argi], "--depth") == 0 && argi + 1 < argc) {
+            depth = atoi(argv[argi + 1]);
+            argi += 2;
+        } else {
+            argi = argc;   // unknown option: print usage
+        }
+    }
+    if (argc - argi != 4 || depth < 1 || depth > MAX_DEPTH) {
+        fprintf(stderr, "Usage: %s [--depth D (1-%d)] <server_ip> <port> <N> <seed>\n",
+                argv[0], MAX_DEPTH);
+        return 1;
+    }
+    const char *server_ip = argv[argi];
+    int port = atoi(argv[argi + 1]);
+    long long nops = atoll(argv[argi + 2]);
+    rng_state = (unsigned long long)atoll(argv[argi + 3]) * 0x9E3779B97F4A7C15ULL + 1;
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return 1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_ip, &addr.sin_addr) <= 0) {
+        perror("inet_pton");
+        return 1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        return 1;
+    }
+    FILE *in = fdopen(sock, "r");
+    FILE *out = in ? fdopen(dup(sock), "w") : NULL;
+    if (!in || !out) {
+        perror("fdopen");
+        return 1;
+    }
+
+    // "<cylinders> <sectors> <block size>"; older servers omit the block size
+    char line[MAX_LINE];
+    fputs("I\n", out);
+    fflush(out);
+    if (!fgets(line, sizeof(line), in) ||
+        sscanf(line, "%lld %lld %d", &num_cyl, &sectors_per_cyl, &block_size) < 2 ||
+        num_cyl <= 0 || sectors_per_cyl <= 0 || block_size <= 0) {
+        fprintf(stderr, "Failed to read disk geometry\n");
+        return 1;
+    }
+    total_blocks = num_cyl * sectors_per_cyl;
+    if (total_blocks < MAX_RANGE) {
+        fprintf(stderr, "Disk too small\n");
+        return 1;
+    }
+
+    model = calloc(total_blocks, block_size);
+    unsigned char *data = malloc((size_t)MAX_RANGE * block_size);
+    Cmd *cmds = calloc(MAX_DEPTH, sizeof(Cmd));
+    if (!model || !data || !cmds) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < MAX_DEPTH; i++) {
+        cmds[i].expect = malloc((size_t)MAX_RANGE * block_size);
+        if (!cmds[i].expect) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+    long long done = 0, mismatches = 0, failures = 0;
+    unsigned char *got = malloc((size_t)MAX_RANGE * block_size);
+    if (!got) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    while (done < nops) {
+        int batch = 1 + (int)(next_rand() % depth);
+        if (batch > nops - done)
+            batch = (int)(nops - done);
+
+        for (int i = 0; i < batch; i++) {
+            Cmd *c = &cmds[i];
+            unsigned long long r = next_rand();
+            int ranged = (r >> 8) % 4 == 0;
+            c->is_write = (r >> 16) % 2;
+            c->n = ranged ? 1 + (int)((r >> 24) % MAX_RANGE) : 1;
+            c->lba = (long long)((r >> 32) % (unsigned long long)(total_blocks - c->n + 1));
+            long long cyl = c->lba / sectors_per_cyl, sec = c->lba % sectors_per_cyl;
+            size_t len = (size_t)c->n * block_size;
+            unsigned char *m = model + (size_t)c->lba * block_size;
+
+            if (c->is_write) {
+                for (size_t j = 0; j < len; j += 8) {
+                    unsigned long long v = next_rand();
+                    memcpy(data + j, &v, len - j < 8 ? len - j : 8);
+                }
+                memcpy(m, data, len);
+                if (ranged)
+                    fprintf(out, "T %d WN %lld %lld %d\n", i, cyl, sec, c->n);
+                else
+                    fprintf(out, "T %d W %lld %lld %d\n", i, cyl, sec, block_size);
+                fwrite(data, 1, len, out);
+            } else {
+                memcpy(c->expect, m, len);
+                if (ranged)
+                    fprintf(out, "T %d RN %lld %lld %d\n", i, cyl, sec, c->n);
+                else
+                    fprintf(out, "T %d R %lld %lld\n", i, cyl, sec);
+            }
+        }
+        fflush(out);
+
+        // Replies come back in the order the commands went out
+        for (int i = 0; i < batch; i++) {
+            Cmd *c = &cmds[i];
+            int status = read_status(in, (unsigned int)i);
+            if (status < 0 || status == EOF) {
+                fprintf(stderr, "Lost the server or a reply out of order\n");
+                return 1;
+            }
+            if (status != '1') {
+                failures++;
+                continue;
+            }
+            if (c->is_write)
+                continue;
+            size_t len = (size_t)c->n * block_size;
+            if (fread(got, 1, len, in) != len) {
+                fprintf(stderr, "Short read reply\n");
+                return 1;
+            }
+            for (int b = 0; b < c->n; b++) {
+                if (memcmp(got + (size_t)b * block_size, c->expect + (size_t)b * block_size,
+                           block_size) != 0) {
+                    if (mismatches < 10)
+                        fprintf(stderr, "block %lld: read doesn't match what was written\n",
+                                c->lba + b);
+                    mismatches++;
+                }
+            }
+        }
+        done += batch;
+    }
+
+    fputs("F\n", out);
+    fflush(out);
+    if (fgetc(in) != '1')
+        failures++;
+
+    printf("%lld commands on %lld blocks of %d bytes: %lld mismatches, %lld failed\n",
+           done, total_blocks, block_size, mismatches, failures);
+    fclose(out);
+    fclose(in);
+    return mismatches == 0 && failures == 0 ? 0 : 1;
+}
@@ -61,12 +61,13 @@ int main(int argc, char *argv[]) {
 
     printf("Connected to filesystem server %s:%d\n", server_ip, port);
     printf("Commands:\n");
-    printf("  F                   - format filesystem\n");
+    printf("  F [block_size]      - format filesystem\n");
     printf("  C name              - create file\n");
     printf("  D name              - delete file\n");
     printf("  L 0|1               - list files\n");
     printf("  R name              - read file\n");
     printf("  W name len          - write len bytes (you will be prompted for data)\n");
+    printf("  S                   - server statistics\n");
     printf("Ctrl+D to quit.\n\n");
 
     char line[1024];
@@ -81,17 +82,22 @@ int main(int argc, char *argv[]) {
         if (line[0] == '\n' || line[0] == '\0')
             continue;
 
-        if (line[0] == 'W') {
-            // Parse: W name len
+        if (line[0] == 'W' || line[0] == 'A' || line[0] == 'P') {
+            // Parse: W name len, A name len (append) or P name offset len
             char fname[64];
-            int len;
-            if (sscanf(line, "W %63s %d", fname, &len) != 2 || len < 0) {
-                printf("Usage: W name len\n");
+            int offset = 0, len;
+            int ok = line[0] == 'P' ? sscanf(line, "P %63s %d %d", fname, &offset, &len) == 3
+                                    : sscanf(line + 1, " %63s %d", fname, &len) == 2;
+            if (!ok || len < 0) {
+                printf("Usage: W name len | A name len | P name offset len\n");
                 continue;
             }
 
             // Send header line
-            fprintf(server, "W %s %d\n", fname, len);
+            if (line[0] == 'P')
+                fprintf(server, "P %s %d %d\n", fname, offset, len);
+            else
+                fprintf(server, "%c %s %d\n", line[0], fname, len);
             fflush(server);
 
             unsigned char *buf = NULL;
@@ -133,8 +139,8 @@ int main(int argc, char *argv[]) {
                 break;
             }
             printf("Result: %s", resp);
-        } else if (line[0] == 'R') {
-            // Send read command as-is
+        } else if (line[0] == 'R' || line[0] == 'G') {
+            // Send read command (R name, or G name offset len) as-is
             fputs(line, server);
             if (line[strlen(line) - 1] != '\n')
                 fputc('\n', server);
@@ -195,8 +201,8 @@ int main(int argc, char *argv[]) {
             }
             putchar('\n');
             free(buf);
-        } else if (line[0] == 'L') {
-            // Send L command
+        } else if (line[0] == 'L' || line[0] == 'S') {
+            // Send L (or S, which answers the same way)
             fputs(line, server);
             if (line[strlen(line) - 1] != '\n')
                 fputc('\n', server);
@@ -210,7 +216,7 @@ int main(int argc, char *argv[]) {
             }
             printf("Status: %s", resp);
 
-            // Then listing lines until "END\n"
+            // Then listing (or statistics) lines until "END\n"
             while (1) {
                 if (!fgets(resp, sizeof(resp), server)) {
                     printf("Server closed.\n");
@@ -220,7 +226,7 @@ int main(int argc, char *argv[]) {
                     break;
                 printf("%s", resp);
             }
-        } else if (line[0] == 'F' || line[0] == 'C' || line[0] == 'D') {
+        } else if (line[0] == 'F' || line[0] == 'C' || line[0] == 'D' || line[0] == 'T') {
             // Simple one-line commands: send, then read one-line result
             fputs(line, server);
             if (line[strlen(line) - 1] != '\n')
@@ -234,7 +240,7 @@ int main(int argc, char *argv[]) {
             }
             printf("Result: %s", resp);
         } else {
-            printf("Unknown command. Use F, C, D, L, R, or W.\n");
+            printf("Unknown command. Use F, C, D, L, R, G, W, P, A, T, or S.\n");
         }
     }
 
@@ -0,0 +1,122 @@
+// histogram.h
+// Log-linear latency histograms in the style of HdrHistogram: every power
+// of two is split into HIST_SUB_BUCKETS equal buckets, so any recorded
+// value is reported to within about 3% over the whole 64-bit range, in a
+// fixed 15 KiB. Recording is an index computation and an increment;
+// histograms from several threads are merged by adding their buckets.
+//
+// The _shared variants are for a histogram (or counter) that one thread
+// records into while others read it: the owner updates with relaxed
+// atomic loads and stores, which cost no more than plain ones (there is no
+// locked instruction), and readers see each count whole, if not all
+// counts from the same instant.
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <string.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    long long counts[HIST_BUCKETS];
+    long long total;             // values recorded
+    long long sum;
+    long long max;
+} Histogram;
+
+static inline int hist_index(unsigned long long v) {
+    if (v < HIST_SUB_BUCKETS)
+        return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+// The largest value that lands in bucket i
+static inline long long hist_bucket_value(int i) {
+    if (i < HIST_SUB_BUCKETS)
+        return i;
+    int shift = (i >> HIST_SUB_BITS) - 1;
+    unsigned long long base = (unsigned long long)(HIST_SUB_BUCKETS + (i & (HIST_SUB_BUCKETS - 1)));
+    return (long long)(((base + 1) << shift) - 1);
+}
+
+static inline void hist_record(Histogram *h, long long v) {
+    if (v < 0)
+        v = 0;
+    h->counts[hist_index((unsigned long long)v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+// Single writer; other threads read with counter_read
+static inline void counter_add(long long *c, long long v) {
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static inline long long counter_read(const long long *c) {
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+static inline void hist_record_shared(Histogram *h, long long v) {
+    if (v < 0)
+        v = 0;
+    counter_add(&h->counts[hist_index((unsigned long long)v)], 1);
+    counter_add(&h->total, 1);
+    counter_add(&h->sum, v);
+    if (v > counter_read(&h->max))
+        __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+static inline void hist_merge(Histogram *dst, const Histogram *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+// dst is private; src may be being recorded into. The total is taken from
+// the buckets as read, so percentiles stay consistent.
+static inline void hist_merge_shared(Histogram *dst, const Histogram *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        long long n = counter_read(&src->counts[i]);
+        dst->counts[i] += n;
+        dst->total += n;
+    }
+    dst->sum += counter_read(&src->sum);
+    long long max = counter_read(&src->max);
+    if (max > dst->max)
+        dst->max = max;
+}
+
+// The value below which a fraction p of the recorded values fall
+static inline long long hist_percentile(const Histogram *h, double p) {
+    if (h->total == 0)
+        return 0;
+    long long rank = (long long)(p * h->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    long long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            return hist_bucket_value(i) < h->max ? hist_bucket_value(i) : h->max;
+    }
+    return h->max;
+}
+
+static inline double hist_mean(const Histogram *h) {
+    return h->total ? (double)h->sum / h->total : 0.0;
+}
+
+static inline void hist_reset(Histogram *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+#endif
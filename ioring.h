@@ -0,0 +1,154 @@
+// ioring.h
+// Minimal io_uring wrapper shared by the disk and filesystem servers.
+// Talks to the kernel through the raw syscalls, so no liburing is needed.
+// Every function returns -1 (or NULL) with errno set when the kernel has
+// no io_uring, letting the caller fall back to plain pread/pwrite.
+
+#ifndef IORING_H
+#define IORING_H
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// linux/fs.h, pulled in above, defines a BLOCK_SIZE of its own
+#undef BLOCK_SIZE
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned entries;
+    unsigned to_submit;          // SQEs queued but not yet handed to the kernel
+} IoRing;
+
+static inline int ioring_init(IoRing *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->entries = p.sq_entries;
+    return 0;
+
+fail: {
+        int saved = errno;
+        close(r->fd);
+        r->fd = -1;
+        errno = saved;
+        return -1;
+    }
+}
+
+// Next free submission entry, zeroed, or NULL if the queue is full.
+static inline struct io_uring_sqe *ioring_get_sqe(IoRing *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *r->sq_tail + r->to_submit;
+    if (tail - head >= r->entries)
+        return NULL;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->to_submit++;
+    return sqe;
+}
+
+static inline void ioring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, void *buf,
+                                  unsigned len, off_t offset, void *user_data) {
+    sqe->opcode = (unsigned char)op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = (unsigned long long)offset;
+    sqe->user_data = (unsigned long long)(unsigned long)user_data;
+}
+
+// fallocate(fd, mode, offset, len); completes with res 0 on success.
+static inline void ioring_prep_fallocate(struct io_uring_sqe *sqe, int fd, int mode,
+                                         off_t offset, off_t len, void *user_data) {
+    sqe->opcode = IORING_OP_FALLOCATE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)len;
+    sqe->len = (unsigned)mode;
+    sqe->off = (unsigned long long)offset;
+    sqe->user_data = (unsigned long long)(unsigned long)user_data;
+}
+
+// Hand queued SQEs to the kernel and optionally wait for wait_nr completions.
+static inline int ioring_submit(IoRing *r, unsigned wait_nr) {
+    unsigned n = r->to_submit;
+    if (n > 0) {
+        __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+        r->to_submit = 0;
+    }
+    if (n == 0 && wait_nr == 0)
+        return 0;
+    int ret;
+    for (;;) {
+        ret = (int)syscall(__NR_io_uring_enter, r->fd, n, wait_nr,
+                           wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0 || errno != EINTR)
+            break;
+        n = 0;                   // submission already happened; just keep waiting
+    }
+    return ret;
+}
+
+// Oldest unconsumed completion, or NULL if there is none.
+static inline struct io_uring_cqe *ioring_peek_cqe(IoRing *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+static inline void ioring_cqe_seen(IoRing *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
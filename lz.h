@@ -0,0 +1,143 @@
+// lz.h
+// Fast LZ77 block compression in the LZ4 block format: a greedy parse
+// over a hash of 4-byte sequences, byte-aligned tokens and no entropy
+// coding, so both directions run at memory speed. Used by the disk
+// server's compressed store (-z).
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+// Largest output for n bytes of input that doesn't compress
+static inline int lz_bound(int n) {
+    return n + n / 255 + 16;
+}
+
+static inline uint32_t lz_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// Length byte run for a token nibble that overflowed
+static inline unsigned char *lz_put_len(unsigned char *op, int len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// One sequence: literals, then a match of mlen bytes at offset back
+// (mlen 0: literals only, the last sequence). Returns NULL if it won't fit.
+static inline unsigned char *lz_put_seq(unsigned char *op, const unsigned char *end,
+                                        const unsigned char *lit, int nlit,
+                                        int offset, int mlen) {
+    if (end - op < 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1)
+        return NULL;
+    int ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    unsigned char *token = op++;
+    *token = (unsigned char)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15)
+        op = lz_put_len(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0)
+        return op;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    *token |= ml < 15 ? ml : 15;
+    if (ml >= 15)
+        op = lz_put_len(op, ml - 15);
+    return op;
+}
+
+// Compress n bytes into dst. Returns the compressed length, or 0 if it
+// wouldn't be smaller than cap bytes (store the input as it is).
+static inline int lz_compress(const unsigned char *src, int n, unsigned char *dst, int cap) {
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+    unsigned char *op = dst, *end = dst + cap;
+    int anchor = 0, ip = 0;
+
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t seq = lz_read32(src + ip);
+        uint32_t h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || lz_read32(src + ref) != seq) {
+            // Stride grows through incompressible stretches
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        int len = LZ_MIN_MATCH;
+        while (ip + len < n && src[ref + len] == src[ip + len])
+            len++;
+        op = lz_put_seq(op, end, src + anchor, ip - anchor, ip - ref, len);
+        if (!op)
+            return 0;
+        ip += len;
+        anchor = ip;
+    }
+    op = lz_put_seq(op, end, src + anchor, n - anchor, 0, 0);
+    return op ? (int)(op - dst) : 0;
+}
+
+// Decompress n bytes into at most cap bytes of dst. Returns the
+// decompressed length, or -1 if the input is malformed.
+static inline int lz_decompress(const unsigned char *src, int n, unsigned char *dst, int cap) {
+    int ip = 0, op = 0;
+    while (ip < n) {
+        int token = src[ip++];
+        int nlit = token >> 4;
+        if (nlit == 15) {
+            int b;
+            do {
+                if (ip >= n)
+                    return -1;
+                b = src[ip++];
+                nlit += b;
+            } while (b == 255);
+        }
+        if (nlit > n - ip || nlit > cap - op)
+            return -1;
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == n)
+            break;               // the last sequence has no match
+
+        if (n - ip < 2)
+            return -1;
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        int mlen = token & 15;
+        if (mlen == 15) {
+            int b;
+            do {
+                if (ip >= n)
+                    return -1;
+                b = src[ip++];
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || mlen > cap - op)
+            return -1;
+        if (offset >= mlen) {
+            memcpy(dst + op, dst + op - offset, mlen);
+        } else {
+            for (int i = 0; i < mlen; i++)   // overlapping: a repeating run
+                dst[op + i] = dst[op - offset + i];
+        }
+        op += mlen;
+    }
+    return op;
+}
+
+#endif
@@ -1,6 +1,27 @@
 // random_client.c
-// Random workload generator for disk server (Part 3)
-// Usage: ./random_client <server_ip> <port> <N> <seed>
+// Load generator for the disk server (Part 3)
+//
+// Runs one connection per thread against a disk server (or the proxy) and
+// reports throughput and latency percentiles. Each connection keeps up to
+// --depth requests in flight and issues <N> measured requests, after
+// --warmup requests that aren't counted; all connections start measuring
+// together.
+//
+// Closed loop (the default): a connection sends its next request as soon
+// as one is answered. Open loop (--rate R): requests go out on a fixed
+// schedule, R per second over all connections, whether or not earlier ones
+// have been answered (up to --depth in flight), and latency is measured
+// from when each request was due, so a server that falls behind shows it.
+//
+// Addresses are drawn from --dist over all blocks of the disk:
+//   uniform            every block equally likely
+//   zipfian[:theta]    a few blocks take most of the requests (theta 0.99);
+//                      the popular blocks are scattered over the disk
+//   sequential         each connection walks its own share of the disk
+//   hotcold[:f:p]      a fraction p of requests go to the first fraction f
+//                      of the disk (0.2:0.8)
+//
+// Usage: ./random_client [options] <server_ip> <port> <N> <seed>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,25 +31,204 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <time.h>
+#include "histogram.h"
 
-#define BLOCK_SIZE 128
+#define DEFAULT_BLOCK_SIZE 128
+#define REQ_HDR_SIZE  20
+#define RESP_HDR_SIZE 16
+#define MAX_THREADS   256
+#define MAX_LINE      64
 
-int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <server_ip> <port> <N> <seed>\n", argv[0]);
+#define DIST_UNIFORM    0
+#define DIST_ZIPFIAN    1
+#define DIST_SEQUENTIAL 2
+#define DIST_HOTCOLD    3
+
+#define FORMAT_TEXT 0
+#define FORMAT_CSV  1
+#define FORMAT_JSON 2
+
+// Settings, fixed before the threads start
+static const char *server_ip;
+static int port;
+static int nthreads = 1;
+static int depth = 1;
+static int binary = 0;
+static double read_ratio = 0.5;
+static double rate = 0;          // requests per second over all connections; 0: closed loop
+static long long warmup = 0;     // per connection
+static long long nops;           // measured, per connection
+static int seed;
+static int dist = DIST_UNIFORM;
+static char dist_name[64] = "uniform";
+static double zipf_theta = 0.99;
+static double hot_fraction = 0.2, hot_probability = 0.8;
+static int format = FORMAT_TEXT;
+
+// Geometry, from the first connection's "I"
+static long long num_cyl, sectors_per_cyl, total_blocks;
+static int block_size = DEFAULT_BLOCK_SIZE;
+
+// Zipfian constants (Gray et al., as in YCSB)
+static double zipf_alpha, zipf_zetan, zipf_eta;
+
+static pthread_barrier_t start_barrier;
+
+typedef struct {
+    long long start_ns;          // when it was sent, or (open loop) due
+    int is_write;
+} Pending;
+
+typedef struct {
+    int id;
+    int fd;
+    unsigned long long rng;
+    long long seq_next;          // sequential: next block
+    Pending *pending;            // ring of depth requests in flight
+    unsigned char *out;
+    size_t out_len;
+    unsigned char *in;
+    size_t in_len, in_cap;
+    unsigned char *payload;
+    Histogram reads, writes;
+    long long errors;
+    int failed;
+} Worker;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void put_le32(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static unsigned int get_le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+// xorshift64*: each thread has its own, seeded from <seed> and its id
+static unsigned long long next_rand(unsigned long long *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545f4914f6cdd1dULL;
+}
+
+static double rand_unit(unsigned long long *s) {
+    return (next_rand(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Uniform in [0, n), wide enough for 64-bit geometry
+static long long rand_below(unsigned long long *s, long long n) {
+    return (long long)(next_rand(s) % (unsigned long long)n);
+}
+
+// Generalized harmonic number H(n, theta). Summed exactly up to a million
+// terms; beyond that the tail is close enough to its integral.
+static double zeta(long long n, double theta) {
+    long long exact = n < 1000000 ? n : 1000000;
+    double sum = 0;
+    for (long long i = 1; i <= exact; i++)
+        sum += 1.0 / pow((double)i, theta);
+    if (n > exact)
+        sum += (pow((double)n, 1 - theta) - pow((double)exact, 1 - theta)) / (1 - theta);
+    return sum;
+}
+
+static void zipf_init(void) {
+    zipf_alpha = 1.0 / (1.0 - zipf_theta);
+    zipf_zetan = zeta(total_blocks, zipf_theta);
+    double zeta2 = zeta(2, zipf_theta);
+    zipf_eta = (1 - pow(2.0 / total_blocks, 1 - zipf_theta)) / (1 - zeta2 / zipf_zetan);
+}
+
+// Rank 0 is the most popular block
+static long long zipf_rank(unsigned long long *s) {
+    double u = rand_unit(s);
+    double uz = u * zipf_zetan;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, zipf_theta))
         return 1;
+    long long r = (long long)(total_blocks * pow(zipf_eta * u - zipf_eta + 1, zipf_alpha));
+    return r < total_blocks ? r : total_blocks - 1;
+}
+
+static long long next_block(Worker *w) {
+    switch (dist) {
+    case DIST_ZIPFIAN: {
+        // Scatter the ranks so the popular blocks aren't all on cylinder 0
+        unsigned long long h = (unsigned long long)zipf_rank(&w->rng) * 0x9e3779b97f4a7c15ULL;
+        return (long long)((h ^ (h >> 29)) % (unsigned long long)total_blocks);
+    }
+    case DIST_SEQUENTIAL: {
+        long long b = w->seq_next;
+        w->seq_next = (w->seq_next + 1) % total_blocks;
+        return b;
     }
+    case DIST_HOTCOLD: {
+        long long hot = (long long)(total_blocks * hot_fraction);
+        if (hot < 1)
+            hot = 1;
+        if (hot >= total_blocks || rand_unit(&w->rng) < hot_probability)
+            return rand_below(&w->rng, hot);
+        return hot + rand_below(&w->rng, total_blocks - hot);
+    }
+    default:
+        return rand_below(&w->rng, total_blocks);
+    }
+}
 
-    const char *server_ip = argv[1];
-    int port = atoi(argv[2]);
-    int N = atoi(argv[3]);
-    int seed = atoi(argv[4]);
+static int send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// One reply line ("I", "V", "B"), read a byte at a time so nothing after
+// it is consumed. Only used with nothing else in flight.
+static int recv_line(int fd, char *line, int cap) {
+    int n = 0;
+    while (n < cap - 1) {
+        char ch;
+        ssize_t r = recv(fd, &ch, 1, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return 0;
+        line[n++] = ch;
+        if (ch == '\n')
+            break;
+    }
+    line[n] = '\0';
+    return 1;
+}
 
+static int connect_server(void) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
         perror("socket");
-        return 1;
+        return -1;
     }
 
     struct sockaddr_in addr;
@@ -38,103 +238,430 @@ int main(int argc, char *argv[]) {
     if (inet_pton(AF_INET, server_ip, &addr.sin_addr) <= 0) {
         perror("inet_pton");
         close(sock);
-        return 1;
+        return -1;
     }
-
     if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         perror("connect");
         close(sock);
-        return 1;
-    }
-
-    FILE *server = fdopen(sock, "r+");
-    if (!server) {
-        perror("fdopen");
-        close(sock);
-        return 1;
+        return -1;
     }
 
-    // Get disk geometry using I command
-    fputs("I\n", server);
-    fflush(server);
+    // Each request is a small write waiting on a reply; don't let Nagle hold it
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return sock;
+}
 
-    int num_cyl, sectors_per_cyl;
-    if (fscanf(server, "%d %d", &num_cyl, &sectors_per_cyl) != 2) {
+// "<cylinders> <sectors> <block size>"; older servers omit the block size
+// and use 128-byte blocks
+static int read_geometry(int fd) {
+    char info[128];
+    if (!send_all(fd, "I\n", 2) || !recv_line(fd, info, sizeof(info)) ||
+        sscanf(info, "%lld %lld %d", &num_cyl, &sectors_per_cyl, &block_size) < 2 ||
+        num_cyl <= 0 || sectors_per_cyl <= 0 || block_size <= 0) {
         fprintf(stderr, "Failed to read disk geometry\n");
-        fclose(server);
-        return 1;
+        return 0;
     }
+    total_blocks = num_cyl * sectors_per_cyl;
+    return 1;
+}
 
-    // Consume the rest of the line after fscanf
-    int ch;
-    while ((ch = fgetc(server)) != '\n' && ch != EOF) {}
+// The server's simulated clock ("V"); -1 if it can't tell us
+static long long query_clock(int fd) {
+    char line[MAX_LINE];
+    long long t;
+    if (!send_all(fd, "V\n", 2) || !recv_line(fd, line, sizeof(line)) ||
+        sscanf(line, "%lld", &t) != 1)
+        return -1;
+    return t;
+}
 
-    printf("Disk geometry: %d cylinders, %d sectors/cylinder\n",
-           num_cyl, sectors_per_cyl);
+// Binary request frame: op, flags, u16 count, u32 tag, cylinder, sector,
+// payload length (see Basic_disk_storage_system.c)
+static void add_frame(Worker *w, int op, int tag, long long c, long long s,
+                      const unsigned char *payload, int len) {
+    unsigned char *h = w->out + w->out_len;
+    h[0] = (unsigned char)op;
+    h[1] = 0;
+    h[2] = 1;   // count = 1 block
+    h[3] = 0;
+    put_le32(h + 4, tag);
+    put_le32(h + 8, (unsigned int)c);
+    put_le32(h + 12, (unsigned int)s);
+    put_le32(h + 16, len);
+    w->out_len += REQ_HDR_SIZE;
+    memcpy(w->out + w->out_len, payload, len);
+    w->out_len += len;
+}
 
-    srand(seed);
+// Append request number tag to the output buffer
+static void add_request(Worker *w, int tag, int is_write) {
+    long long b = next_block(w);
+    long long c = b / sectors_per_cyl, s = b % sectors_per_cyl;
+    if (is_write) {
+        // Vary the payload a little so writes aren't all identical
+        w->payload[next_rand(&w->rng) % block_size] = 'A' + next_rand(&w->rng) % 26;
+    }
 
-    unsigned char buf[BLOCK_SIZE];
+    if (binary) {
+        add_frame(w, is_write ? 'W' : 'R', tag, c, s, w->payload, is_write ? block_size : 0);
+        return;
+    }
+    char *line = (char *)w->out + w->out_len;
+    // With more than one in flight, tag the request ("T <id> ") as the
+    // server's pipelining expects; replies come back in order either way
+    int n = depth > 1 ? sprintf(line, "T %d ", tag) : 0;
+    if (is_write) {
+        n += sprintf(line + n, "W %lld %lld %d\n", c, s, block_size);
+        memcpy(line + n, w->payload, block_size);
+        n += block_size;
+    } else {
+        n += sprintf(line + n, "R %lld %lld\n", c, s);
+    }
+    w->out_len += n;
+}
 
-    for (int i = 0; i < N; i++) {
-        int is_write = rand() % 2;
-        int c = rand() % num_cyl;
-        int s = rand() % sectors_per_cyl;
+// Length of the reply at offset from in the input buffer, or 0 if it
+// isn't all there yet. *ok is its status.
+static size_t reply_length(const Worker *w, size_t from, int is_write, int *ok) {
+    const unsigned char *in = w->in + from;
+    size_t avail = w->in_len - from;
+    if (binary) {
+        if (avail < RESP_HDR_SIZE)
+            return 0;
+        size_t len = RESP_HDR_SIZE + get_le32(in + 8);
+        *ok = in[0] == 1;
+        return avail >= len ? len : 0;
+    }
+    size_t pos = 0;
+    if (depth > 1) {
+        while (pos < avail && in[pos] != ' ')
+            pos++;
+        if (pos++ >= avail)
+            return 0;
+    }
+    if (pos >= avail)
+        return 0;
+    *ok = in[pos++] == '1';
+    size_t need = pos + (*ok && !is_write ? block_size : 0);
+    return avail >= need ? need : 0;
+}
 
-        if (is_write) {
-            // Build random 128-byte payload
-            for (int j = 0; j < BLOCK_SIZE; j++) {
-                buf[j] = (unsigned char)('A' + (rand() % 26));
+// Issue n requests; latencies are recorded if measure is set. Returns 0 if
+// the connection failed.
+static int run_phase(Worker *w, long long n, int measure) {
+    long long interval = rate > 0 ? (long long)(1e9 * nthreads / rate) : 0;
+    long long sent = 0, done = 0;
+    long long due = now_ns();
+
+    while (done < n) {
+        long long now = now_ns();
+        w->out_len = 0;
+        while (sent < n && sent - done < depth && (interval == 0 || now >= due)) {
+            Pending *p = &w->pending[sent % depth];
+            p->is_write = rand_unit(&w->rng) >= read_ratio;
+            p->start_ns = interval ? due : now;
+            add_request(w, (int)(sent % 1000000), p->is_write);
+            sent++;
+            due += interval;
+        }
+        if (w->out_len > 0 && !send_all(w->fd, w->out, w->out_len)) {
+            perror("send");
+            return 0;
+        }
+        if (sent == done) {
+            // Open loop, nothing in flight: sleep until the next is due
+            long long wait = due - now_ns();
+            if (wait > 0) {
+                struct timespec ts = { wait / 1000000000LL, wait % 1000000000LL };
+                nanosleep(&ts, NULL);
             }
+            continue;
+        }
 
-            // Send header: W c s 128\n
-            char header[128];
-            snprintf(header, sizeof(header), "W %d %d %d\n", c, s, BLOCK_SIZE);
-            fputs(header, server);
-            fflush(server);
+        int timeout = -1;
+        if (interval && sent < n && sent - done < depth) {
+            long long wait = due - now_ns();
+            timeout = wait > 0 ? (int)((wait + 999999) / 1000000) : 0;
+        }
+        struct pollfd pfd = { w->fd, POLLIN, 0 };
+        if (poll(&pfd, 1, timeout) <= 0)
+            continue;
+        if (w->in_cap - w->in_len < (size_t)block_size + RESP_HDR_SIZE + MAX_LINE) {
+            fprintf(stderr, "Reply too large\n");
+            return 0;
+        }
+        ssize_t got = recv(w->fd, w->in + w->in_len, w->in_cap - w->in_len, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0) {
+            fprintf(stderr, "Server disconnected\n");
+            return 0;
+        }
+        w->in_len += got;
+        now = now_ns();
 
-            int srv_fd = fileno(server);
-            ssize_t w = write(srv_fd, buf, BLOCK_SIZE);
-            if (w != BLOCK_SIZE) {
-                perror("write payload");
+        size_t used = 0;
+        while (done < sent) {
+            Pending *p = &w->pending[done % depth];
+            int ok = 0;
+            size_t len = reply_length(w, used, p->is_write, &ok);
+            if (len == 0)
                 break;
-            }
+            used += len;
+            if (!ok)
+                w->errors++;
+            if (measure)
+                hist_record(p->is_write ? &w->writes : &w->reads, (now - p->start_ns) / 1000);
+            done++;
+        }
+        memmove(w->in, w->in + used, w->in_len - used);
+        w->in_len -= used;
+    }
+    return 1;
+}
 
-            int resp = fgetc(server);
-            if (resp == EOF) {
-                printf("\nServer disconnected.\n");
-                break;
-            }
-            // Just show progress
-            putchar('W');
-            fflush(stdout);
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    w->seq_next = total_blocks / nthreads * w->id;
+    w->fd = connect_server();
+    w->failed = w->fd < 0;
+    if (!w->failed && binary) {
+        // Switch the connection to binary frames
+        char ch;
+        if (!send_all(w->fd, "B\n", 2) || recv(w->fd, &ch, 1, 0) != 1 || ch != '1') {
+            fprintf(stderr, "Server refused binary framing\n");
+            w->failed = 1;
+        }
+    }
+    if (!w->failed && warmup > 0)
+        w->failed = !run_phase(w, warmup, 0);
+
+    // Everyone measures from the same moment
+    pthread_barrier_wait(&start_barrier);
+    if (!w->failed)
+        w->failed = !run_phase(w, nops, 1);
+    if (w->fd >= 0)
+        close(w->fd);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--threads T] [--depth D] [--binary] [--read-ratio R] [--dist D]\n"
+            "       [--rate OPS] [--warmup N] [--format text|csv|json] <server_ip> <port> <N> <seed>\n"
+            "  D: uniform, zipfian[:theta], sequential or hotcold[:fraction:probability]\n"
+            "  N: measured requests per connection\n",
+            prog);
+}
+
+static int parse_dist(const char *spec) {
+    snprintf(dist_name, sizeof(dist_name), "%s", spec);
+    if (strcmp(spec, "uniform") == 0) {
+        dist = DIST_UNIFORM;
+    } else if (strcmp(spec, "sequential") == 0) {
+        dist = DIST_SEQUENTIAL;
+    } else if (strncmp(spec, "zipfian", 7) == 0) {
+        dist = DIST_ZIPFIAN;
+        if (spec[7] == ':' && sscanf(spec + 8, "%lf", &zipf_theta) != 1)
+            return 0;
+        if (zipf_theta <= 0 || zipf_theta >= 1)
+            return 0;
+    } else if (strncmp(spec, "hotcold", 7) == 0) {
+        dist = DIST_HOTCOLD;
+        if (spec[7] == ':' && sscanf(spec + 8, "%lf:%lf", &hot_fraction, &hot_probability) != 2)
+            return 0;
+        if (hot_fraction <= 0 || hot_fraction > 1 || hot_probability < 0 || hot_probability > 1)
+            return 0;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static void print_latency_json(const char *name, const Histogram *h, int last) {
+    printf("    \"%s\": {\"ops\": %lld, \"mean\": %.1f, \"p50\": %lld, \"p99\": %lld, "
+           "\"p999\": %lld, \"max\": %lld}%s\n",
+           name, h->total, hist_mean(h), hist_percentile(h, 0.5), hist_percentile(h, 0.99),
+           hist_percentile(h, 0.999), h->max, last ? "" : ",");
+}
+
+int main(int argc, char *argv[]) {
+    char *args[5];
+    int nargs = 0;
+    int bad = 0;
+    for (int i = 0; i < argc; i++) {
+        const char *opt = argv[i];
+        int has_value = i + 1 < argc;
+        if (strcmp(opt, "--threads") == 0 && has_value) {
+            nthreads = atoi(argv[++i]);
+        } else if (strcmp(opt, "--depth") == 0 && has_value) {
+            depth = atoi(argv[++i]);
+        } else if (strcmp(opt, "--binary") == 0) {
+            binary = 1;
+        } else if (strcmp(opt, "--read-ratio") == 0 && has_value) {
+            read_ratio = atof(argv[++i]);
+        } else if (strcmp(opt, "--rate") == 0 && has_value) {
+            rate = atof(argv[++i]);
+        } else if (strcmp(opt, "--warmup") == 0 && has_value) {
+            warmup = atoll(argv[++i]);
+        } else if (strcmp(opt, "--dist") == 0 && has_value) {
+            bad |= !parse_dist(argv[++i]);
+        } else if (strcmp(opt, "--format") == 0 && has_value) {
+            const char *f = argv[++i];
+            format = strcmp(f, "csv") == 0 ? FORMAT_CSV : strcmp(f, "json") == 0 ? FORMAT_JSON :
+                     strcmp(f, "text") == 0 ? FORMAT_TEXT : -1;
+            bad |= format < 0;
+        } else if (nargs < 5) {
+            args[nargs++] = argv[i];
         } else {
-            // Read request: R c s\n
-            char header[128];
-            snprintf(header, sizeof(header), "R %d %d\n", c, s);
-            fputs(header, server);
-            fflush(server);
-
-            int resp = fgetc(server);
-            if (resp == EOF) {
-                printf("\nServer disconnected.\n");
-                break;
-            }
-            if (resp == '1') {
-                int srv_fd = fileno(server);
-                ssize_t n = read(srv_fd, buf, BLOCK_SIZE);
-                if (n != BLOCK_SIZE) {
-                    perror("read block");
-                    break;
-                }
-            }
-            // Just show progress
-            putchar('R');
-            fflush(stdout);
+            nargs++;
+        }
+    }
+
+    if (bad || nargs != 5 || depth < 1 || nthreads < 1 || nthreads > MAX_THREADS ||
+        read_ratio < 0 || read_ratio > 1 || rate < 0 || warmup < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    server_ip = args[1];
+    port = atoi(args[2]);
+    nops = atoll(args[3]);
+    seed = atoi(args[4]);
+
+    // A connection of our own for the geometry and the simulated clock
+    int control = connect_server();
+    if (control < 0)
+        return 1;
+    if (!read_geometry(control)) {
+        close(control);
+        return 1;
+    }
+    if (format == FORMAT_TEXT)
+        printf("Disk geometry: %lld cylinders, %lld sectors/cylinder, block size %d\n",
+               num_cyl, sectors_per_cyl, block_size);
+    if (dist == DIST_ZIPFIAN)
+        zipf_init();
+
+    Worker *workers = calloc(nthreads, sizeof(Worker));
+    pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+    if (!workers || !tids) {
+        perror("calloc");
+        return 1;
+    }
+    size_t request_max = REQ_HDR_SIZE + MAX_LINE + block_size;
+    for (int i = 0; i < nthreads; i++) {
+        Worker *w = &workers[i];
+        w->id = i;
+        w->fd = -1;
+        w->rng = ((unsigned long long)seed << 16 ^ (unsigned long long)i) * 0x9e3779b97f4a7c15ULL + 1;
+        w->pending = calloc(depth, sizeof(Pending));
+        w->out = malloc((size_t)depth * request_max);
+        w->in_cap = (size_t)depth * request_max + 65536;
+        w->in = malloc(w->in_cap);
+        w->payload = malloc(block_size);
+        if (!w->pending || !w->out || !w->in || !w->payload) {
+            perror("malloc");
+            return 1;
         }
+        for (int j = 0; j < block_size; j++)
+            w->payload[j] = 'A' + next_rand(&w->rng) % 26;
     }
 
-    putchar('\n');
-    fclose(server);
-    return 0;
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&tids[i], NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    pthread_barrier_wait(&start_barrier);
+    long long sim_start = query_clock(control);
+    long long start = now_ns();
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+    double secs = (now_ns() - start) / 1e9;
+    long long sim_end = query_clock(control);
+    close(control);
+
+    Histogram *all = calloc(3, sizeof(Histogram));
+    if (!all) {
+        perror("calloc");
+        return 1;
+    }
+    Histogram *reads = &all[1], *writes = &all[2];
+    long long errors = 0;
+    int failed = 0;
+    for (int i = 0; i < nthreads; i++) {
+        hist_merge(reads, &workers[i].reads);
+        hist_merge(writes, &workers[i].writes);
+        errors += workers[i].errors;
+        failed += workers[i].failed;
+    }
+    hist_merge(all, reads);
+    hist_merge(all, writes);
+    long long done = all->total;
+    double ops_per_sec = secs > 0 ? done / secs : 0.0;
+    // Simulated disk time that passed while we ran (shared with any other
+    // clients running at the same time)
+    double sim_secs = sim_start >= 0 && sim_end > sim_start ? (sim_end - sim_start) / 1e6 : 0.0;
+    const char *mode = rate > 0 ? "open" : "closed";
+
+    if (format == FORMAT_CSV) {
+        printf("op,threads,depth,mode,rate,read_ratio,distribution,ops,errors,seconds,"
+               "ops_per_sec,sim_seconds,mean_us,p50_us,p99_us,p999_us,max_us\n");
+        const char *names[] = { "all", "read", "write" };
+        for (int k = 0; k < 3; k++) {
+            const Histogram *h = &all[k];
+            printf("%s,%d,%d,%s,%.1f,%.3f,%s,%lld,%lld,%.3f,%.1f,%.3f,%.1f,%lld,%lld,%lld,%lld\n",
+                   names[k], nthreads, depth, mode, rate, read_ratio, dist_name, h->total,
+                   k == 0 ? errors : 0, secs, secs > 0 ? h->total / secs : 0.0, sim_secs,
+                   hist_mean(h), hist_percentile(h, 0.5), hist_percentile(h, 0.99),
+                   hist_percentile(h, 0.999), h->max);
+        }
+    } else if (format == FORMAT_JSON) {
+        printf("{\n");
+        printf("  \"threads\": %d, \"depth\": %d, \"mode\": \"%s\", \"rate\": %.1f,\n",
+               nthreads, depth, mode, rate);
+        printf("  \"read_ratio\": %.3f, \"distribution\": \"%s\", \"warmup\": %lld, \"binary\": %s,\n",
+               read_ratio, dist_name, warmup, binary ? "true" : "false");
+        printf("  \"ops\": %lld, \"errors\": %lld, \"failed_connections\": %d,\n", done, errors, failed);
+        printf("  \"seconds\": %.3f, \"ops_per_sec\": %.1f, \"sim_seconds\": %.3f,\n",
+               secs, ops_per_sec, sim_secs);
+        printf("  \"latency_usec\": {\n");
+        print_latency_json("all", all, 0);
+        print_latency_json("read", reads, 0);
+        print_latency_json("write", writes, 1);
+        printf("  }\n}\n");
+    } else {
+        printf("%lld ops in %.3f s (%.1f ops/s), %d connections, depth %d, %s loop%s\n",
+               done, secs, ops_per_sec, nthreads, depth, mode, binary ? ", binary" : "");
+        if (sim_secs > 0)
+            printf("simulated %.3f s (%.1f ops/s)\n", sim_secs, done / sim_secs);
+        printf("%-6s %8s %10s %8s %8s %8s %8s  (usec)\n", "", "ops", "mean", "p50", "p99", "p99.9", "max");
+        const char *names[] = { "all", "read", "write" };
+        for (int k = 0; k < 3; k++) {
+            const Histogram *h = &all[k];
+            printf("%-6s %8lld %10.1f %8lld %8lld %8lld %8lld\n", names[k], h->total,
+                   hist_mean(h), hist_percentile(h, 0.5), hist_percentile(h, 0.99),
+                   hist_percentile(h, 0.999), h->max);
+        }
+        if (errors > 0)
+            printf("%lld requests failed\n", errors);
+        if (failed > 0)
+            printf("%d connections failed\n", failed);
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        free(workers[i].pending);
+        free(workers[i].out);
+        free(workers[i].in);
+        free(workers[i].payload);
+    }
+    free(workers);
+    free(tids);
+    free(all);
+    return failed > 0;
 }
@@ -0,0 +1,192 @@
+// trace.h
+// Request traces: written by the disk and filesystem servers (-T <file>)
+// and replayed by trace_replay.
+//
+// A trace is a TraceHeader followed by one variable-length record per
+// request, in the order the server took them:
+//
+//   u8      op        command letter: R W D F (disk), F C D L R G W P A T (filesystem)
+//   varint  dt        microseconds since the previous record
+//   varint  client    connection number, from 0 in order of arrival
+//   varint  addr      disk: first block; filesystem: G P offset, F layout + 1
+//                     (0: the server's default), otherwise 0
+//   varint  length    disk: blocks; filesystem: G W P A bytes, T new length,
+//                     F block size, L verbose
+//   varint  name_len  the file name's length (filesystem C D R G W P A T), then its bytes
+//
+// Varints are 7 bits a byte, low bits first, so a typical disk record is
+// 6-8 bytes. Data isn't recorded; replays write a pattern of the same size.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#define TRACE_BUF_SIZE (64 * 1024)       // written out when this full...
+#define TRACE_FLUSH_USEC 1000000         // ...or this old
+#define TRACE_MAX_NAME 255
+#define TRACE_MAX_RECORD (1 + 5 * 10 + TRACE_MAX_NAME)
+
+typedef struct {
+    char magic[4];               // "TRC1"
+    char kind;                   // 'D' disk server, 'F' filesystem server
+    char reserved0[3];
+    int block_size;              // disk: of the traced server; filesystem: 0
+    long long start_usec;        // wall clock when the trace began
+    long long reserved[2];
+} TraceHeader;
+
+typedef struct {
+    int op;
+    long long usec;              // since the start of the trace
+    unsigned int client;
+    long long addr;
+    long long length;
+    char name[TRACE_MAX_NAME + 1];
+} TraceRecord;
+
+// Appends are buffered and serialized by the writer's own lock
+typedef struct {
+    int fd;                      // -1: not tracing
+    pthread_mutex_t lock;
+    unsigned char buf[TRACE_BUF_SIZE + TRACE_MAX_RECORD];
+    size_t len;
+    long long start, last, flushed;   // monotonic microseconds
+} TraceWriter;
+
+static inline long long trace_now(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static inline unsigned char *trace_put_varint(unsigned char *p, unsigned long long v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+// 0 if the varint runs past end or is too long
+static inline int trace_get_varint(const unsigned char **p, const unsigned char *end,
+                                   unsigned long long *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        unsigned char b = *(*p)++;
+        *v |= (unsigned long long)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+static inline int trace_open(TraceWriter *t, const char *path, char kind, int block_size) {
+    t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (t->fd < 0) {
+        perror("open trace");
+        return 0;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    TraceHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "TRC1", 4);
+    h.kind = kind;
+    h.block_size = block_size;
+    h.start_usec = trace_now(CLOCK_REALTIME);
+    memcpy(t->buf, &h, sizeof(h));
+    t->len = sizeof(h);
+    t->start = t->last = t->flushed = trace_now(CLOCK_MONOTONIC);
+    return 1;
+}
+
+// Caller holds t->lock. A failed write stops the trace.
+static inline void trace_flush_locked(TraceWriter *t) {
+    size_t done = 0;
+    while (done < t->len && t->fd >= 0) {
+        ssize_t n = write(t->fd, t->buf + done, t->len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror("write trace (tracing stopped)");
+            close(t->fd);
+            t->fd = -1;
+            break;
+        }
+        done += n;
+    }
+    t->len = 0;
+    t->flushed = t->last;
+}
+
+static inline void trace_flush(TraceWriter *t) {
+    if (t->fd < 0)
+        return;
+    pthread_mutex_lock(&t->lock);
+    trace_flush_locked(t);
+    pthread_mutex_unlock(&t->lock);
+}
+
+// Caller holds t->lock; name may be NULL
+static inline void trace_add_locked(TraceWriter *t, int op, unsigned int client,
+                                    long long addr, long long length, const char *name) {
+    if (t->fd < 0)
+        return;
+    long long now = trace_now(CLOCK_MONOTONIC);
+    size_t name_len = name ? strlen(name) : 0;
+    if (name_len > TRACE_MAX_NAME)
+        name_len = TRACE_MAX_NAME;
+    unsigned char *p = t->buf + t->len;
+    *p++ = (unsigned char)op;
+    p = trace_put_varint(p, (unsigned long long)(now - t->last));
+    p = trace_put_varint(p, client);
+    p = trace_put_varint(p, (unsigned long long)addr);
+    p = trace_put_varint(p, (unsigned long long)length);
+    p = trace_put_varint(p, name_len);
+    if (name_len)
+        memcpy(p, name, name_len);
+    t->len = (size_t)(p + name_len - t->buf);
+    t->last = now;
+    if (t->len >= TRACE_BUF_SIZE || now - t->flushed >= TRACE_FLUSH_USEC)
+        trace_flush_locked(t);
+}
+
+static inline void trace_add(TraceWriter *t, int op, unsigned int client,
+                             long long addr, long long length, const char *name) {
+    if (t->fd < 0)
+        return;
+    pthread_mutex_lock(&t->lock);
+    trace_add_locked(t, op, client, addr, length, name);
+    pthread_mutex_unlock(&t->lock);
+}
+
+// Decode the record at *p, advancing *p past it; r->usec continues from
+// the previous record's. Returns 0 at the end or on a truncated record.
+static inline int trace_next(const unsigned char **p, const unsigned char *end, TraceRecord *r) {
+    unsigned long long dt, client, addr, length, name_len;
+    if (*p >= end)
+        return 0;
+    r->op = *(*p)++;
+    if (!trace_get_varint(p, end, &dt) || !trace_get_varint(p, end, &client) ||
+        !trace_get_varint(p, end, &addr) || !trace_get_varint(p, end, &length) ||
+        !trace_get_varint(p, end, &name_len) || name_len > TRACE_MAX_NAME ||
+        name_len > (unsigned long long)(end - *p))
+        return 0;
+    r->usec += (long long)dt;
+    r->client = (unsigned int)client;
+    r->addr = (long long)addr;
+    r->length = (long long)length;
+    memcpy(r->name, *p, name_len);
+    r->name[name_len] = '\0';
+    *p += name_len;
+    return 1;
+}
+
+#endif
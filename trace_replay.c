@@ -0,0 +1,764 @@
+// trace_replay.c
+// Replays a request trace (see trace.h) against a disk server, the disk
+// proxy, or a filesystem server, and reports throughput and latency.
+//
+// Every connection in the trace gets a thread and a connection of its own,
+// and issues that connection's requests in their original order. As fast as
+// possible (the default), each sends its next request as soon as the last
+// is answered. With --timed, each request waits until its original offset
+// from the start of the trace, scaled by --speed (2 runs twice as fast);
+// the report then also shows how late requests went out.
+//
+// Timed disk replay is open loop: requests go out tagged ("T <id>") at
+// their time whether or not earlier ones have been answered, and a second
+// thread per connection collects the replies, so the trace's concurrency
+// within and across connections is kept. Latency runs from when a request
+// went out to its last reply.
+//
+// Disk traces: block addresses wrap around a smaller target disk, ranges
+// are split to fit the target's RN/WN limit, and writes carry a pattern
+// rather than the original data. Lengths are in blocks, so a target with
+// another block size moves proportionally more or less data.
+//
+// Filesystem traces: the server handles one connection at a time, so
+// concurrent connections in the trace are served one after another. Its
+// commands can't be tagged, so each connection waits on every reply even
+// with --timed.
+//
+// Usage: ./trace_replay [--timed] [--speed X] [--format text|json] <server_ip> <port> <trace_file>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include "histogram.h"
+#include "trace.h"
+
+#define DEFAULT_BLOCK_SIZE 128
+#define MAX_RANGE_BLOCKS 256       // the disk server's RN/WN limits
+#define MAX_RANGE_BYTES (1 << 20)
+#define MAX_LINE 128
+#define MAX_OUTSTANDING 4096       // --timed disk: pieces awaiting a reply, per connection
+
+#define FORMAT_TEXT 0
+#define FORMAT_JSON 1
+
+// Settings, fixed before the threads start
+static const char *server_ip;
+static int port;
+static int timed = 0;
+static double speed = 1.0;
+static int format = FORMAT_TEXT;
+
+// The trace, decoded
+typedef struct {
+    long long usec;
+    long long addr;
+    long long length;
+    char *name;                  // NULL if none
+    unsigned int client;
+    int op;
+} Op;
+
+static TraceHeader header;
+static Op *records;
+static long long nrecords;
+
+// Disk geometry, from "I" (disk traces only)
+static long long num_cyl, sectors_per_cyl, total_blocks;
+static int block_size = DEFAULT_BLOCK_SIZE;
+static int max_range_blocks;
+static unsigned char *payload;   // max_range_blocks of pattern, shared
+
+static pthread_barrier_t start_barrier;
+static long long start_ns;
+
+// A disk command sent with --timed whose reply the reader hasn't had yet
+typedef struct {
+    unsigned int tag;
+    int op;
+    int last;                    // the record's final piece
+    long long data_len;          // read data that follows a '1'
+    long long sent_ns;           // when the record's first piece went out
+} Pending;
+
+typedef struct {
+    unsigned int client;
+    long long *index;            // this connection's records, in order
+    long long n, cap;
+    FILE *in, *out;
+    Histogram reads, writes, other;   // the reader's, with --timed disk replay
+    long long errors;            // requests the server answered with a failure
+    long long lag_max, lag_sum;  // --timed: nsec sent after the request was due
+    int failed;
+
+    // --timed disk replay: sent pieces, oldest first, shared with the reader
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Pending *pending;            // NULL: closed loop
+    int head, count;
+    unsigned int next_tag;
+    int sending_done;
+    int reader_lost;             // the reader lost the server
+} Replayer;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(long long t) {
+    struct timespec ts = { t / 1000000000LL, t % 1000000000LL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+static int connect_server(void) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_ip, &addr.sin_addr) <= 0) {
+        perror("inet_pton");
+        close(sock);
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(sock);
+        return -1;
+    }
+
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return sock;
+}
+
+// Separate read and write streams over one socket, as the servers use
+static int open_streams(Replayer *r) {
+    int fd = connect_server();
+    if (fd < 0)
+        return 0;
+    r->in = fdopen(fd, "r");
+    r->out = r->in ? fdopen(dup(fd), "w") : NULL;
+    if (!r->in || !r->out) {
+        perror("fdopen");
+        if (r->in)
+            fclose(r->in);
+        else
+            close(fd);
+        r->in = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// "<cylinders> <sectors> <block size>"; older servers omit the block size
+static int read_geometry(void) {
+    int fd = connect_server();
+    if (fd < 0)
+        return 0;
+    char info[MAX_LINE];
+    int n = 0;
+    if (send(fd, "I\n", 2, 0) == 2) {
+        while (n < MAX_LINE - 1 && recv(fd, info + n, 1, 0) == 1 && info[n] != '\n')
+            n++;
+    }
+    info[n] = '\0';
+    close(fd);
+    if (sscanf(info, "%lld %lld %d", &num_cyl, &sectors_per_cyl, &block_size) < 2 ||
+        num_cyl <= 0 || sectors_per_cyl <= 0 || block_size <= 0) {
+        fprintf(stderr, "Failed to read disk geometry\n");
+        return 0;
+    }
+    total_blocks = num_cyl * sectors_per_cyl;
+    max_range_blocks = MAX_RANGE_BYTES / block_size < MAX_RANGE_BLOCKS ?
+                       MAX_RANGE_BYTES / block_size : MAX_RANGE_BLOCKS;
+    return 1;
+}
+
+// Status byte, then the data of a successful read. -1: connection lost.
+static int disk_reply(Replayer *r, long long data_len) {
+    unsigned char sink[4096];
+    int status = fgetc(r->in);
+    if (status == EOF)
+        return -1;
+    if (status != '1')
+        return 0;
+    while (data_len > 0) {
+        size_t chunk = data_len < (long long)sizeof(sink) ? (size_t)data_len : sizeof(sink);
+        if (fread(sink, 1, chunk, r->in) != chunk)
+            return -1;
+        data_len -= chunk;
+    }
+    return 1;
+}
+
+static Histogram *op_hist(Replayer *r, int op) {
+    return op == 'R' || op == 'G' ? &r->reads :
+           op == 'W' || op == 'A' || op == 'P' ? &r->writes : &r->other;
+}
+
+// --timed: the tag for the piece about to be written
+static void disk_tag(Replayer *r) {
+    if (r->pending)
+        fprintf(r->out, "T %u ", r->next_tag);
+}
+
+// A piece of rec has been written. Closed loop: send it and fold its reply
+// into *ok. Timed: queue it for the reader, waiting while the window is
+// full, and send it with the record's last piece. 0 if the connection was
+// lost.
+static int disk_sent(Replayer *r, const Op *rec, long long data_len, int last,
+                     long long sent_ns, int *ok) {
+    if (!r->pending) {
+        fflush(r->out);
+        int rc = disk_reply(r, data_len);
+        *ok &= rc > 0;
+        return rc >= 0;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    while (r->count == MAX_OUTSTANDING && !r->reader_lost) {
+        // Let the reader catch up on what's already written
+        pthread_mutex_unlock(&r->lock);
+        fflush(r->out);
+        pthread_mutex_lock(&r->lock);
+        if (r->count == MAX_OUTSTANDING && !r->reader_lost)
+            pthread_cond_wait(&r->cond, &r->lock);
+    }
+    int lost = r->reader_lost;
+    if (!lost) {
+        Pending *p = &r->pending[(r->head + r->count) % MAX_OUTSTANDING];
+        p->tag = r->next_tag++;
+        p->op = rec->op;
+        p->last = last;
+        p->data_len = data_len;
+        p->sent_ns = sent_ns;
+        r->count++;
+        pthread_cond_signal(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    if (last)
+        fflush(r->out);
+    return !lost && !ferror(r->out);
+}
+
+// One traced disk request: ranges go out in pieces the target accepts.
+// Closed loop, each piece waits on the last. 0 if the connection was lost.
+static int replay_disk(Replayer *r, const Op *rec) {
+    long long lba = rec->addr % total_blocks;
+    long long left = rec->length > 0 ? rec->length : 1;
+    long long t0 = now_ns();
+    int ok = 1;
+
+    if (rec->op == 'F' || rec->op == 'D') {
+        disk_tag(r);
+        if (rec->op == 'F') {
+            fputs("F\n", r->out);
+        } else {
+            if (left > total_blocks - lba)
+                left = total_blocks - lba;
+            fprintf(r->out, "D %lld %lld %lld\n", lba / sectors_per_cyl, lba % sectors_per_cyl, left);
+        }
+        if (!disk_sent(r, rec, 0, 1, t0, &ok))
+            return 0;
+        if (!r->pending)
+            r->errors += !ok;
+        return 1;
+    }
+
+    int is_write = rec->op == 'W';
+    while (left > 0) {
+        long long n = left < max_range_blocks ? left : max_range_blocks;
+        if (n > total_blocks - lba)
+            n = total_blocks - lba;
+        long long c = lba / sectors_per_cyl, s = lba % sectors_per_cyl;
+        size_t len = (size_t)n * block_size;
+        disk_tag(r);
+        if (n == 1)
+            fprintf(r->out, is_write ? "W %lld %lld %d\n" : "R %lld %lld\n", c, s, block_size);
+        else
+            fprintf(r->out, is_write ? "WN %lld %lld %lld\n" : "RN %lld %lld %lld\n", c, s, n);
+        if (is_write && fwrite(payload, 1, len, r->out) != len)
+            return 0;
+        left -= n;
+        lba = (lba + n) % total_blocks;
+        if (!disk_sent(r, rec, is_write ? 0 : (long long)len, left == 0, t0, &ok))
+            return 0;
+    }
+    if (!r->pending)
+        r->errors += !ok;
+    return 1;
+}
+
+// --timed disk replay: the replies come back in the order the pieces went
+// out, so each is matched to the oldest pending one. A record's latency
+// runs until the reply to its last piece.
+static void *reader_main(void *arg) {
+    Replayer *r = arg;
+    int ok = 1;
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        while (r->count == 0 && !r->sending_done)
+            pthread_cond_wait(&r->cond, &r->lock);
+        if (r->count == 0) {
+            pthread_mutex_unlock(&r->lock);
+            break;
+        }
+        Pending p = r->pending[r->head];
+        pthread_mutex_unlock(&r->lock);
+
+        unsigned int tag;
+        int rc = -1;
+        if (fscanf(r->in, "%u", &tag) == 1 && tag == p.tag && fgetc(r->in) == ' ')
+            rc = disk_reply(r, p.data_len);
+
+        pthread_mutex_lock(&r->lock);
+        if (rc >= 0) {
+            r->head = (r->head + 1) % MAX_OUTSTANDING;
+            r->count--;
+        } else {
+            r->reader_lost = 1;
+        }
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        if (rc < 0)
+            break;
+
+        ok &= rc;
+        if (p.last) {
+            r->errors += !ok;
+            ok = 1;
+            hist_record(op_hist(r, p.op), (now_ns() - p.sent_ns) / 1000);
+        }
+    }
+    return NULL;
+}
+
+// --timed disk replay: start the reader. 0 if it couldn't be.
+static int start_reader(Replayer *r) {
+    r->pending = malloc(MAX_OUTSTANDING * sizeof(Pending));
+    if (!r->pending) {
+        perror("malloc");
+        return 0;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    if (pthread_create(&r->reader, NULL, reader_main, r) != 0) {
+        perror("pthread_create");
+        free(r->pending);
+        r->pending = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// Wait for the reader to collect every reply, or to lose the server
+static void stop_reader(Replayer *r) {
+    fflush(r->out);
+    pthread_mutex_lock(&r->lock);
+    r->sending_done = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    // Wake a reader still waiting on replies that will never come
+    if (r->failed)
+        shutdown(fileno(r->in), SHUT_RDWR);
+    pthread_join(r->reader, NULL);
+    if (r->reader_lost && !r->failed) {
+        fprintf(stderr, "connection %u: lost the server\n", r->client);
+        r->failed = 1;
+    }
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    free(r->pending);
+    r->pending = NULL;
+}
+
+// One traced filesystem command. 0 if the connection was lost.
+static int replay_fs(Replayer *r, const Op *rec) {
+    char line[MAX_LINE];
+    int rc = 2;
+    switch (rec->op) {
+    case 'F':
+        if (rec->addr > 0)
+            fprintf(r->out, "F %lld %lld\n", rec->length, rec->addr - 1);
+        else if (rec->length > 0)
+            fprintf(r->out, "F %lld\n", rec->length);
+        else
+            fputs("F\n", r->out);
+        break;
+    case 'C':
+    case 'D':
+    case 'R':
+        fprintf(r->out, "%c %s\n", rec->op, rec->name ? rec->name : "");
+        break;
+    case 'L':
+        fprintf(r->out, "L %d\n", rec->length != 0);
+        break;
+    case 'W':
+    case 'A':
+    case 'P':
+        if (rec->op == 'P')
+            fprintf(r->out, "P %s %lld %lld\n", rec->name ? rec->name : "", rec->addr, rec->length);
+        else
+            fprintf(r->out, "%c %s %lld\n", rec->op, rec->name ? rec->name : "", rec->length);
+        for (long long left = rec->length; left > 0; ) {
+            size_t chunk = left < MAX_RANGE_BYTES ? (size_t)left : MAX_RANGE_BYTES;
+            if (fwrite(payload, 1, chunk, r->out) != chunk)
+                return 0;
+            left -= chunk;
+        }
+        break;
+    case 'T':
+        fprintf(r->out, "T %s %lld\n", rec->name ? rec->name : "", rec->length);
+        break;
+    case 'G':
+        fprintf(r->out, "G %s %lld %lld\n", rec->name ? rec->name : "", rec->addr, rec->length);
+        break;
+    default:
+        return 1;                // nothing to replay
+    }
+    fflush(r->out);
+
+    if (rec->op == 'R' || rec->op == 'G') {
+        // "<rc> <len> <data>\n", with data only if rc is 0
+        int len;
+        if (fscanf(r->in, "%d %d", &rc, &len) != 2 || fgetc(r->in) != ' ')
+            return 0;
+        for (int i = 0; rc == 0 && i < len; i++) {
+            if (fgetc(r->in) == EOF)
+                return 0;
+        }
+        if (fgetc(r->in) != '\n')
+            return 0;
+    } else {
+        if (!fgets(line, sizeof(line), r->in) || sscanf(line, "%d", &rc) != 1)
+            return 0;
+        // L: the names, then "END"
+        while (rec->op == 'L' && strcmp(line, "END\n") != 0) {
+            if (!fgets(line, sizeof(line), r->in))
+                return 0;
+        }
+    }
+    r->errors += rc != 0;
+    return 1;
+}
+
+static void *replayer_main(void *arg) {
+    Replayer *r = arg;
+    if (!open_streams(r))
+        r->failed = 1;
+    else if (timed && header.kind == 'D' && !start_reader(r))
+        r->failed = 1;
+    pthread_barrier_wait(&start_barrier);
+    long long zero = 0;
+    __atomic_compare_exchange_n(&start_ns, &zero, now_ns(), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    for (long long i = 0; i < r->n && !r->failed; i++) {
+        const Op *rec = &records[r->index[i]];
+        if (timed) {
+            long long due = start_ns + (long long)(rec->usec * 1000.0 / speed);
+            sleep_until(due);
+            long long lag = now_ns() - due;
+            r->lag_sum += lag;
+            if (lag > r->lag_max)
+                r->lag_max = lag;
+        }
+        long long t0 = now_ns();
+        int ok = header.kind == 'D' ? replay_disk(r, rec) : replay_fs(r, rec);
+        if (!ok) {
+            fprintf(stderr, "connection %u: lost the server\n", r->client);
+            r->failed = 1;
+            break;
+        }
+        if (!r->pending)
+            hist_record(op_hist(r, rec->op), (now_ns() - t0) / 1000);
+    }
+
+    if (r->pending)
+        stop_reader(r);
+    if (r->in) {
+        fclose(r->out);
+        fclose(r->in);
+    }
+    return NULL;
+}
+
+static int load_trace(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror("open trace");
+        return 0;
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, "TRC1", 4) != 0 ||
+        (header.kind != 'D' && header.kind != 'F')) {
+        fprintf(stderr, "%s is not a trace\n", path);
+        fclose(f);
+        return 0;
+    }
+    size_t cap = 1 << 20, len = 0;
+    unsigned char *buf = malloc(cap);
+    size_t n;
+    while (buf && (n = fread(buf + len, 1, cap - len, f)) > 0) {
+        len += n;
+        if (len == cap)
+            buf = realloc(buf, cap *= 2);
+    }
+    fclose(f);
+    if (!buf) {
+        perror("malloc");
+        return 0;
+    }
+
+    // Count, then decode
+    const unsigned char *p = buf, *end = buf + len;
+    TraceRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    while (trace_next(&p, end, &rec))
+        nrecords++;
+    if (p != end)
+        fprintf(stderr, "Trace ends with a partial record; replaying the %lld before it\n", nrecords);
+    records = calloc(nrecords + 1, sizeof(Op));
+    if (!records) {
+        perror("calloc");
+        free(buf);
+        return 0;
+    }
+    p = buf;
+    memset(&rec, 0, sizeof(rec));
+    for (long long i = 0; i < nrecords && trace_next(&p, end, &rec); i++) {
+        Op *op = &records[i];
+        op->usec = rec.usec;
+        op->addr = rec.addr;
+        op->length = rec.length;
+        op->client = rec.client;
+        op->op = rec.op;
+        if (rec.name[0] && !(op->name = strdup(rec.name))) {
+            perror("strdup");
+            free(buf);
+            return 0;
+        }
+    }
+    free(buf);
+
+    // Time runs from the first request, not from when the server started
+    for (long long i = nrecords - 1; i >= 0; i--)
+        records[i].usec -= records[0].usec;
+    return 1;
+}
+
+// Group the records by connection, in order of each one's first request
+static Replayer *split_clients(int *nclients) {
+    unsigned int max_client = 0;
+    for (long long i = 0; i < nrecords; i++) {
+        if (records[i].client > max_client)
+            max_client = records[i].client;
+    }
+    int *slot = malloc(((size_t)max_client + 1) * sizeof(int));
+    Replayer *rs = calloc((size_t)max_client + 1, sizeof(Replayer));
+    if (!slot || !rs) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(slot, 0xff, ((size_t)max_client + 1) * sizeof(int));
+    int n = 0;
+    for (long long i = 0; i < nrecords; i++) {
+        unsigned int c = records[i].client;
+        if (slot[c] < 0) {
+            slot[c] = n;
+            rs[n++].client = c;
+        }
+        Replayer *r = &rs[slot[c]];
+        if (r->n == r->cap) {
+            r->cap = r->cap ? r->cap * 2 : 64;
+            r->index = realloc(r->index, r->cap * sizeof(long long));
+            if (!r->index) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        r->index[r->n++] = i;
+    }
+    free(slot);
+    *nclients = n;
+    return rs;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--timed] [--speed X] [--format text|json] <server_ip> <port> <trace_file>\n"
+            "  --timed: keep the trace's timing; --speed X: X times as fast (implies --timed)\n",
+            prog);
+}
+
+static void print_latency_json(const char *name, const Histogram *h, int last) {
+    printf("    \"%s\": {\"ops\": %lld, \"mean\": %.1f, \"p50\": %lld, \"p99\": %lld, "
+           "\"p999\": %lld, \"max\": %lld}%s\n",
+           name, h->total, hist_mean(h), hist_percentile(h, 0.5), hist_percentile(h, 0.99),
+           hist_percentile(h, 0.999), h->max, last ? "" : ",");
+}
+
+int main(int argc, char *argv[]) {
+    char *args[4];
+    int nargs = 0;
+    int bad = 0;
+    for (int i = 0; i < argc; i++) {
+        const char *opt = argv[i];
+        int has_value = i + 1 < argc;
+        if (strcmp(opt, "--timed") == 0) {
+            timed = 1;
+        } else if (strcmp(opt, "--speed") == 0 && has_value) {
+            speed = atof(argv[++i]);
+            timed = 1;
+        } else if (strcmp(opt, "--format") == 0 && has_value) {
+            const char *f = argv[++i];
+            format = strcmp(f, "json") == 0 ? FORMAT_JSON : strcmp(f, "text") == 0 ? FORMAT_TEXT : -1;
+            bad |= format < 0;
+        } else if (nargs < 4) {
+            args[nargs++] = argv[i];
+        } else {
+            nargs++;
+        }
+    }
+    if (bad || nargs != 4 || speed <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    server_ip = args[1];
+    port = atoi(args[2]);
+
+    if (!load_trace(args[3]))
+        return 1;
+    int nclients;
+    Replayer *rs = split_clients(&nclients);
+    double trace_secs = nrecords ? records[nrecords - 1].usec / 1e6 : 0.0;
+    if (format == FORMAT_TEXT)
+        printf("Trace: %s server, %lld requests from %d connections over %.3f s\n",
+               header.kind == 'D' ? "disk" : "filesystem", nrecords, nclients, trace_secs);
+
+    // Writes carry a pattern; the largest disk range or filesystem chunk
+    if (header.kind == 'D') {
+        if (!read_geometry())
+            return 1;
+        if (format == FORMAT_TEXT && header.block_size != block_size)
+            printf("Traced with %d-byte blocks, replaying with %d-byte blocks\n",
+                   header.block_size, block_size);
+    }
+    payload = malloc(MAX_RANGE_BYTES);
+    pthread_t *tids = calloc(nclients, sizeof(pthread_t));
+    if (!payload || !tids) {
+        perror("malloc");
+        return 1;
+    }
+    for (int i = 0; i < MAX_RANGE_BYTES; i++)
+        payload[i] = 'A' + i % 26;
+
+    // A server vanishing mid-write is handled where the write fails
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_barrier_init(&start_barrier, NULL, nclients + 1);
+    for (int i = 0; i < nclients; i++) {
+        if (pthread_create(&tids[i], NULL, replayer_main, &rs[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    // The first one past the barrier starts the clock
+    pthread_barrier_wait(&start_barrier);
+    long long zero = 0;
+    __atomic_compare_exchange_n(&start_ns, &zero, now_ns(), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < nclients; i++)
+        pthread_join(tids[i], NULL);
+    double secs = (now_ns() - start_ns) / 1e9;
+
+    Histogram *all = calloc(4, sizeof(Histogram));
+    if (!all) {
+        perror("calloc");
+        return 1;
+    }
+    Histogram *reads = &all[1], *writes = &all[2], *other = &all[3];
+    long long errors = 0, lag_sum = 0, lag_max = 0;
+    int failed = 0;
+    for (int i = 0; i < nclients; i++) {
+        hist_merge(reads, &rs[i].reads);
+        hist_merge(writes, &rs[i].writes);
+        hist_merge(other, &rs[i].other);
+        errors += rs[i].errors;
+        failed += rs[i].failed;
+        lag_sum += rs[i].lag_sum;
+        if (rs[i].lag_max > lag_max)
+            lag_max = rs[i].lag_max;
+    }
+    hist_merge(all, reads);
+    hist_merge(all, writes);
+    hist_merge(all, other);
+    long long done = all->total;
+    double ops_per_sec = secs > 0 ? done / secs : 0.0;
+    double lag_mean_us = done ? lag_sum / 1e3 / done : 0.0;
+    const char *mode = timed ? "timed" : "fast";
+
+    if (format == FORMAT_JSON) {
+        printf("{\n");
+        printf("  \"kind\": \"%s\", \"mode\": \"%s\", \"speed\": %.3f, \"connections\": %d,\n",
+               header.kind == 'D' ? "disk" : "filesystem", mode, speed, nclients);
+        printf("  \"trace_requests\": %lld, \"trace_seconds\": %.3f,\n", nrecords, trace_secs);
+        printf("  \"ops\": %lld, \"errors\": %lld, \"failed_connections\": %d,\n", done, errors, failed);
+        printf("  \"seconds\": %.3f, \"ops_per_sec\": %.1f,\n", secs, ops_per_sec);
+        if (timed)
+            printf("  \"lag_usec\": {\"mean\": %.1f, \"max\": %lld},\n", lag_mean_us, lag_max / 1000);
+        printf("  \"latency_usec\": {\n");
+        print_latency_json("all", all, 0);
+        print_latency_json("read", reads, 0);
+        print_latency_json("write", writes, 0);
+        print_latency_json("other", other, 1);
+        printf("  }\n}\n");
+    } else {
+        printf("%lld ops in %.3f s (%.1f ops/s), %d connections, %s", done, secs, ops_per_sec,
+               nclients, mode);
+        if (timed)
+            printf(" at %.2fx", speed);
+        printf("\n");
+        if (timed)
+            printf("sent late by %.1f usec on average, %lld at most\n", lag_mean_us, lag_max / 1000);
+        printf("%-6s %8s %10s %8s %8s %8s %8s  (usec)\n", "", "ops", "mean", "p50", "p99", "p99.9", "max");
+        const char *names[] = { "all", "read", "write", "other" };
+        for (int k = 0; k < 4; k++) {
+            const Histogram *h = &all[k];
+            printf("%-6s %8lld %10.1f %8lld %8lld %8lld %8lld\n", names[k], h->total,
+                   hist_mean(h), hist_percentile(h, 0.5), hist_percentile(h, 0.99),
+                   hist_percentile(h, 0.999), h->max);
+        }
+        if (errors > 0)
+            printf("%lld requests failed\n", errors);
+        if (failed > 0)
+            printf("%d connections failed\n", failed);
+    }
+
+    for (int i = 0; i < nclients; i++)
+        free(rs[i].index);
+    free(rs);
+    free(tids);
+    free(all);
+    free(payload);
+    for (long long i = 0; i < nrecords; i++)
+        free(records[i].name);
+    free(records);
+    return failed > 0;
+}